@@ -0,0 +1,440 @@
+
+// viscal benchmarks
+//
+// generates synthetic calendars and times the load, sort, layout and draw
+// paths against an offscreen cairo surface. results are printed one json
+// object per line so they can be collected and compared across releases:
+//
+//   make bench
+//   ./viscal-bench --events 20000 --calendars 30 > results.json
+//   ./viscal-bench gen --events 500 > big.ics
+
+#define _DEFAULT_SOURCE
+#define VISCAL_NO_MAIN
+#include "viscal.c"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct bench_opts {
+	int events;
+	int calendars;
+	int days;
+	int iterations;
+	int timezones;
+	double overlap;
+	double recurrence;
+	int width, height;
+	unsigned int seed;
+};
+
+struct bench_event {
+	time_t start, end;
+	int tz;
+	int recurring;
+};
+
+static const char *bench_timezones[] = {
+	"UTC",
+	"America/Vancouver",
+	"America/New_York",
+	"Europe/London",
+	"Europe/Berlin",
+	"Asia/Tokyo",
+	"Australia/Sydney",
+	"America/Sao_Paulo",
+};
+
+static void bench_usage()
+{
+	printf("usage: viscal-bench [gen] [options]\n"
+	       "\n"
+	       "  --events N        number of events (default 5000)\n"
+	       "  --calendars N     spread events over N calendars (default 8)\n"
+	       "  --days N          spread events over N days around today (default 14)\n"
+	       "  --overlap F       chance an event overlaps the previous one (default 0.2)\n"
+	       "  --recurrence F    fraction of events with an RRULE (default 0.1)\n"
+	       "  --timezones N     number of TZIDs to mix (1-%d, default 4)\n"
+	       "  --iterations N    iterations per benchmark (default 20)\n"
+	       "  --size WxH        offscreen surface size (default 1920x1080)\n"
+	       "  --seed N          random seed (default 42)\n"
+	       "  --verbose         enable viscal's debug logging on stderr\n",
+	       (int)ARRAY_SIZE(bench_timezones));
+	exit(1);
+}
+
+static double now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double bench_rand(unsigned int *seed)
+{
+	return (double)rand_r(seed) / RAND_MAX;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double*)a;
+	double db = *(const double*)b;
+	return (da > db) - (da < db);
+}
+
+// lay events out day by day starting in the morning. each event either
+// starts after the previous one or, with probability `overlap`, inside it
+static struct bench_event *bench_schedule(struct bench_opts *opts)
+{
+	struct bench_event *evs, *ev, *prev = NULL;
+	unsigned int seed = opts->seed;
+	int per_day = max(1, (opts->events + opts->days - 1) / opts->days);
+	time_t today = time(NULL) / DAY_SECONDS * DAY_SECONDS;
+	time_t day = today - (opts->days / 2) * DAY_SECONDS;
+	time_t at = day + 7 * 60 * 60;
+	int i, len;
+
+	evs = calloc(opts->events, sizeof(*evs));
+	assert(evs);
+
+	for (i = 0; i < opts->events; i++) {
+		ev = &evs[i];
+
+		if (i > 0 && i % per_day == 0) {
+			day += DAY_SECONDS;
+			at = day + 7 * 60 * 60;
+			prev = NULL;
+		}
+
+		len = (3 + rand_r(&seed) % 22) * SMALLEST_TIMEBLOCK * 60;
+
+		if (prev && bench_rand(&seed) < opts->overlap)
+			at = prev->start + (rand_r(&seed) % (int)(prev->end - prev->start + 1))
+				/ (SMALLEST_TIMEBLOCK * 60) * (SMALLEST_TIMEBLOCK * 60);
+
+		ev->start = at;
+		ev->end = at + len;
+		ev->tz = rand_r(&seed) % opts->timezones;
+		ev->recurring = bench_rand(&seed) < opts->recurrence;
+
+		at = ev->end + (rand_r(&seed) % 4) * 15 * 60;
+		prev = ev;
+	}
+
+	return evs;
+}
+
+static void format_ics_time(char *buf, int bufsize, time_t t, int tz)
+{
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(buf, bufsize, tz == 0 ? "%Y%m%dT%H%M%SZ" : "%Y%m%dT%H%M%S", &tm);
+}
+
+static void write_ics_time(FILE *out, const char *prop, time_t t, int tz)
+{
+	char buf[32];
+
+	format_ics_time(buf, sizeof(buf), t, tz);
+
+	if (tz == 0)
+		fprintf(out, "%s:%s\r\n", prop, buf);
+	else
+		fprintf(out, "%s;TZID=%s:%s\r\n", prop, bench_timezones[tz], buf);
+}
+
+// write every event that belongs to calendar `ind`
+static void bench_write_calendar(FILE *out, struct bench_opts *opts,
+				 struct bench_event *evs, int ind)
+{
+	struct bench_event *ev;
+
+	fprintf(out, "BEGIN:VCALENDAR\r\n"
+		     "VERSION:2.0\r\n"
+		     "PRODID:-//viscal//bench//EN\r\n");
+
+	for (int i = ind; i < opts->events; i += opts->calendars) {
+		ev = &evs[i];
+
+		fprintf(out, "BEGIN:VEVENT\r\n"
+			     "UID:bench-%d-%d@viscal\r\n"
+			     "DTSTAMP:20200101T000000Z\r\n", ind, i);
+		write_ics_time(out, "DTSTART", ev->start, ev->tz);
+		write_ics_time(out, "DTEND", ev->end, ev->tz);
+		fprintf(out, "SUMMARY:bench event %d\r\n", i);
+
+		if (ev->recurring)
+			fprintf(out, "RRULE:FREQ=WEEKLY;COUNT=10\r\n");
+
+		fprintf(out, "END:VEVENT\r\n");
+	}
+
+	fprintf(out, "END:VCALENDAR\r\n");
+}
+
+static char **bench_write_calendars(struct bench_opts *opts, char *dir)
+{
+	struct bench_event *evs = bench_schedule(opts);
+	char **paths = calloc(opts->calendars, sizeof(char*));
+	FILE *out;
+
+	assert(paths);
+
+	for (int i = 0; i < opts->calendars; i++) {
+		paths[i] = malloc(strlen(dir) + 32);
+		assert(paths[i]);
+		sprintf(paths[i], "%s/bench-%d.ics", dir, i);
+
+		out = fopen(paths[i], "w");
+		assert(out);
+		bench_write_calendar(out, opts, evs, i);
+		fclose(out);
+	}
+
+	free(evs);
+	return paths;
+}
+
+static void bench_unload(struct cal *cal)
+{
+	for (int i = 0; i < cal->ncalendars; i++) {
+		icalcomponent_free(cal->calendars[i].calendar);
+		free(cal->calendars[i].events);
+	}
+
+	cal->ncalendars = 0;
+	cal->nevents = 0;
+	cal->selected_event_ind = -1;
+	cal->target = -1;
+}
+
+static void bench_report(struct bench_opts *opts, const char *name,
+			 double *samples, int n)
+{
+	double sum = 0;
+
+	qsort(samples, n, sizeof(double), cmp_double);
+
+	for (int i = 0; i < n; i++)
+		sum += samples[i];
+
+	printf(
+		"{\"bench\":\"%s\",\"events\":%d,\"calendars\":%d,"
+		"\"overlap\":%g,\"recurrence\":%g,\"timezones\":%d,"
+		"\"width\":%d,\"height\":%d,\"iterations\":%d,"
+		"\"mean_us\":%.1f,\"median_us\":%.1f,"
+		"\"min_us\":%.1f,\"max_us\":%.1f}\n",
+		name, opts->events, opts->calendars,
+		opts->overlap, opts->recurrence, opts->timezones,
+		opts->width, opts->height, n,
+		sum / n, samples[n/2], samples[0], samples[n-1]);
+	fflush(stdout);
+}
+
+static void mark_all_dirty(struct cal *cal)
+{
+	for (int i = 0; i < cal->ncalendars; i++)
+		cal->calendars[i].dirty = true;
+}
+
+static void mark_first_dirty(struct cal *cal)
+{
+	cal->calendars[0].dirty = true;
+}
+
+static void bench_view(struct bench_opts *opts, struct cal *cal,
+		       const char *name, void (*prepare)(struct cal *))
+{
+	double *samples = calloc(opts->iterations, sizeof(double));
+	double t;
+
+	for (int i = 0; i < opts->iterations; i++) {
+		if (prepare)
+			prepare(cal);
+		t = now_us();
+		on_change_view(cal);
+		samples[i] = now_us() - t;
+	}
+
+	bench_report(opts, name, samples, opts->iterations);
+	free(samples);
+}
+
+static void run_benchmarks(struct bench_opts *opts, char **paths)
+{
+	static struct cal cal;
+	double *samples = calloc(opts->iterations, sizeof(double));
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	struct render r;
+	icalcomponent *calendar;
+	struct busy *busy = NULL;
+	double t;
+	int i, j, busy_size = 0;
+
+	assert(samples);
+
+	calendar_create(&cal);
+
+	// parse only, one calendar after another
+	for (i = 0; i < opts->iterations; i++) {
+		t = now_us();
+		for (j = 0; j < opts->calendars; j++) {
+			calendar = calendar_parse_file(paths[j]);
+			samples[i] += now_us() - t;
+			icalcomponent_free(calendar);
+			t = now_us();
+		}
+	}
+	bench_report(opts, "parse_serial", samples, opts->iterations);
+
+	// the full startup pipeline: parallel parse + per-calendar sort + merge
+	for (i = 0; i < opts->iterations; i++) {
+		t = now_us();
+		calendars_load(&cal, paths, opts->calendars);
+		on_change_view(&cal);
+		samples[i] = now_us() - t;
+
+		if (i != opts->iterations - 1)
+			bench_unload(&cal);
+	}
+	bench_report(opts, "calendar_load", samples, opts->iterations);
+
+	bench_view(opts, &cal, "events_for_view_all_dirty", mark_all_dirty);
+	bench_view(opts, &cal, "events_for_view_one_dirty", mark_first_dirty);
+	bench_view(opts, &cal, "events_for_view_merge", NULL);
+
+	// a quarter around today across every calendar
+	for (i = 0; i < opts->iterations; i++) {
+		t = now_us();
+		freebusy(&cal, cal.today - 45 * DAY_SECONDS,
+			 cal.today + 45 * DAY_SECONDS, &busy, &busy_size);
+		samples[i] = now_us() - t;
+	}
+	bench_report(opts, "freebusy_quarter", samples, opts->iterations);
+	free(busy);
+
+	surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+					     opts->width, opts->height);
+	cr = cairo_create(surface);
+
+	render_cairo(&r, cr);
+	calendar_prepare_draw(&cal, opts->width, opts->height);
+	cal.refresh_events = 0;
+
+	for (i = 0; i < opts->iterations; i++) {
+		t = now_us();
+		update_calendar(&cal);
+		samples[i] = now_us() - t;
+	}
+	bench_report(opts, "update_calendar", samples, opts->iterations);
+
+	for (i = 0; i < opts->iterations; i++) {
+		t = now_us();
+		draw_calendar(&r, &cal);
+		cairo_surface_flush(surface);
+		samples[i] = now_us() - t;
+	}
+	bench_report(opts, "draw_calendar", samples, opts->iterations);
+
+	cairo_destroy(cr);
+	cairo_surface_destroy(surface);
+	bench_unload(&cal);
+	free(samples);
+}
+
+static void parse_size(const char *str, int *w, int *h)
+{
+	if (sscanf(str, "%dx%d", w, h) != 2 || *w <= 0 || *h <= 0)
+		bench_usage();
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_opts opts = {
+		.events = 5000,
+		.calendars = 8,
+		.days = 14,
+		.iterations = 20,
+		.timezones = 4,
+		.overlap = 0.2,
+		.recurrence = 0.1,
+		.width = 1920,
+		.height = 1080,
+		.seed = 42,
+	};
+	int gen = 0, verbose = 0;
+	char dir[] = "/tmp/viscal-bench-XXXXXX";
+	char **paths;
+	struct bench_event *evs;
+	const char *arg;
+
+	for (int i = 1; i < argc; i++) {
+		arg = argv[i];
+
+		if (!strcmp(arg, "gen"))
+			gen = 1;
+		else if (!strcmp(arg, "--verbose"))
+			verbose = 1;
+		else if (i + 1 == argc)
+			bench_usage();
+		else if (!strcmp(arg, "--events"))
+			opts.events = atoi(argv[++i]);
+		else if (!strcmp(arg, "--calendars"))
+			opts.calendars = atoi(argv[++i]);
+		else if (!strcmp(arg, "--days"))
+			opts.days = atoi(argv[++i]);
+		else if (!strcmp(arg, "--overlap"))
+			opts.overlap = atof(argv[++i]);
+		else if (!strcmp(arg, "--recurrence"))
+			opts.recurrence = atof(argv[++i]);
+		else if (!strcmp(arg, "--timezones"))
+			opts.timezones = atoi(argv[++i]);
+		else if (!strcmp(arg, "--iterations"))
+			opts.iterations = atoi(argv[++i]);
+		else if (!strcmp(arg, "--size"))
+			parse_size(argv[++i], &opts.width, &opts.height);
+		else if (!strcmp(arg, "--seed"))
+			opts.seed = atoi(argv[++i]);
+		else
+			bench_usage();
+	}
+
+	if (opts.events <= 0 || opts.calendars <= 0 || opts.days <= 0 ||
+	    opts.iterations <= 0 || opts.timezones <= 0 ||
+	    opts.timezones > (int)ARRAY_SIZE(bench_timezones) ||
+	    opts.calendars > (int)ARRAY_SIZE(((struct cal*)0)->calendars))
+		bench_usage();
+
+	if (gen) {
+		opts.calendars = 1;
+		evs = bench_schedule(&opts);
+		bench_write_calendar(stdout, &opts, evs, 0);
+		free(evs);
+		return 0;
+	}
+
+	// viscal logs to stderr, results go to stdout
+	log_init();
+	g_log_level = verbose ? LOG_DEBUG : LOG_WARN;
+
+	timezones_init();
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	paths = bench_write_calendars(&opts, dir);
+
+	run_benchmarks(&opts, paths);
+
+	for (int i = 0; i < opts.calendars; i++) {
+		unlink(paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+	rmdir(dir);
+
+	return 0;
+}
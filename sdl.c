@@ -0,0 +1,696 @@
+// viscal on SDL2
+//
+// a gtk-free window for tiling wm users. the calendar is drawn through the
+// same render calls as the gtk window, but everything in a frame goes into
+// one vertex batch and one SDL_RenderGeometry call. glyphs are rasterized
+// once with pango into an atlas texture which also has a white texel for
+// the untextured rects, so a frame is a single draw. works on the software
+// renderer when there's no gpu:
+//
+//   make SDL=1 viscal-sdl
+//   ./viscal-sdl calendar.ics ...
+//   SDL_RENDER_DRIVER=software ./viscal-sdl calendar.ics ...
+//
+// needs SDL 2.0.18 or newer for SDL_RenderGeometry
+
+#define _DEFAULT_SOURCE
+#define VISCAL_NO_MAIN
+#include "viscal.c"
+
+#include <SDL.h>
+
+#define ATLAS_SIZE 1024
+#define ATLAS_GLYPHS 4096
+
+struct glyph {
+	PangoFont *font;
+	PangoGlyph id;
+	// offset from the pen position to the top left of the bitmap
+	int left, top;
+	int x, y, w, h;
+};
+
+struct sdl_render {
+	SDL_Renderer *renderer;
+	SDL_Texture *atlas;
+	SDL_Color color;
+
+	SDL_Vertex *verts;
+	int *indices;
+	int nverts, verts_size;
+	int nindices, indices_size;
+
+	// shelf packing into the atlas
+	int shelf_x, shelf_y, shelf_h;
+	struct glyph glyphs[ATLAS_GLYPHS];
+	int nglyphs;
+};
+
+static Uint8 color_byte(double c)
+{
+	return (Uint8)lround(min(1.0, max(0.0, c)) * 255.0);
+}
+
+static void sdl_flush(struct sdl_render *sdl)
+{
+	if (sdl->nindices == 0)
+		return;
+
+	SDL_RenderGeometry(sdl->renderer, sdl->atlas, sdl->verts, sdl->nverts,
+			   sdl->indices, sdl->nindices);
+
+	sdl->nverts = 0;
+	sdl->nindices = 0;
+}
+
+// a textured quad, (u, v) and (u2, v2) are atlas pixels
+static void sdl_quad(struct sdl_render *sdl, double x, double y, double w,
+		     double h, double u, double v, double u2, double v2)
+{
+	SDL_Vertex *vert;
+	int *index;
+	int i, base = sdl->nverts;
+	static const int quad[] = { 0, 1, 2, 2, 1, 3 };
+
+	sdl->verts = grow_array(sdl->verts, &sdl->verts_size, base + 4,
+				sizeof(*sdl->verts));
+	sdl->indices = grow_array(sdl->indices, &sdl->indices_size,
+				  sdl->nindices + 6, sizeof(*sdl->indices));
+
+	for (i = 0; i < 4; i++) {
+		vert = &sdl->verts[base + i];
+		vert->position.x = x + (i & 1 ? w : 0);
+		vert->position.y = y + (i & 2 ? h : 0);
+		vert->tex_coord.x = (i & 1 ? u2 : u) / ATLAS_SIZE;
+		vert->tex_coord.y = (i & 2 ? v2 : v) / ATLAS_SIZE;
+		vert->color = sdl->color;
+	}
+
+	index = &sdl->indices[sdl->nindices];
+	for (i = 0; i < 6; i++)
+		index[i] = base + quad[i];
+
+	sdl->nverts += 4;
+	sdl->nindices += 6;
+}
+
+// the first atlas pixels are white and opaque, rects sample the middle
+static void sdl_atlas_reset(struct sdl_render *sdl)
+{
+	static Uint32 white[4] = { 0xffffffff, 0xffffffff,
+				   0xffffffff, 0xffffffff };
+	SDL_Rect rect = { 0, 0, 2, 2 };
+
+	sdl_flush(sdl);
+
+	memset(sdl->glyphs, 0, sizeof(sdl->glyphs));
+	sdl->nglyphs = 0;
+	sdl->shelf_x = 2;
+	sdl->shelf_y = 0;
+	sdl->shelf_h = 2;
+
+	SDL_UpdateTexture(sdl->atlas, &rect, white, 2 * sizeof(Uint32));
+}
+
+static bool sdl_atlas_place(struct sdl_render *sdl, int w, int h,
+			    int *x, int *y)
+{
+	if (sdl->shelf_x + w > ATLAS_SIZE) {
+		sdl->shelf_x = 0;
+		sdl->shelf_y += sdl->shelf_h;
+		sdl->shelf_h = 0;
+	}
+
+	if (sdl->shelf_y + h > ATLAS_SIZE || w > ATLAS_SIZE)
+		return false;
+
+	*x = sdl->shelf_x;
+	*y = sdl->shelf_y;
+	sdl->shelf_x += w;
+	sdl->shelf_h = max(sdl->shelf_h, h);
+
+	return true;
+}
+
+// false when the atlas is full
+static bool sdl_glyph_raster(struct sdl_render *sdl, struct glyph *glyph)
+{
+	PangoRectangle ink;
+	PangoGlyphString *glyphs;
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	Uint32 *pixels;
+	unsigned char *row;
+	int i, j, stride;
+	SDL_Rect rect;
+
+	pango_font_get_glyph_extents(glyph->font, glyph->id, &ink, NULL);
+	pango_extents_to_pixels(&ink, NULL);
+
+	// a pixel of padding so neighbours don't bleed in when scaled
+	glyph->left = ink.x - 1;
+	glyph->top = ink.y - 1;
+	glyph->w = ink.width + 2;
+	glyph->h = ink.height + 2;
+
+	if (!sdl_atlas_place(sdl, glyph->w, glyph->h, &glyph->x, &glyph->y)) {
+		if (sdl->nglyphs > 0)
+			return false;
+
+		// too big for even an empty atlas, draw nothing
+		glyph->x = glyph->y = glyph->w = glyph->h = 0;
+		return true;
+	}
+
+	surface = cairo_image_surface_create(CAIRO_FORMAT_A8, glyph->w,
+					     glyph->h);
+	cr = cairo_create(surface);
+
+	glyphs = pango_glyph_string_new();
+	pango_glyph_string_set_size(glyphs, 1);
+	memset(&glyphs->glyphs[0], 0, sizeof(glyphs->glyphs[0]));
+	glyphs->glyphs[0].glyph = glyph->id;
+
+	cairo_move_to(cr, -glyph->left, -glyph->top);
+	pango_cairo_show_glyph_string(cr, glyph->font, glyphs);
+	cairo_surface_flush(surface);
+
+	// white, with the glyph's coverage as alpha. the vertex color tints it
+	stride = cairo_image_surface_get_stride(surface);
+	row = cairo_image_surface_get_data(surface);
+	pixels = malloc(glyph->w * glyph->h * sizeof(*pixels));
+	assert(pixels);
+
+	for (j = 0; j < glyph->h; j++, row += stride) {
+		for (i = 0; i < glyph->w; i++)
+			pixels[j * glyph->w + i] = (Uint32)row[i] << 24 | 0xffffff;
+	}
+
+	rect.x = glyph->x;
+	rect.y = glyph->y;
+	rect.w = glyph->w;
+	rect.h = glyph->h;
+	SDL_UpdateTexture(sdl->atlas, &rect, pixels, glyph->w * sizeof(*pixels));
+
+	free(pixels);
+	pango_glyph_string_free(glyphs);
+	cairo_destroy(cr);
+	cairo_surface_destroy(surface);
+
+	return true;
+}
+
+static struct glyph *sdl_glyph(struct sdl_render *sdl, PangoFont *font,
+			       PangoGlyph id)
+{
+	guint hash = (g_direct_hash(font) * 31 + id) % ATLAS_GLYPHS;
+	struct glyph *glyph;
+
+	for (;;) {
+		glyph = &sdl->glyphs[hash];
+
+		if (glyph->font == font && glyph->id == id)
+			return glyph;
+
+		if (glyph->font == NULL)
+			break;
+
+		hash = (hash + 1) % ATLAS_GLYPHS;
+	}
+
+	glyph->font = font;
+	glyph->id = id;
+
+	// out of room, or the table is getting crowded. start over and
+	// rasterize whatever is used from here on again
+	if (sdl->nglyphs >= ATLAS_GLYPHS / 2 || !sdl_glyph_raster(sdl, glyph)) {
+		sdl_atlas_reset(sdl);
+		return sdl_glyph(sdl, font, id);
+	}
+
+	sdl->nglyphs++;
+
+	return glyph;
+}
+
+static void sdl_render_color(struct render *r, double red, double green,
+			     double blue, double alpha)
+{
+	struct sdl_render *sdl = r->data;
+
+	sdl->color.r = color_byte(red);
+	sdl->color.g = color_byte(green);
+	sdl->color.b = color_byte(blue);
+	sdl->color.a = color_byte(alpha);
+}
+
+static void sdl_render_rect(struct render *r, double x, double y, double w,
+			    double h)
+{
+	sdl_quad(r->data, x, y, w, h, 1, 1, 1, 1);
+}
+
+// one pixel dashes would be a quad per pixel, a dashed line is drawn at
+// half strength instead, which looks about the same
+static void sdl_render_hline(struct render *r, double x, double y, double w,
+			     double thickness, bool dash)
+{
+	struct sdl_render *sdl = r->data;
+	Uint8 alpha = sdl->color.a;
+
+	if (dash)
+		sdl->color.a /= 2;
+
+	sdl_quad(sdl, x, y - thickness / 2.0, w, thickness, 1, 1, 1, 1);
+	sdl->color.a = alpha;
+}
+
+static void sdl_render_text(struct render *r, double x, double y,
+			    const char *text, int width)
+{
+	struct sdl_render *sdl = r->data;
+	PangoLayout *layout = text_layout(text, width);
+	PangoLayoutIter *iter = pango_layout_get_iter(layout);
+	PangoLayoutRun *run;
+	PangoGlyphInfo *info;
+	PangoRectangle logical;
+	struct glyph *glyph;
+	int i, pen, baseline;
+
+	// pango's coordinates are from the layout's top left
+	y -= (double)pango_layout_get_baseline(layout) / PANGO_SCALE;
+
+	do {
+		run = pango_layout_iter_get_run_readonly(iter);
+		if (!run)
+			continue;
+
+		pango_layout_iter_get_run_extents(iter, NULL, &logical);
+		baseline = pango_layout_iter_get_baseline(iter);
+		pen = logical.x;
+
+		for (i = 0; i < run->glyphs->num_glyphs; i++) {
+			info = &run->glyphs->glyphs[i];
+
+			if (info->glyph != PANGO_GLYPH_EMPTY &&
+			    !(info->glyph & PANGO_GLYPH_UNKNOWN_FLAG)) {
+				glyph = sdl_glyph(sdl, run->item->analysis.font,
+						  info->glyph);
+
+				sdl_quad(sdl,
+					 round(x + (double)(pen + info->geometry.x_offset)
+					       / PANGO_SCALE) + glyph->left,
+					 round(y + (double)(baseline + info->geometry.y_offset)
+					       / PANGO_SCALE) + glyph->top,
+					 glyph->w, glyph->h,
+					 glyph->x, glyph->y,
+					 glyph->x + glyph->w, glyph->y + glyph->h);
+			}
+
+			pen += info->geometry.width;
+		}
+	} while (pango_layout_iter_next_run(iter));
+
+	pango_layout_iter_free(iter);
+}
+
+static void sdl_render_flush(struct render *r)
+{
+	sdl_flush(r->data);
+}
+
+static void sdl_render_clip(struct render *r, double x, double y, double w,
+			    double h)
+{
+	struct sdl_render *sdl = r->data;
+	SDL_Rect rect = { x, y, ceil(w), ceil(h) };
+
+	sdl_flush(sdl);
+	SDL_RenderSetClipRect(sdl->renderer, &rect);
+}
+
+static void sdl_render_unclip(struct render *r)
+{
+	struct sdl_render *sdl = r->data;
+
+	sdl_flush(sdl);
+	SDL_RenderSetClipRect(sdl->renderer, NULL);
+}
+
+static const struct render_ops sdl_render_ops = {
+	.color = sdl_render_color,
+	.rect = sdl_render_rect,
+	.hline = sdl_render_hline,
+	.text = sdl_render_text,
+	.clip = sdl_render_clip,
+	.unclip = sdl_render_unclip,
+	.flush = sdl_render_flush,
+};
+
+static SDL_Renderer *sdl_create_renderer(SDL_Window *window)
+{
+	SDL_Renderer *renderer;
+
+	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED |
+				      SDL_RENDERER_PRESENTVSYNC);
+	if (renderer)
+		return renderer;
+
+	log_info("no accelerated renderer (%s), using software",
+		 SDL_GetError());
+
+	return SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+}
+
+static int sdl_render_init(struct sdl_render *sdl, struct render *r,
+			   SDL_Window *window)
+{
+	memset(sdl, 0, sizeof(*sdl));
+
+	sdl->renderer = sdl_create_renderer(window);
+	if (!sdl->renderer)
+		return 0;
+
+	sdl->atlas = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_ARGB8888,
+				       SDL_TEXTUREACCESS_STATIC, ATLAS_SIZE,
+				       ATLAS_SIZE);
+	if (!sdl->atlas)
+		return 0;
+
+	SDL_SetTextureBlendMode(sdl->atlas, SDL_BLENDMODE_BLEND);
+	sdl_atlas_reset(sdl);
+
+	r->ops = &sdl_render_ops;
+	r->cr = NULL;
+	r->data = sdl;
+
+	return 1;
+}
+
+static void sdl_draw(struct sdl_render *sdl, struct render *r, struct cal *cal)
+{
+	Uint8 bg = color_byte(BGCOLOR);
+	int width, height;
+	gint64 trace = trace_begin();
+
+	SDL_GetRendererOutputSize(sdl->renderer, &width, &height);
+
+	calendar_prepare_draw(cal, width, height);
+	update_calendar(cal);
+
+	SDL_SetRenderDrawColor(sdl->renderer, bg, bg, bg, 255);
+	SDL_RenderClear(sdl->renderer);
+
+	draw_calendar(r, cal);
+
+	trace_end(TRACE_FRAME, trace);
+
+	if (g_trace_overlay)
+		draw_trace_overlay(r, cal);
+
+	SDL_RenderPresent(sdl->renderer);
+	cal->needs_draw = 0;
+}
+
+// gdk keyvals for the keys that don't type text
+static guint sdl_keyval(SDL_Keycode sym)
+{
+	if (sym >= SDLK_F1 && sym <= SDLK_F12)
+		return GDK_KEY_F1 + (sym - SDLK_F1);
+
+	switch (sym) {
+	case SDLK_ESCAPE: return GDK_KEY_Escape;
+	case SDLK_RETURN: return GDK_KEY_Return;
+	case SDLK_BACKSPACE: return GDK_KEY_BackSpace;
+	case SDLK_TAB: return GDK_KEY_Tab;
+	case SDLK_DELETE: return GDK_KEY_Delete;
+	case SDLK_LEFT: return GDK_KEY_Left;
+	case SDLK_RIGHT: return GDK_KEY_Right;
+	case SDLK_HOME: return GDK_KEY_Home;
+	case SDLK_END: return GDK_KEY_End;
+	}
+
+	return 0;
+}
+
+// what gdk would type for the key, see struct key_press
+static const char *sdl_key_string(SDL_Keycode sym, bool ctrl, char *buf)
+{
+	char c;
+
+	switch (sym) {
+	case SDLK_ESCAPE: return "\033";
+	case SDLK_RETURN: return "\r";
+	case SDLK_BACKSPACE: return "\b";
+	case SDLK_TAB: return "\t";
+	}
+
+	if (sym < 0x20 || sym >= 0x7f)
+		return "";
+
+	c = sym;
+	if (ctrl && ((c >= '@' && c < '\177') || c == ' '))
+		c &= 0x1f;
+
+	buf[0] = c;
+	buf[1] = '\0';
+
+	return buf;
+}
+
+// plain typing comes in as SDL_TEXTINPUT, keydowns only for the rest
+static int sdl_keydown(struct cal *cal, SDL_KeyboardEvent *ev)
+{
+	struct key_press key;
+	char buf[2];
+
+	// shift and friends on their own would break up counts, registers
+	// and sequences
+	switch (ev->keysym.sym) {
+	case SDLK_LSHIFT: case SDLK_RSHIFT:
+	case SDLK_LCTRL: case SDLK_RCTRL:
+	case SDLK_LALT: case SDLK_RALT:
+	case SDLK_LGUI: case SDLK_RGUI:
+		return 0;
+	}
+
+	key.ctrl = (ev->keysym.mod & KMOD_CTRL) != 0;
+	key.keyval = sdl_keyval(ev->keysym.sym);
+
+	if (!key.keyval && !key.ctrl)
+		return 0;
+
+	key.string = sdl_key_string(ev->keysym.sym, key.ctrl, buf);
+	if (!key.keyval)
+		key.keyval = ev->keysym.sym;
+
+	return calendar_keypress(cal, &key);
+}
+
+static int sdl_textinput(struct cal *cal, SDL_TextInputEvent *ev)
+{
+	struct key_press key;
+
+	key.string = ev->text;
+	key.keyval = gdk_unicode_to_keyval(g_utf8_get_char(ev->text));
+	key.ctrl = false;
+
+	return calendar_keypress(cal, &key);
+}
+
+static void sdl_wheel(struct cal *cal, SDL_MouseWheelEvent *ev)
+{
+	double delta = -ev->preciseY;
+
+	if (SDL_GetModState() & KMOD_CTRL)
+		zoom(cal, delta);
+	else
+		// a wheel notch is a twelfth of the view, like gtk
+		view_scroll_by(cal, delta * DAY_SECONDS / cal->zoom / 12.0);
+
+	calendar_queue_draw(cal);
+}
+
+static bool sdl_hidden;
+
+static void sdl_window_event(struct cal *cal, SDL_WindowEvent *ev)
+{
+	switch (ev->event) {
+	case SDL_WINDOWEVENT_HIDDEN:
+	case SDL_WINDOWEVENT_MINIMIZED:
+		sdl_hidden = true;
+		return;
+
+	case SDL_WINDOWEVENT_SHOWN:
+	case SDL_WINDOWEVENT_RESTORED:
+	case SDL_WINDOWEVENT_MAXIMIZED:
+	case SDL_WINDOWEVENT_EXPOSED:
+		sdl_hidden = false;
+		break;
+	}
+
+	calendar_queue_draw(cal);
+}
+
+// how long until something on screen changes by itself, -1 for never
+static int sdl_wait_ms(struct cal *cal)
+{
+	gint64 wait;
+
+	if (sdl_hidden)
+		return -1;
+
+	wait = (cal->redraw_at * G_USEC_PER_SEC - g_get_real_time()) / 1000;
+
+	return max(wait, 0) + 1;
+}
+
+#ifdef VISCAL_CALDAV
+// ms until some calendar has caldav work to do, -1 for none. we sleep in
+// SDL_WaitEvent, not a glib main loop
+static int caldav_wait_ms(struct cal *cal)
+{
+	struct caldav *dav;
+	gint64 wait = -1, at, now = g_get_monotonic_time();
+
+	for (int i = 0; i < cal->ncalendars; i++) {
+		if (!(dav = cal->calendars[i].caldav))
+			continue;
+
+		// responses come in on sockets only glib is watching
+		if (dav->inflight)
+			return CALDAV_POLL_MS;
+
+		if (!(at = caldav_next(dav, now)))
+			continue;
+
+		at = (at - now) / 1000 + 1;
+		if (wait < 0 || at < wait)
+			wait = at;
+	}
+
+	return wait;
+}
+#endif
+
+// returns 0 on quit
+static int sdl_event(struct cal *cal, SDL_Event *ev)
+{
+	static SDL_Cursor *cursor_pointer, *cursor_default;
+	struct event *hit;
+	int changed;
+
+	if (!cursor_pointer) {
+		cursor_pointer = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_HAND);
+		cursor_default = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_ARROW);
+	}
+
+	switch (ev->type) {
+	case SDL_QUIT:
+		return 0;
+
+	case SDL_WINDOWEVENT:
+		sdl_window_event(cal, &ev->window);
+		break;
+
+	case SDL_KEYDOWN:
+		if (sdl_keydown(cal, &ev->key))
+			calendar_queue_draw(cal);
+		break;
+
+	case SDL_TEXTINPUT:
+		if (sdl_textinput(cal, &ev->text))
+			calendar_queue_draw(cal);
+		break;
+
+	case SDL_MOUSEBUTTONDOWN:
+		calendar_button_press(cal, ev->button.x, ev->button.y);
+		calendar_queue_draw(cal);
+		break;
+
+	case SDL_MOUSEBUTTONUP:
+		calendar_button_release(cal, ev->button.x, ev->button.y);
+		calendar_queue_draw(cal);
+		break;
+
+	case SDL_MOUSEMOTION:
+		hit = calendar_motion(cal, ev->motion.x, ev->motion.y, &changed);
+		SDL_SetCursor(hit ? cursor_pointer : cursor_default);
+		if (changed)
+			calendar_queue_draw(cal);
+		break;
+
+	case SDL_MOUSEWHEEL:
+		sdl_wheel(cal, &ev->wheel);
+		break;
+	}
+
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct cal cal;
+	static struct sdl_render sdl;
+	struct render r;
+	SDL_Window *window;
+	SDL_Event ev;
+	int wait, running = 1;
+
+	calendar_startup(&cal, argc, argv);
+
+	if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+		log_error("SDL_Init: %s", SDL_GetError());
+		return 1;
+	}
+
+	window = SDL_CreateWindow("viscal", SDL_WINDOWPOS_CENTERED,
+				  SDL_WINDOWPOS_CENTERED, 400, 800,
+				  SDL_WINDOW_RESIZABLE);
+
+	if (!window || !sdl_render_init(&sdl, &r, window)) {
+		log_error("sdl: %s", SDL_GetError());
+		return 1;
+	}
+
+	SDL_StartTextInput();
+	calendar_queue_draw(&cal);
+
+	while (running) {
+		// the log ring flushes from glib idle callbacks
+		while (g_main_context_iteration(NULL, FALSE))
+			;
+
+		// sleep until input or the clock changes something, see
+		// calendar_next_change. hidden, only input wakes us
+		wait = sdl_wait_ms(&cal);
+#ifdef VISCAL_CALDAV
+		// requests and timers only move while glib gets to run
+		int io = caldav_wait_ms(&cal);
+		if (io >= 0 && (wait < 0 || io < wait))
+			wait = io;
+#endif
+		if (wait < 0 ? SDL_WaitEvent(&ev) : SDL_WaitEventTimeout(&ev, wait)) {
+			do {
+				running = sdl_event(&cal, &ev);
+			} while (running && SDL_PollEvent(&ev));
+		}
+
+		if (!running || sdl_hidden)
+			continue;
+
+		if (cal.needs_draw || sdl_wait_ms(&cal) <= 1) {
+			sdl_draw(&sdl, &r, &cal);
+			cal.redraw_at = calendar_next_change(&cal,
+				g_get_real_time() / G_USEC_PER_SEC);
+		}
+	}
+
+	SDL_DestroyTexture(sdl.atlas);
+	SDL_DestroyRenderer(sdl.renderer);
+	SDL_DestroyWindow(window);
+	SDL_Quit();
+	calendar_shutdown(&cal);
+
+	return 0;
+}
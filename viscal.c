@@ -1,6 +1,7 @@
 
 #include <cairo/cairo.h>
 #include <gtk/gtk.h>
+#include <pango/pangocairo.h>
 #include <gdk/gdkkeysyms.h>
 #include <libical/ical.h>
 #include <assert.h>
@@ -10,6 +11,18 @@
 #include <math.h>
 #include <locale.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <limits.h>
+
+#ifdef VISCAL_CALDAV
+#include <libsoup/soup.h>
+#endif
+
+#ifdef VISCAL_LUA
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#endif
 
 #define ARRAY_SIZE(array) (sizeof((array))/sizeof((array)[0]))
 
@@ -27,10 +40,6 @@
     __typeof__ (b) _b = (b);                    \
     _a < _b ? _a : _b; })
 
-#define EDITBUF_MAX 32768
-
-// TODO: heap-realloc events array
-#define MAX_EVENTS 1024
 #define SMALLEST_TIMEBLOCK 5
 
 static icaltimezone *tz_utc;
@@ -49,6 +58,7 @@ enum event_flags {
   , EV_HIGHLIGHTED = 1 << 1
   , EV_DRAGGING    = 1 << 2
   , EV_IMMOVABLE   = 1 << 3
+  , EV_FREE        = 1 << 4 // transparent or cancelled, not busy time
 };
 
 enum cal_flags {
@@ -57,6 +67,9 @@ enum cal_flags {
   , CAL_SPLIT      = 1 << 2
   , CAL_CHANGING   = 1 << 3
   , CAL_INSERTING  = 1 << 4
+  , CAL_VISUAL     = 1 << 5
+  , CAL_REGISTER   = 1 << 6
+  , CAL_SEARCHING  = 1 << 7
 };
 
 union rgba {
@@ -71,12 +84,34 @@ enum source {
 	SOURCE_FILE
 };
 
+struct event;
+struct tz_cache;
+struct caldav;
+
 struct ical {
 	icalcomponent * calendar;
 	enum source source;
 	const char *source_location;
 	union rgba color;
 	bool visible;
+
+	// this calendar's events sorted by start time. only re-sorted
+	// when the calendar is marked dirty, the view is merged from these
+	struct event *events;
+	int nevents, events_size;
+	bool dirty;
+	time_t longest; // event, so a search by start knows how far back to look
+
+	// vevent -> search_doc, see search
+	GHashTable *search_docs;
+	bool search_dirty;
+
+	// offset caches for the zones this calendar's events are written in
+	struct tz_cache *zones;
+	int nzones;
+
+	// SOURCE_CALDAV only
+	struct caldav *caldav;
 };
 
 struct event {
@@ -84,6 +119,8 @@ struct event {
 	struct ical *ical;
 
 	int flags;
+	// DTSTART and DTEND as of the last time our calendar was sorted
+	time_t start, end;
 	// set on draw
 	double width, height;
 	double x, y;
@@ -92,43 +129,259 @@ struct event {
 	time_t drag_time;
 };
 
-// used for temporary storage when editing summaries, descriptions, etc
-static char g_editbuf[EDITBUF_MAX] = {0};
-static int g_editbuf_pos = 0;
+// the text being edited, a summary, description or search. it's a gap
+// buffer: what's before the cursor sits at the start of buf and what's
+// after it at the end, so typing and deleting at the cursor only touch
+// the gap. the cursor is always on a utf-8 character boundary
+struct edit_buffer {
+	char *buf;
+	int size;
+	int gap, gap_end; // the cursor is at gap
+	char *text; // in one piece, see edit_buffer_text
+	int text_size;
+};
+
+static struct edit_buffer g_edit;
 
-// TODO: move or remove g_cal_tz
+// the system zone, floating times and dates are in this zone
 static icaltimezone *g_cal_tz;
 
-static void print_timezone(icaltimezone *tz) {
-	printf("Timezone Name: %s\n", icaltimezone_get_tzid(tz));
-	printf("Timezone Location: %s\n", icaltimezone_get_location(tz));
-	printf("Timezone TZNAME properties (should include PST/PDT): %s\n", icaltimezone_get_tznames(tz));
+// logging
+//
+// log lines are formatted into a lock-free ring buffer and written to
+// stderr from an idle callback, so logging never blocks on the terminal.
+// lines above g_log_level are skipped before their arguments are
+// evaluated, and lines above VISCAL_LOG_MAX are compiled out entirely,
+// eg. -DVISCAL_LOG_MAX=LOG_INFO. the level is set with VISCAL_LOG=debug
+enum log_level {
+	LOG_ERROR,
+	LOG_WARN,
+	LOG_INFO,
+	LOG_DEBUG,
+};
+
+#ifndef VISCAL_LOG_MAX
+#define VISCAL_LOG_MAX LOG_DEBUG
+#endif
+
+#define LOG_SLOTS 1024
+#define LOG_LINE_MAX 256
+
+static const char *log_level_names[] = {
+	[LOG_ERROR] = "ERROR",
+	[LOG_WARN]  = "WARN",
+	[LOG_INFO]  = "INFO",
+	[LOG_DEBUG] = "DEBUG",
+};
+
+// a slot's state is 2*lap when it can be written during that lap of the
+// ring, and 2*lap+1 once it holds a line waiting to be flushed
+struct log_slot {
+	unsigned long state;
+	enum log_level level;
+	char line[LOG_LINE_MAX];
+};
+
+static struct log_slot g_log[LOG_SLOTS];
+static unsigned long g_log_head = 0;
+static unsigned long g_log_tail = 0;
+static unsigned long g_log_dropped = 0;
+static int g_log_flushing = 0;
+static int g_log_flush_queued = 0;
+static enum log_level g_log_level = LOG_INFO;
+
+#define log_enabled(level) \
+	((level) <= VISCAL_LOG_MAX && (level) <= g_log_level)
+
+#define log_at(level, ...)                      \
+	do {                                    \
+		if (log_enabled(level))         \
+			log_write(level, __VA_ARGS__); \
+	} while (0)
+
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
+// single consumer at a time, any thread may call this
+static void log_flush()
+{
+	struct log_slot *slot;
+	unsigned long lap, dropped;
+
+	if (__atomic_exchange_n(&g_log_flushing, 1, __ATOMIC_ACQUIRE))
+		return;
+
+	for (;;) {
+		slot = &g_log[g_log_tail % LOG_SLOTS];
+		lap = g_log_tail / LOG_SLOTS;
+
+		if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != lap*2 + 1)
+			break;
+
+		fprintf(stderr, "%s %s\n", log_level_names[slot->level], slot->line);
+
+		__atomic_store_n(&slot->state, (lap + 1) * 2, __ATOMIC_RELEASE);
+		g_log_tail++;
+	}
+
+	dropped = __atomic_exchange_n(&g_log_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		fprintf(stderr, "WARN dropped %lu log lines\n", dropped);
+
+	fflush(stderr);
+
+	__atomic_store_n(&g_log_flushing, 0, __ATOMIC_RELEASE);
+}
+
+static gboolean log_flush_idle(gpointer data)
+{
+	__atomic_store_n(&g_log_flush_queued, 0, __ATOMIC_RELEASE);
+	log_flush();
+	return FALSE;
+}
+
+static void log_write(enum log_level level, const char *fmt, ...)
+{
+	struct log_slot *slot;
+	unsigned long pos, lap, state;
+	va_list ap;
+
+	pos = __atomic_load_n(&g_log_head, __ATOMIC_RELAXED);
+
+	for (;;) {
+		slot = &g_log[pos % LOG_SLOTS];
+		lap = pos / LOG_SLOTS;
+		state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+		if (state == lap*2) {
+			if (__atomic_compare_exchange_n(&g_log_head, &pos, pos + 1,
+							true, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		}
+		else if (state < lap*2) {
+			// ring is full of lines nobody has flushed yet
+			__atomic_add_fetch(&g_log_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else {
+			pos = __atomic_load_n(&g_log_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(slot->line, LOG_LINE_MAX, fmt, ap);
+	va_end(ap);
+	slot->level = level;
+
+	__atomic_store_n(&slot->state, lap*2 + 1, __ATOMIC_RELEASE);
+
+	if (level == LOG_ERROR)
+		log_flush();
+	else if (!__atomic_exchange_n(&g_log_flush_queued, 1, __ATOMIC_ACQ_REL))
+		g_idle_add_full(G_PRIORITY_LOW, log_flush_idle, NULL, NULL);
+}
+
+static void log_init()
+{
+	const char *level = getenv("VISCAL_LOG");
+
+	if (level == NULL)
+		;
+	else if (!strcmp(level, "error"))
+		g_log_level = LOG_ERROR;
+	else if (!strcmp(level, "warn"))
+		g_log_level = LOG_WARN;
+	else if (!strcmp(level, "info"))
+		g_log_level = LOG_INFO;
+	else if (!strcmp(level, "debug"))
+		g_log_level = LOG_DEBUG;
+
+	// anything still buffered when we exit
+	atexit(log_flush);
 }
 
+static void print_timezone(icaltimezone *tz) {
+	log_debug("Timezone Name: %s", icaltimezone_get_tzid(tz));
+	log_debug("Timezone Location: %s", icaltimezone_get_location(tz));
+	log_debug("Timezone TZNAME properties (should include PST/PDT): %s", icaltimezone_get_tznames(tz));
+}
+
+// smooth scrolling and zooming
+//
+// scrolls and zooms move a target that the view eases towards on each
+// frame clock tick, and touchpad flings keep going with some friction.
+// while moving we don't relayout: the events are drawn once into a layer
+// with a margin above and below, which is translated and scaled each
+// frame. the layer is redrawn when we've moved past its margin or scaled
+// too far, and everything is relaid out once the view settles.
+struct view_anim {
+	guint tick;
+	gint64 last_frame;
+	double scroll, scroll_target;
+	double zoom_target;
+	// seconds of scroll per second, for touchpad flings
+	double velocity, fling;
+	guint32 last_scroll_time;
+	// what we last set cal->scroll to, so we notice other changes
+	time_t scroll_set;
+
+	cairo_surface_t *layer;
+	time_t layer_start;
+	double layer_zoom;
+	int layer_width, layer_height;
+};
+
+// what edit mode changes
+enum edit_field {
+	FIELD_SUMMARY,
+	FIELD_DESCRIPTION,
+	FIELD_LOCATION,
+};
+
+static const char *edit_field_labels[] = {
+	[FIELD_SUMMARY]     = "",
+	[FIELD_DESCRIPTION] = "description: ",
+	[FIELD_LOCATION]    = "location: ",
+};
+
 struct cal {
 	GtkWidget *widget;
 	struct ical calendars[128];
 	int ncalendars;
 
-	struct event events[MAX_EVENTS];
-	int nevents;
-	char chord;
+	struct event *events;
+	int nevents, events_size;
+	int key_node; // where we are in a key sequence, see key bindings
+	int count;
 	int repeat;
+	int reg; // register the next command uses, see registers
+	enum edit_field edit_field;
 
 	icalcomponent *select_after_sort;
 	// TODO: make multiple target selection
 	int target;
 	int selected_event_ind;
+	int visual_ind; // other end of the visual range, see visual_update
+	icalcomponent *visual_cursor; // the selection the range was built for
+	icalcomponent **visual; // the range's events, sorted by pointer
+	int nvisual, visual_size;
 	int selected_calendar_ind;
 
 	enum cal_flags flags;
 	int timeblock_size;
 	int timeblock_step;
 	int refresh_events;
+	int needs_draw;
+	guint redraw_timer;
+	time_t redraw_at;
 	int x, y, mx, my;
 	int gutter_height;
 	int font_size;
 	double zoom, zoom_at;
+	struct view_anim anim;
 	icaltimezone *tz;
 
 	time_t current; // current highlighted position
@@ -139,36 +392,7 @@ struct cal {
 
 typedef void (chord_cmd)(struct cal *);
 
-struct chord {
-	char *keys;
-	chord_cmd *cmd;
-};
-
-static void align_hour(struct cal *);
-static void align_up(struct cal *);
-static void align_down(struct cal *);
 static void center_view(struct cal *);
-static void top_view(struct cal *);
-static void bottom_view(struct cal *);
-static void zoom_in(struct cal *);
-static void zoom_out(struct cal *);
-static void select_down(struct cal *);
-static void select_up(struct cal *);
-static void delete_timeblock(struct cal *);
-
-static struct chord chords[] = {
-	{ "ah", align_hour },
-	{ "ak", align_up },
-	{ "aj", align_down },
-	{ "zz", center_view },
-	{ "zt", top_view },
-	{ "zb", bottom_view },
-	{ "zi", zoom_in },
-	{ "zo", zoom_out },
-	{ "gj", select_down },
-	{ "gk", select_up },
-	{ "dd", delete_timeblock },
-};
 
 struct extra_data {
   GtkWindow *win;
@@ -187,1796 +411,6441 @@ static union rgba g_text_color;
 
 static const double dashed[] = {1.0};
 
-static void
-calendar_create(struct cal *cal) {
-	time_t now;
-	time_t today, nowh;
-	struct tm nowtm;
+// lightweight profiling. spans are recorded into a ring buffer only while
+// tracing is on (F12 shows the overlay, Ctrl-F12 dumps a chrome trace)
+enum trace_point {
+	TRACE_FRAME,
+	TRACE_UPDATE_CALENDAR,
+	TRACE_EVENTS_FOR_VIEW,
+	TRACE_DRAW_CALENDAR,
+	TRACE_DRAW_EVENT_SUMMARY,
+	TRACE_SAVE_CALENDAR,
+	TRACE_SCRIPT_COMMIT,
+	TRACE_SCHEDULE_TASKS,
+	TRACE_FREEBUSY,
+	TRACE_SEARCH,
+	TRACE_POINTS
+};
 
-	now = time(NULL);
-	nowtm = *localtime(&now);
-	nowtm.tm_min = 0;
-	nowh = mktime(&nowtm);
-	nowtm.tm_hour = 0;
-	nowtm.tm_sec = 0;
-	today = mktime(&nowtm);
+static const char *trace_names[TRACE_POINTS] = {
+	[TRACE_FRAME]              = "frame",
+	[TRACE_UPDATE_CALENDAR]    = "update_calendar",
+	[TRACE_EVENTS_FOR_VIEW]    = "events_for_view",
+	[TRACE_DRAW_CALENDAR]      = "draw_calendar",
+	[TRACE_DRAW_EVENT_SUMMARY] = "draw_event_summary",
+	[TRACE_SAVE_CALENDAR]      = "save_calendar",
+	[TRACE_SCRIPT_COMMIT]      = "script_commit",
+	[TRACE_SCHEDULE_TASKS]     = "schedule_tasks",
+	[TRACE_FREEBUSY]           = "freebusy",
+	[TRACE_SEARCH]             = "search",
+};
 
-	cal->selected_calendar_ind = 0;
-	cal->selected_event_ind = -1;
-	cal->select_after_sort = NULL;
-	cal->target = -1;
-	cal->chord = 0;
-	cal->gutter_height = 40;
-	cal->font_size = 16;
-	cal->timeblock_step = 15;
-	cal->timeblock_size = 30;
-	cal->flags = 0;
-	cal->ncalendars = 0;
-	cal->nevents = 0;
-	cal->start_at = nowh - today - 4*60*60;
-	cal->scroll = 0;
-	cal->current = nowh;
-	cal->repeat = 1;
-	cal->today = today;
-	cal->x = g_lmargin;
-	cal->y = cal->gutter_height;
-	cal->zoom = 5.0;
-}
+struct trace_span {
+	enum trace_point point;
+	gint64 start, dur;
+};
 
-static void warn(const char *msg) {
-	printf("WARN %s\n", msg);
-}
+struct trace_stat {
+	gint64 total;
+	int count;
+};
 
+#define TRACE_SPANS (1 << 16)
+#define TRACE_FRAMES 256
 
-static void set_current_calendar(struct cal *cal, struct ical *ical)
-{
-	for (int i = 0; i < cal->ncalendars; i++) {
-		if (&cal->calendars[i] == ical)
-			cal->selected_calendar_ind = i;
-	}
-}
+static struct trace_span g_trace[TRACE_SPANS];
+static unsigned int g_trace_head = 0;
+static bool g_tracing = false;
+static bool g_trace_overlay = false;
 
-static struct ical *current_calendar(struct cal *cal) {
-	if (cal->ncalendars == 0)
-		return NULL;
+// per-point totals for the frame being drawn and the last complete one
+static struct trace_stat g_trace_frame[TRACE_POINTS];
+static struct trace_stat g_trace_last[TRACE_POINTS];
 
-	return &cal->calendars[cal->selected_calendar_ind];
-}
+static gint64 g_frame_times[TRACE_FRAMES];
+static int g_nframe_times = 0;
 
-static time_t calendar_view_end(struct cal *cal)
+static inline gint64 trace_begin()
 {
-	return cal->today + cal->start_at + cal->scroll + DAY_SECONDS;
+	return g_tracing ? g_get_monotonic_time() : 0;
 }
 
-
-static time_t calendar_view_start(struct cal *cal)
+static inline void trace_end(enum trace_point point, gint64 start)
 {
-	return cal->today + cal->start_at + cal->scroll;
-}
+	struct trace_span *span;
+	gint64 dur;
 
+	if (!g_tracing || start == 0)
+		return;
 
+	dur = g_get_monotonic_time() - start;
 
-static int
-span_overlaps(time_t start1, time_t end1, time_t start2, time_t end2) {
-	return max(0, min(end1, end2) - max(start1, start2));
-}
+	span = &g_trace[g_trace_head++ % TRACE_SPANS];
+	span->point = point;
+	span->start = start;
+	span->dur = dur;
+
+	g_trace_frame[point].total += dur;
+	g_trace_frame[point].count++;
 
+	if (point == TRACE_FRAME) {
+		g_frame_times[g_nframe_times++ % TRACE_FRAMES] = dur;
+		memcpy(g_trace_last, g_trace_frame, sizeof(g_trace_last));
+		memset(g_trace_frame, 0, sizeof(g_trace_frame));
+	}
+}
 
-static void vevent_span_timet(icalcomponent *vevent, time_t *st, time_t *et)
+static void toggle_trace_overlay(struct cal *cal)
 {
-	icaltimetype dtstart, dtend;
+	g_trace_overlay = !g_trace_overlay;
+	g_tracing = g_trace_overlay || getenv("VISCAL_TRACE") != NULL;
+}
 
-	if (st) {
-		dtstart = icalcomponent_get_dtstart(vevent);
-		*st = icaltime_as_timet_with_zone(dtstart, icaltime_get_timezone(dtstart));
+// dump the ring buffer in chrome's trace event format, loadable in
+// chrome://tracing or perfetto
+static void trace_dump()
+{
+	struct trace_span *span;
+	unsigned int i, first, count;
+	char *path;
+	char name[64];
+	FILE *fd;
+
+	if (!g_tracing) {
+		log_warn("tracing is off, press F12 or set VISCAL_TRACE first");
+		return;
 	}
 
-	if (et) {
-		dtend = icalcomponent_get_dtend(vevent);
-		*et = icaltime_as_timet_with_zone(dtend, icaltime_get_timezone(dtend));
+	snprintf(name, sizeof(name), "viscal-trace-%ld.json", (long)time(NULL));
+	path = g_build_filename(g_get_tmp_dir(), name, NULL);
+
+	if (!(fd = fopen(path, "w"))) {
+		log_error("failed to open %s for writing", path);
+		g_free(path);
+		return;
 	}
-}
 
-static void select_event(struct cal *cal, int ind)
-{
-	time_t start;
-	struct event *ev;
+	count = min(g_trace_head, (unsigned int)TRACE_SPANS);
+	first = g_trace_head - count;
 
-	cal->selected_event_ind = ind;
+	fprintf(fd, "{\"traceEvents\":[");
 
-	if (ind != -1) {
-		ev = &cal->events[ind];
-		vevent_span_timet(ev->vevent, &start, NULL);
-		cal->current = start;
+	for (i = 0; i < count; i++) {
+		span = &g_trace[(first + i) % TRACE_SPANS];
+		fprintf(fd, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT
+			",\"dur\":%" G_GINT64_FORMAT ",\"pid\":1,\"tid\":1}",
+			i == 0 ? "" : ",", trace_names[span->point],
+			span->start, span->dur);
 	}
-}
 
-/* static int */
-/* vevent_in_span(icalcomponent *vevent, time_t start, time_t end) { */
-/* 	/\* printf("vevent_in_span span.start %d span.end %d start %d end %d\n", *\/ */
-/* 	/\* 	span.start, span.end, start, end); *\/ */
-/* 	time_t st, et; */
-/* 	vevent_span_timet(vevent, &st, &et); */
-/* 	return span_overlaps(st, et, start, end); */
+	fprintf(fd, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(fd);
 
-/* } */
+	log_info("wrote %u trace spans to %s", count, path);
+	g_free(path);
+}
+
+// local time
+//
+// localtime/mktime take the libc timezone lock and re-evaluate the zone
+// rules on every call, and we do a lot of them while dragging. instead we
+// cache the utc offset per utc day, along with the (at most one) DST
+// transition in that day, and do the calendar math ourselves.
+//
+// the same cache is kept per zone that events are written in, see
+// calendar_zone. those only cache the window tz_cache_prepare was last
+// called with, so loading years of events doesn't thrash it.
+struct tz_day {
+	long day;
+	bool valid;
+	bool has_transition;
+	time_t transition;
+	long off_before, off_after;
+	int isdst_before, isdst_after;
+};
 
-static int sort_event(const void *a, const void*b) {
-	time_t st_a, st_b;
-	icaltimetype dtstart;
-	struct event *ea = (struct event *)a;
-	struct event *eb = (struct event *)b;
+#define TZ_DAYS 64
 
-	dtstart = icalcomponent_get_dtstart(ea->vevent);
-	st_a = icaltime_as_timet_with_zone(dtstart, dtstart.zone);
+struct tz_cache {
+	// NULL is the system zone, which goes through libc
+	const icaltimezone *zone;
+	// the TZID this zone was resolved from, if any
+	char *tzid;
+	long first_day, last_day;
+	struct tz_day days[TZ_DAYS];
+};
 
-	dtstart = icalcomponent_get_dtstart(eb->vevent);
-	st_b = icaltime_as_timet_with_zone(dtstart, dtstart.zone);
+static struct tz_cache g_local_tz;
 
-	if (st_a < st_b)
-		return -1;
-	else if (st_a == st_b)
-		return 0;
-	else
-		return 1;
+static inline long floor_div(long a, long b)
+{
+	return a / b - (a % b != 0 && (a < 0) != (b < 0));
 }
 
-static time_t get_vevent_start(icalcomponent *vevent)
+static inline long floor_mod(long a, long b)
 {
-	icaltimetype dtstart = icalcomponent_get_dtstart(vevent);
-	return icaltime_as_timet_with_zone(dtstart, dtstart.zone);
+	return a - floor_div(a, b) * b;
 }
 
-static int first_event_starting_at(struct cal *cal, time_t starting_at)
+// days since 1970-01-01 in the proleptic gregorian calendar
+static long days_from_civil(long y, unsigned m, unsigned d)
 {
-	time_t st;
+	y -= m <= 2;
+	long era = (y >= 0 ? y : y - 399) / 400;
+	unsigned yoe = (unsigned)(y - era * 400);
+	unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (long)doe - 719468;
+}
 
-	if (cal->nevents == 0)
-		return -1;
+static void civil_from_days(long z, long *year, unsigned *month, unsigned *day)
+{
+	z += 719468;
+	long era = (z >= 0 ? z : z - 146096) / 146097;
+	unsigned doe = (unsigned)(z - era * 146097);
+	unsigned yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+	unsigned doy = doe - (365*yoe + yoe/4 - yoe/100);
+	unsigned mp = (5*doy + 2) / 153;
 
-	for (int i = cal->nevents - 1; i >= 0; i--) {
-		vevent_span_timet(cal->events[i].vevent, &st, NULL);
+	*day = doy - (153*mp + 2)/5 + 1;
+	*month = mp < 10 ? mp + 3 : mp - 9;
+	*year = (long)yoe + era * 400 + (*month <= 2);
+}
 
-		if (st >= starting_at)
-			continue;
-		else if (i == cal->nevents - 1)
-			return -1;
+// an icaltime's wall clock time as seconds since the epoch
+static time_t icaltime_wall_seconds(icaltimetype tt)
+{
+	time_t secs = days_from_civil(tt.year, tt.month, tt.day) * DAY_SECONDS;
 
-		return i + 1;
-	}
+	if (!tt.is_date)
+		secs += tt.hour * 3600 + tt.minute * 60 + tt.second;
 
-	assert(!"unpossible");
+	return secs;
 }
 
-// seconds_range = 0 implies: do something reasonable (DAY_SECONDS/4)
-static int find_event_within(struct cal *cal, time_t target, int seconds_range)
+static icaltimetype utc_icaltime(time_t t)
 {
-	struct event *ev;
-	time_t evtime, diff, prev;
+	icaltimetype tt = icaltime_null_time();
+	long days = floor_div(t, DAY_SECONDS);
+	long secs = t - days * DAY_SECONDS;
+	long year;
+	unsigned month, day;
 
-	if (seconds_range == 0)
-		seconds_range = DAY_SECONDS/4;
+	civil_from_days(days, &year, &month, &day);
 
-	prev = target;
+	tt.year = year;
+	tt.month = month;
+	tt.day = day;
+	tt.hour = secs / 3600;
+	tt.minute = (secs / 60) % 60;
+	tt.second = secs % 60;
+	tt.zone = tz_utc;
 
-	if (cal->nevents == 0)
-		return -1;
-	else if (cal->nevents == 1)
-		return 0;
+	return tt;
+}
 
-	for (int i = cal->nevents-1; i >= 0; i--) {
+// the slow path, only used to fill the cache
+static long localtime_offset(time_t t, int *isdst)
+{
+	struct tm lt = *localtime(&t);
+	long local = days_from_civil(lt.tm_year + 1900, lt.tm_mon + 1, lt.tm_mday)
+		* DAY_SECONDS + lt.tm_hour * 3600 + lt.tm_min * 60 + lt.tm_sec;
 
-		ev = &cal->events[i];
-		vevent_span_timet(ev->vevent, &evtime, NULL);
+	if (isdst)
+		*isdst = lt.tm_isdst;
 
-		diff = abs(target - evtime);
+	return local - t;
+}
 
-		if (diff > prev) {
-			if (prev > seconds_range)
-				return -1;
-			return i+1;
-		}
+static long zone_offset(const icaltimezone *zone, time_t t, int *isdst)
+{
+	icaltimetype tt;
+	int dst = 0;
+	long off;
 
-		prev = diff;
-	}
+	if (zone == NULL)
+		return localtime_offset(t, isdst);
 
-	assert(!"shouldn't get here");
+	tt = utc_icaltime(t);
+	off = icaltimezone_get_utc_offset_of_utc_time((icaltimezone*)zone,
+						      &tt, &dst);
+	if (isdst)
+		*isdst = dst;
+
+	return off;
 }
 
-/* static void select_closest_to_now(struct cal *cal) */
-/* { */
-/* 	time_t now = time(NULL); */
-/* 	cal->selected_event_ind = find_event_within(cal, now, 0); */
-/* } */
+static void tz_fill_day(const icaltimezone *zone, struct tz_day *entry,
+			long day)
+{
+	time_t lo = day * DAY_SECONDS;
+	time_t hi = lo + DAY_SECONDS - 1;
+	time_t mid;
 
+	entry->day = day;
+	entry->valid = true;
+	entry->off_before = zone_offset(zone, lo, &entry->isdst_before);
+	entry->off_after = zone_offset(zone, hi, &entry->isdst_after);
+	entry->has_transition = entry->off_before != entry->off_after;
 
-static void set_edit_buffer(const char *src)
-{
-	char *dst = g_editbuf;
-	int n = 0;
-	int c = EDITBUF_MAX;
+	if (!entry->has_transition)
+		return;
 
-	while (c-- && (*dst++ = *src++))
-		n++;
+	// bisect for the first second with the new offset
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (zone_offset(zone, mid, NULL) == entry->off_before)
+			lo = mid;
+		else
+			hi = mid;
+	}
 
-	g_editbuf_pos = n;
+	entry->transition = hi;
 }
 
-static struct ical *get_selected_calendar(struct cal *cal)
+static inline bool tz_cache_covers(struct tz_cache *cache, long day)
 {
-	if (cal->ncalendars == 0 || cal->selected_calendar_ind == -1)
-		return NULL;
-	return &cal->calendars[cal->selected_calendar_ind];
+	return cache->zone == NULL ||
+		(day >= cache->first_day && day <= cache->last_day);
 }
 
-static struct event *get_selected_event(struct cal *cal)
+static inline long tz_cache_offset(struct tz_cache *cache, time_t t,
+				   int *isdst)
 {
-	if (cal->nevents == 0 || cal->selected_event_ind == -1)
-		return NULL;
-	return &cal->events[cal->selected_event_ind];
+	long day = floor_div(t, DAY_SECONDS);
+	struct tz_day *entry;
+	bool after;
+
+	if (!tz_cache_covers(cache, day))
+		return zone_offset(cache->zone, t, isdst);
+
+	entry = &cache->days[floor_mod(day, TZ_DAYS)];
+	if (!entry->valid || entry->day != day)
+		tz_fill_day(cache->zone, entry, day);
+
+	after = entry->has_transition && t >= entry->transition;
+
+	if (isdst)
+		*isdst = after ? entry->isdst_after : entry->isdst_before;
+
+	return after ? entry->off_after : entry->off_before;
 }
 
-enum edit_mode_flags {
-	EDIT_CLEAR = 1 << 1,
-};
+static inline long tz_offset(time_t t, int *isdst)
+{
+	return tz_cache_offset(&g_local_tz, t, isdst);
+}
 
-static void edit_mode(struct cal *cal, int flags)
+// wall clock time in the cache's zone to utc. ambiguous times pick the
+// first occurrence
+static time_t tz_cache_to_utc(struct tz_cache *cache, icaltimetype tt)
 {
-	// TODO: STATUS BAR for edit mode
+	time_t local = icaltime_wall_seconds(tt);
+	long before, after, first, second;
 
-	struct event *event =
-		get_selected_event(cal);
+	if (!tz_cache_covers(cache, floor_div(local, DAY_SECONDS))) {
+		tt.is_date = 0;
+		return local - icaltimezone_get_utc_offset(
+			(icaltimezone*)cache->zone, &tt, NULL);
+	}
 
-	// don't enter edit mode if we're not selecting any event
-	if (!event)
-		return;
+	// the offsets either side of any transition near this time
+	before = tz_cache_offset(cache, local - DAY_SECONDS, NULL);
+	after = tz_cache_offset(cache, local + DAY_SECONDS, NULL);
 
-	cal->flags |= CAL_CHANGING;
+	if (before == after)
+		return local - before;
 
-	if (flags & EDIT_CLEAR)
-		return set_edit_buffer("");
+	// the larger offset gives the earlier time, if it exists
+	first = max(before, after);
+	if (tz_cache_offset(cache, local - first, NULL) == first)
+		return local - first;
 
-	const char *summary =
-		icalcomponent_get_summary(event->vevent);
+	second = min(before, after);
+	if (tz_cache_offset(cache, local - second, NULL) == second)
+		return local - second;
 
-	// TODO: what are we editing? for now assume summary
-	// copy current summary to edit buffer
-	set_edit_buffer(summary);
+	// skipped by the transition, use the offset from before it
+	return local - before;
 }
 
-
-static void print_flags(struct cal *cal)
+// warm a cache for a time range, eg. the visible part of the calendar.
+// zone caches keep a week either side of it for scrolling and dragging
+static void tz_cache_prepare(struct tz_cache *cache, time_t start, time_t end)
 {
-	int i;
+	long first = floor_div(start, DAY_SECONDS);
+	long last = floor_div(end, DAY_SECONDS);
 
-	printf("flags: ");
-	for (i = 0; i < cal->nevents; i++) {
-		printf("%d ", cal->events[i].flags);
+	if (cache->zone) {
+		cache->first_day = first - 7;
+		cache->last_day = min(last + 7, cache->first_day + TZ_DAYS - 1);
 	}
-	printf("\n");
+
+	for (long day = first; day <= last; day++)
+		tz_cache_offset(cache, day * DAY_SECONDS, NULL);
 }
 
-static void events_for_view(struct cal *cal, time_t start, time_t end)
+// the system zone, from $TZ or /etc/localtime like libc does it
+static icaltimezone *system_timezone()
 {
-	int i;
-	struct event *event;
-	icalcomponent *vevent;
-	struct ical *calendar;
-	icalcomponent *ical;
-
-	cal->nevents = 0;
-
-	for (i = 0; i < cal->ncalendars; ++i) {
-		calendar = &cal->calendars[i];
-		ical = calendar->calendar;
-		for (vevent = icalcomponent_get_first_component(ical, ICAL_VEVENT_COMPONENT);
-		     vevent != NULL && cal->nevents < MAX_EVENTS;
-		     vevent = icalcomponent_get_next_component(ical, ICAL_VEVENT_COMPONENT))
-		{
-
-			// NOTE: re-add me when we care about filtering
-			/* if (vevent_in_span(vevent, start, end)) { */
-			event = &cal->events[cal->nevents++];
-			/* printf("event in view %s\n", icalcomponent_get_summary(vevent)); */
-			event->vevent = vevent;
-			event->ical = calendar;
-			/* } */
-		}
+	const char *tz = getenv("TZ");
+	const char *p;
+	char *link = NULL, *contents = NULL, *name = NULL;
+	icaltimezone *zone = NULL;
+
+	if (tz && *tz)
+		name = g_strdup(tz[0] == ':' ? tz + 1 : tz);
+	else if ((link = g_file_read_link("/etc/localtime", NULL)))
+		name = g_strdup(link);
+	else if (g_file_get_contents("/etc/timezone", &contents, NULL, NULL))
+		name = g_strdup(g_strstrip(contents));
+
+	// TZ and the symlink may be full paths into the zoneinfo database
+	if (name && (p = strstr(name, "zoneinfo/")))
+		memmove(name, p + strlen("zoneinfo/"),
+			strlen(p + strlen("zoneinfo/")) + 1);
+
+	if (name)
+		zone = icaltimezone_get_builtin_timezone(name);
+
+	if (zone)
+		log_info("using timezone %s", name);
+	else {
+		log_warn("couldn't find system timezone %s, using UTC",
+			 name ? name : "");
+		zone = tz_utc;
 	}
 
-	print_flags(cal);
+	g_free(name);
+	g_free(link);
+	g_free(contents);
 
-	printf("DEBUG sorting\n");
-	qsort(cal->events, cal->nevents, sizeof(struct event), sort_event);
+	return zone;
+}
 
-	print_flags(cal);
+static void timezones_init()
+{
+	tz_utc = icaltimezone_get_utc_timezone();
+	g_cal_tz = system_timezone();
+}
+
+// replacement for *localtime(&t)
+static void local_tm(time_t t, struct tm *tm)
+{
+	long year;
+	unsigned month, day;
+	time_t local = t + tz_offset(t, &tm->tm_isdst);
+	long days = floor_div(local, DAY_SECONDS);
+	long secs = local - days * DAY_SECONDS;
+
+	civil_from_days(days, &year, &month, &day);
+
+	tm->tm_year = year - 1900;
+	tm->tm_mon = month - 1;
+	tm->tm_mday = day;
+	tm->tm_hour = secs / 3600;
+	tm->tm_min = (secs / 60) % 60;
+	tm->tm_sec = secs % 60;
+	tm->tm_wday = floor_mod(days + 4, 7);
+	tm->tm_yday = days - days_from_civil(year, 1, 1);
+}
+
+// these adjust t's wall clock time and convert back using t's own utc
+// offset, like mktime does when handed the tm_isdst localtime gave us
+
+// start of the local hour containing t
+static time_t local_hour_start(time_t t)
+{
+	long off = tz_offset(t, NULL);
+	return t - floor_mod(t + off, 3600);
+}
+
+static time_t local_day_start(time_t t)
+{
+	long off = tz_offset(t, NULL);
+	return t - floor_mod(t + off, DAY_SECONDS);
+}
+
+// the time at minute `minute` of t's local hour, minute may be 60
+static time_t local_hour_at_minute(time_t t, int minute)
+{
+	return local_hour_start(t) + minute * 60;
+}
+
+static int local_minute(time_t t)
+{
+	return floor_mod(t + tz_offset(t, NULL), 3600) / 60;
+}
+
+static void
+calendar_create(struct cal *cal) {
+	time_t now;
+	time_t today, nowh;
+
+	now = time(NULL);
+	nowh = local_hour_start(now);
+	today = local_day_start(now);
+
+	cal->selected_calendar_ind = 0;
+	cal->selected_event_ind = -1;
+	cal->visual_ind = -1;
+	cal->select_after_sort = NULL;
+	cal->target = -1;
+	cal->key_node = 0;
+	cal->count = 0;
+	cal->gutter_height = 40;
+	cal->font_size = 16;
+	cal->timeblock_step = 15;
+	cal->timeblock_size = 30;
+	cal->flags = 0;
+	cal->ncalendars = 0;
+	cal->events = NULL;
+	cal->nevents = 0;
+	cal->events_size = 0;
+	cal->start_at = nowh - today - 4*60*60;
+	cal->scroll = 0;
+	cal->current = nowh;
+	cal->repeat = 1;
+	cal->today = today;
+	cal->x = g_lmargin;
+	cal->y = cal->gutter_height;
+	cal->zoom = 5.0;
+	cal->widget = NULL;
+	memset(&cal->anim, 0, sizeof(cal->anim));
+}
+
+
+static void set_current_calendar(struct cal *cal, struct ical *ical)
+{
+	for (int i = 0; i < cal->ncalendars; i++) {
+		if (&cal->calendars[i] == ical)
+			cal->selected_calendar_ind = i;
+	}
+}
+
+static struct ical *current_calendar(struct cal *cal) {
+	if (cal->ncalendars == 0)
+		return NULL;
+
+	return &cal->calendars[cal->selected_calendar_ind];
+}
+
+static time_t calendar_view_end(struct cal *cal)
+{
+	return cal->today + cal->start_at + cal->scroll + DAY_SECONDS;
+}
+
+
+static time_t calendar_view_start(struct cal *cal)
+{
+	return cal->today + cal->start_at + cal->scroll;
+}
+
+
+
+static int
+span_overlaps(time_t start1, time_t end1, time_t start2, time_t end2) {
+	return max(0, min(end1, end2) - max(start1, start2));
+}
+
+
+// zones
+//
+// icalcomponent_get_dtstart resolves the TZID against the calendar's
+// VTIMEZONEs and then libical's builtin zones, which is a linear search,
+// every time it's called. we resolve each TZID once per calendar and
+// convert with that zone's offset cache instead.
+static struct tz_cache *calendar_zone_add(struct ical *ical,
+					  const icaltimezone *zone,
+					  const char *tzid)
+{
+	struct tz_cache *cache;
+
+	ical->zones = realloc(ical->zones,
+			      (ical->nzones + 1) * sizeof(*ical->zones));
+	assert(ical->zones);
+
+	cache = &ical->zones[ical->nzones++];
+	memset(cache, 0, sizeof(*cache));
+	cache->zone = zone;
+	cache->tzid = g_strdup(tzid);
+
+	return cache;
+}
+
+static struct tz_cache *calendar_zone(struct ical *ical,
+				      const icaltimezone *zone)
+{
+	for (int i = 0; i < ical->nzones; i++) {
+		if (ical->zones[i].zone == zone)
+			return &ical->zones[i];
+	}
+
+	return calendar_zone_add(ical, zone, NULL);
+}
+
+static struct tz_cache *calendar_tzid_zone(struct ical *ical,
+					   const char *tzid)
+{
+	icaltimezone *zone;
+
+	for (int i = 0; i < ical->nzones; i++) {
+		if (ical->zones[i].tzid && !strcmp(ical->zones[i].tzid, tzid))
+			return &ical->zones[i];
+	}
+
+	zone = icalcomponent_get_timezone(ical->calendar, tzid);
+	if (!zone)
+		zone = icaltimezone_get_builtin_timezone_from_tzid(tzid);
+	if (!zone)
+		zone = icaltimezone_get_builtin_timezone(tzid);
+	if (!zone) {
+		log_warn("%s: unknown TZID %s, using local time",
+			 ical->source_location, tzid);
+		zone = g_cal_tz;
+	}
+
+	return calendar_zone_add(ical, zone, tzid);
+}
+
+// the VTIMEZONE a DTSTART/DTEND's TZID names in ical, copied into vcal if
+// it doesn't have one by that name yet. events that leave ical need it
+static void calendar_copy_timezone(struct ical *ical, icalcomponent *vcal,
+				   icalproperty *prop)
+{
+	icalparameter *param;
+	icaltimezone *zone;
+	const char *tzid;
+
+	if (!prop)
+		return;
+
+	param = icalproperty_get_first_parameter(prop, ICAL_TZID_PARAMETER);
+	if (!param)
+		return;
+
+	tzid = icalparameter_get_tzid(param);
+	if (icalcomponent_get_timezone(vcal, tzid))
+		return;
+
+	zone = icalcomponent_get_timezone(ical->calendar, tzid);
+	if (zone)
+		icalcomponent_add_component(vcal, icalcomponent_new_clone(
+			icaltimezone_get_component(zone)));
+}
+
+// an event moving or being copied from one calendar to another keeps its
+// TZIDs, so the zones they name have to come along
+static void vevent_copy_timezones(struct ical *from, struct ical *to,
+				  icalcomponent *vevent)
+{
+	calendar_copy_timezone(from, to->calendar,
+		icalcomponent_get_first_property(vevent, ICAL_DTSTART_PROPERTY));
+	calendar_copy_timezone(from, to->calendar,
+		icalcomponent_get_first_property(vevent, ICAL_DTEND_PROPERTY));
+}
+
+static void calendar_zones_prepare(struct ical *ical, time_t start, time_t end)
+{
+	for (int i = 0; i < ical->nzones; i++)
+		tz_cache_prepare(&ical->zones[i], start, end);
+}
+
+static icaltimetype prop_icaltime(icalproperty *prop)
+{
+	if (icalproperty_isa(prop) == ICAL_DTSTART_PROPERTY)
+		return icalproperty_get_dtstart(prop);
+	return icalproperty_get_dtend(prop);
+}
+
+// the zone a DTSTART/DTEND's wall clock time is in, NULL for utc.
+// floating times and dates are in the system zone
+static struct tz_cache *prop_zone(struct ical *ical, icalproperty *prop,
+				  icaltimetype tt)
+{
+	icalparameter *tzid;
+
+	if (icaltime_is_utc(tt))
+		return NULL;
+
+	tzid = icalproperty_get_first_parameter(prop, ICAL_TZID_PARAMETER);
+	if (tzid)
+		return calendar_tzid_zone(ical, icalparameter_get_tzid(tzid));
+
+	return g_cal_tz == tz_utc ? NULL : calendar_zone(ical, g_cal_tz);
+}
+
+static time_t prop_timet(struct ical *ical, icalproperty *prop)
+{
+	icaltimetype tt = prop_icaltime(prop);
+	struct tz_cache *zone;
+
+	if (icaltime_is_null_time(tt))
+		return 0;
+
+	zone = prop_zone(ical, prop, tt);
+
+	return zone ? tz_cache_to_utc(zone, tt) : icaltime_wall_seconds(tt);
+}
+
+// moves a DTSTART/DTEND to t, leaving its TZID parameter alone.
+// icalcomponent_set_dtstart would replace it with libical's name for the
+// zone, which isn't always what the file had
+static void prop_set_timet(struct ical *ical, icalproperty *prop, time_t t)
+{
+	icaltimetype old = prop_icaltime(prop);
+	struct tz_cache *zone = prop_zone(ical, prop, old);
+	icaltimetype tt;
+
+	tt = icaltime_from_timet_with_zone(t, old.is_date,
+					   zone ? zone->zone : tz_utc);
+
+	// the TZID parameter names the zone, the value is wall clock time.
+	// floating times have no zone either, even when the system zone is
+	// utc, only utc times keep theirs
+	if (!icaltime_is_utc(old))
+		tt.zone = NULL;
+
+	icalproperty_set_value(prop, old.is_date ? icalvalue_new_date(tt)
+				     : icalvalue_new_datetime(tt));
+}
+
+static void vevent_span_timet(struct ical *ical, icalcomponent *vevent,
+			      time_t *st, time_t *et)
+{
+	icalproperty *dtstart, *dtend, *duration;
+	time_t start;
+
+	dtstart = icalcomponent_get_first_property(vevent, ICAL_DTSTART_PROPERTY);
+	start = dtstart ? prop_timet(ical, dtstart) : 0;
+
+	if (st)
+		*st = start;
+
+	if (!et)
+		return;
+
+	dtend = icalcomponent_get_first_property(vevent, ICAL_DTEND_PROPERTY);
+	duration = icalcomponent_get_first_property(vevent, ICAL_DURATION_PROPERTY);
+
+	if (dtend)
+		*et = prop_timet(ical, dtend);
+	else if (duration)
+		*et = start + icaldurationtype_as_int(
+			icalproperty_get_duration(duration));
+	else if (dtstart && icalproperty_get_dtstart(dtstart).is_date)
+		*et = start + DAY_SECONDS;
+	else
+		*et = start;
+}
+
+// moves an event to start..end, keeping the zones it was written in
+static void vevent_set_span(struct ical *ical, icalcomponent *vevent,
+			    time_t start, time_t end)
+{
+	icalproperty *prop;
+
+	prop = icalcomponent_get_first_property(vevent, ICAL_DTSTART_PROPERTY);
+	if (prop)
+		prop_set_timet(ical, prop, start);
+	else
+		icalcomponent_set_dtstart(vevent,
+			icaltime_from_timet_with_zone(start, 0, tz_utc));
+
+	if ((prop = icalcomponent_get_first_property(vevent, ICAL_DTEND_PROPERTY)))
+		prop_set_timet(ical, prop, end);
+	else if ((prop = icalcomponent_get_first_property(vevent, ICAL_DURATION_PROPERTY)))
+		icalproperty_set_duration(prop, icaldurationtype_from_int(end - start));
+	else
+		icalcomponent_set_dtend(vevent,
+			icaltime_from_timet_with_zone(end, 0, tz_utc));
+}
+
+static void select_event(struct cal *cal, int ind)
+{
+	time_t start;
+	struct event *ev;
+
+	cal->selected_event_ind = ind;
+
+	if (ind != -1) {
+		ev = &cal->events[ind];
+		vevent_span_timet(ev->ical, ev->vevent, &start, NULL);
+		cal->current = start;
+	}
+}
+
+/* static int */
+/* vevent_in_span(icalcomponent *vevent, time_t start, time_t end) { */
+/* 	/\* printf("vevent_in_span span.start %d span.end %d start %d end %d\n", *\/ */
+/* 	/\* 	span.start, span.end, start, end); *\/ */
+/* 	time_t st, et; */
+/* 	vevent_span_timet(vevent, &st, &et); */
+/* 	return span_overlaps(st, et, start, end); */
+
+/* } */
+
+// compares the start times cached by calendar_sort_events, so libical
+// only has to convert each DTSTART once per sort instead of per compare
+static int sort_event(const void *a, const void*b) {
+	const struct event *ea = (const struct event *)a;
+	const struct event *eb = (const struct event *)b;
+
+	if (ea->start < eb->start)
+		return -1;
+	else if (ea->start == eb->start)
+		return 0;
+	else
+		return 1;
+}
+
+static int sort_event_vevent(const void *a, const void*b) {
+	const struct event *ea = (const struct event *)a;
+	const struct event *eb = (const struct event *)b;
+
+	if (ea->vevent < eb->vevent)
+		return -1;
+	else if (ea->vevent == eb->vevent)
+		return 0;
+	else
+		return 1;
+}
+
+static void *grow_array(void *arr, int *size, int needed, size_t elem)
+{
+	int newsize;
+
+	if (needed <= *size)
+		return arr;
+
+	newsize = max(*size * 2, max(needed, 64));
+	arr = realloc(arr, newsize * elem);
+	assert(arr);
+	*size = newsize;
+
+	return arr;
+}
+
+static int first_event_starting_at(struct cal *cal, time_t starting_at)
+{
+	time_t st;
+
+	if (cal->nevents == 0)
+		return -1;
+
+	for (int i = cal->nevents - 1; i >= 0; i--) {
+		vevent_span_timet(cal->events[i].ical, cal->events[i].vevent,
+				  &st, NULL);
+
+		if (st >= starting_at)
+			continue;
+		else if (i == cal->nevents - 1)
+			return -1;
+
+		return i + 1;
+	}
+
+	assert(!"unpossible");
+}
+
+// seconds_range = 0 implies: do something reasonable (DAY_SECONDS/4)
+static int find_event_within(struct cal *cal, time_t target, int seconds_range)
+{
+	struct event *ev;
+	time_t evtime, diff, prev;
+
+	if (seconds_range == 0)
+		seconds_range = DAY_SECONDS/4;
+
+	prev = target;
+
+	if (cal->nevents == 0)
+		return -1;
+	else if (cal->nevents == 1)
+		return 0;
+
+	for (int i = cal->nevents-1; i >= 0; i--) {
+
+		ev = &cal->events[i];
+		vevent_span_timet(ev->ical, ev->vevent, &evtime, NULL);
+
+		diff = abs(target - evtime);
+
+		if (diff > prev) {
+			if (prev > seconds_range)
+				return -1;
+			return i+1;
+		}
+
+		prev = diff;
+	}
+
+	assert(!"shouldn't get here");
+}
+
+/* static void select_closest_to_now(struct cal *cal) */
+/* { */
+/* 	time_t now = time(NULL); */
+/* 	cal->selected_event_ind = find_event_within(cal, now, 0); */
+/* } */
+
+
+static void edit_buffer_reserve(int n)
+{
+	int after = g_edit.size - g_edit.gap_end;
+	int size = max(64, g_edit.size);
+
+	if (g_edit.gap_end - g_edit.gap >= n)
+		return;
+
+	while (size - g_edit.gap - after < n)
+		size *= 2;
+
+	g_edit.buf = realloc(g_edit.buf, size);
+	assert(g_edit.buf);
+
+	memmove(g_edit.buf + size - after, g_edit.buf + g_edit.gap_end, after);
+	g_edit.gap_end = size - after;
+	g_edit.size = size;
+}
+
+static void edit_buffer_insert(const char *str)
+{
+	int n = strlen(str);
+
+	edit_buffer_reserve(n);
+	memcpy(g_edit.buf + g_edit.gap, str, n);
+	g_edit.gap += n;
+}
+
+static void set_edit_buffer(const char *str)
+{
+	g_edit.gap = 0;
+	g_edit.gap_end = g_edit.size;
+	edit_buffer_insert(str ? str : "");
+}
+
+// the text in one piece, with a mark at the cursor for drawing
+static const char *edit_buffer_text(bool cursor)
+{
+	int before = g_edit.gap;
+	int after = g_edit.size - g_edit.gap_end;
+	char *p;
+
+	g_edit.text = grow_array(g_edit.text, &g_edit.text_size,
+				 before + after + 2, 1);
+	p = g_edit.text;
+
+	if (before)
+		memcpy(p, g_edit.buf, before);
+	p += before;
+
+	if (cursor)
+		*p++ = '|';
+
+	if (after)
+		memcpy(p, g_edit.buf + g_edit.gap_end, after);
+	p += after;
+
+	*p = '\0';
+	return g_edit.text;
+}
+
+static int utf8_continuation(char c)
+{
+	return (c & 0xc0) == 0x80;
+}
+
+static void edit_buffer_left()
+{
+	int pos = g_edit.gap, n;
+
+	if (pos == 0)
+		return;
+
+	while (--pos > 0 && utf8_continuation(g_edit.buf[pos]))
+		;
+
+	n = g_edit.gap - pos;
+	g_edit.gap_end -= n;
+	memmove(g_edit.buf + g_edit.gap_end, g_edit.buf + pos, n);
+	g_edit.gap = pos;
+}
+
+static void edit_buffer_right()
+{
+	int pos = g_edit.gap_end, n;
+
+	if (pos == g_edit.size)
+		return;
+
+	while (++pos < g_edit.size && utf8_continuation(g_edit.buf[pos]))
+		;
+
+	n = pos - g_edit.gap_end;
+	memmove(g_edit.buf + g_edit.gap, g_edit.buf + g_edit.gap_end, n);
+	g_edit.gap += n;
+	g_edit.gap_end = pos;
+}
+
+static void edit_buffer_home()
+{
+	int n = g_edit.gap;
+
+	g_edit.gap_end -= n;
+	memmove(g_edit.buf + g_edit.gap_end, g_edit.buf, n);
+	g_edit.gap = 0;
+}
+
+static void edit_buffer_end()
+{
+	int n = g_edit.size - g_edit.gap_end;
+
+	memmove(g_edit.buf + g_edit.gap, g_edit.buf + g_edit.gap_end, n);
+	g_edit.gap += n;
+	g_edit.gap_end = g_edit.size;
+}
+
+// the character before the cursor
+static void edit_buffer_backspace()
+{
+	while (g_edit.gap > 0 && utf8_continuation(g_edit.buf[--g_edit.gap]))
+		;
+}
+
+// the character after the cursor
+static void edit_buffer_delete()
+{
+	if (g_edit.gap_end == g_edit.size)
+		return;
+
+	while (++g_edit.gap_end < g_edit.size &&
+	       utf8_continuation(g_edit.buf[g_edit.gap_end]))
+		;
+}
+
+// the spaces before the cursor and the word before them. a space byte is
+// never part of a longer utf-8 character
+static void edit_buffer_pop_word()
+{
+	while (g_edit.gap > 0 && g_edit.buf[g_edit.gap - 1] == ' ')
+		g_edit.gap--;
+
+	while (g_edit.gap > 0 && g_edit.buf[g_edit.gap - 1] != ' ')
+		g_edit.gap--;
+}
+
+static struct ical *get_selected_calendar(struct cal *cal)
+{
+	if (cal->ncalendars == 0 || cal->selected_calendar_ind == -1)
+		return NULL;
+	return &cal->calendars[cal->selected_calendar_ind];
+}
+
+static struct event *get_selected_event(struct cal *cal)
+{
+	if (cal->nevents == 0 || cal->selected_event_ind == -1)
+		return NULL;
+	return &cal->events[cal->selected_event_ind];
+}
+
+static int sort_vevent_ptr(const void *a, const void *b)
+{
+	const icalcomponent *va = *(icalcomponent * const *)a;
+	const icalcomponent *vb = *(icalcomponent * const *)b;
+
+	return va < vb ? -1 : va > vb;
+}
+
+// flag the view's events that are in the visual range with EV_SELECTED
+static void visual_mark(struct cal *cal)
+{
+	struct event *ev;
+	int i;
+
+	for (i = 0; i < cal->nevents; i++) {
+		ev = &cal->events[i];
+
+		if ((cal->flags & CAL_VISUAL) &&
+		    bsearch(&ev->vevent, cal->visual, cal->nvisual,
+			    sizeof(*cal->visual), sort_vevent_ptr))
+			ev->flags |= EV_SELECTED;
+		else
+			ev->flags &= ~EV_SELECTED;
+	}
+}
+
+// the visual range is the span between the anchor and the selection when
+// the selection moves. after that it's a set of events, so moving them
+// past others doesn't pull those in when the view is re-sorted
+static void visual_update(struct cal *cal)
+{
+	struct event *sel = get_selected_event(cal);
+	icalcomponent *cursor = sel ? sel->vevent : NULL;
+	int i, a, b, first, last;
+
+	if (!(cal->flags & CAL_VISUAL) || cursor == cal->visual_cursor)
+		return;
+
+	a = cal->selected_event_ind;
+	b = cal->visual_ind;
+
+	if (a == -1)
+		a = b;
+	if (b == -1)
+		b = a;
+
+	cal->visual_cursor = cursor;
+	cal->nvisual = 0;
+
+	if (a != -1) {
+		first = min(a, b);
+		last = max(a, b);
+
+		cal->visual = grow_array(cal->visual, &cal->visual_size,
+					 last - first + 1, sizeof(*cal->visual));
+
+		for (i = first; i <= last; i++)
+			cal->visual[cal->nvisual++] = cal->events[i].vevent;
+
+		qsort(cal->visual, cal->nvisual, sizeof(*cal->visual),
+		      sort_vevent_ptr);
+	}
+
+	visual_mark(cal);
+}
+
+// whether the view's i-th event is in the visual range, or is the
+// selected event outside of visual mode
+static int in_selection(struct cal *cal, int i)
+{
+	if (cal->flags & CAL_VISUAL)
+		return cal->events[i].flags & EV_SELECTED;
+
+	return i == cal->selected_event_ind;
+}
+
+// the visual range, or just the selected event outside of visual mode.
+// returns how many events are in it, first and last bound them in the
+// view. walk between them with in_selection, others can sit in between
+static int selection_range(struct cal *cal, int *first, int *last)
+{
+	int i, n = 0;
+
+	if (!(cal->flags & CAL_VISUAL)) {
+		if (cal->selected_event_ind == -1)
+			return 0;
+
+		*first = *last = cal->selected_event_ind;
+		return 1;
+	}
+
+	visual_update(cal);
+
+	for (i = 0; i < cal->nevents; i++) {
+		if (!(cal->events[i].flags & EV_SELECTED))
+			continue;
+
+		if (n++ == 0)
+			*first = i;
+		*last = i;
+	}
+
+	return n;
+}
+
+static int event_in_selection(struct cal *cal, struct event *ev)
+{
+	int i = ev - cal->events;
+
+	if (!(cal->flags & CAL_VISUAL) || i < 0 || i >= cal->nevents)
+		return 0;
+
+	visual_update(cal);
+	return ev->flags & EV_SELECTED;
+}
+
+static struct event *get_target(struct cal *cal) {
+	if (cal->target == -1)
+		return NULL;
+
+	return &cal->events[cal->target];
+}
+
+enum edit_mode_flags {
+	EDIT_CLEAR       = 1 << 1,
+	EDIT_DESCRIPTION = 1 << 2,
+	EDIT_LOCATION    = 1 << 3,
+};
+
+static void edit_mode(struct cal *cal, int flags)
+{
+	// TODO: STATUS BAR for edit mode
+
+	struct event *event =
+		get_selected_event(cal);
+	const char *text;
+
+	// don't enter edit mode if we're not selecting any event
+	if (!event)
+		return;
+
+	cal->flags |= CAL_CHANGING;
+
+	if (flags & EDIT_DESCRIPTION) {
+		cal->edit_field = FIELD_DESCRIPTION;
+		text = icalcomponent_get_description(event->vevent);
+	} else if (flags & EDIT_LOCATION) {
+		cal->edit_field = FIELD_LOCATION;
+		text = icalcomponent_get_location(event->vevent);
+	} else {
+		cal->edit_field = FIELD_SUMMARY;
+		text = icalcomponent_get_summary(event->vevent);
+	}
+
+	// the cursor starts at the end
+	set_edit_buffer(flags & EDIT_CLEAR ? "" : text);
+}
+
+
+static int find_event_index(struct cal *cal, icalcomponent *vevent)
+{
+	if (vevent == NULL)
+		return -1;
+
+	for (int i = 0; i < cal->nevents; i++) {
+		if (cal->events[i].vevent == vevent)
+			return i;
+	}
+
+	return -1;
+}
+
+static struct event *calendar_event(struct ical *ical, icalcomponent *vevent)
+{
+	for (int i = 0; i < ical->nevents; i++) {
+		if (ical->events[i].vevent == vevent)
+			return &ical->events[i];
+	}
+
+	return NULL;
+}
+
+// rebuild and sort a single calendar's event list. event state that
+// isn't stored in the vevent itself (locking) is carried over
+static void calendar_sort_events(struct ical *calendar)
+{
+	struct event *event, *old, key;
+	struct event *prev = NULL;
+	int nprev = calendar->nevents;
+	icalcomponent *vevent;
+	icalcomponent *ical = calendar->calendar;
+	icalproperty *transp;
+
+	if (nprev > 0) {
+		prev = malloc(nprev * sizeof(*prev));
+		assert(prev);
+		memcpy(prev, calendar->events, nprev * sizeof(*prev));
+		qsort(prev, nprev, sizeof(*prev), sort_event_vevent);
+	}
+
+	calendar->nevents = 0;
+	calendar->longest = 0;
+
+	for (vevent = icalcomponent_get_first_component(ical, ICAL_VEVENT_COMPONENT);
+	     vevent != NULL;
+	     vevent = icalcomponent_get_next_component(ical, ICAL_VEVENT_COMPONENT))
+	{
+		calendar->events =
+			grow_array(calendar->events, &calendar->events_size,
+				   calendar->nevents + 1, sizeof(*calendar->events));
+
+		event = &calendar->events[calendar->nevents++];
+		memset(event, 0, sizeof(*event));
+		event->vevent = vevent;
+		event->ical = calendar;
+		vevent_span_timet(calendar, vevent, &event->start, &event->end);
+		calendar->longest = max(calendar->longest,
+					event->end - event->start);
+
+		key.vevent = vevent;
+		old = prev == NULL ? NULL :
+			bsearch(&key, prev, nprev, sizeof(*prev), sort_event_vevent);
+
+		if (old)
+			event->flags = old->flags & EV_IMMOVABLE;
+
+		transp = icalcomponent_get_first_property(vevent,
+							  ICAL_TRANSP_PROPERTY);
+		if ((transp && icalproperty_get_transp(transp) ==
+			       ICAL_TRANSP_TRANSPARENT) ||
+		    icalcomponent_get_status(vevent) == ICAL_STATUS_CANCELLED)
+			event->flags |= EV_FREE;
+	}
+
+	free(prev);
+
+	qsort(calendar->events, calendar->nevents, sizeof(struct event),
+	      sort_event);
+
+	calendar->dirty = false;
+}
+
+struct merge_head {
+	int calendar;
+	int pos;
+};
+
+static int merge_head_less(struct cal *cal, struct merge_head *a,
+			   struct merge_head *b)
+{
+	time_t sta = cal->calendars[a->calendar].events[a->pos].start;
+	time_t stb = cal->calendars[b->calendar].events[b->pos].start;
+
+	if (sta != stb)
+		return sta < stb;
+
+	return a->calendar < b->calendar;
+}
+
+static void merge_heap_down(struct cal *cal, struct merge_head *heap, int n,
+			    int i)
+{
+	struct merge_head tmp;
+	int smallest, l, r;
+
+	for (;;) {
+		smallest = i;
+		l = 2*i + 1;
+		r = 2*i + 2;
+
+		if (l < n && merge_head_less(cal, &heap[l], &heap[smallest]))
+			smallest = l;
+		if (r < n && merge_head_less(cal, &heap[r], &heap[smallest]))
+			smallest = r;
+
+		if (smallest == i)
+			return;
+
+		tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+// the event view only ever contains events from visible calendars, so
+// everything that walks cal->events (drawing, navigation, hit testing)
+// gets visibility filtering for free
+//
+// each calendar keeps its own sorted list, so the view is just a k-way
+// merge of those. only calendars that changed get re-sorted.
+static void events_for_view(struct cal *cal, time_t start, time_t end)
+{
+	int i, n, total;
+	struct ical *calendar;
+	struct merge_head heap[ARRAY_SIZE(cal->calendars)];
+	struct merge_head *top;
+	icalcomponent *selected, *anchor;
+	struct event target = {0}, *ptarget;
+
+	gint64 trace = trace_begin();
+
+	// indices change after sorting, remember what they pointed at
+	selected = get_selected_event(cal) ? get_selected_event(cal)->vevent : NULL;
+	anchor = cal->visual_ind != -1 ? cal->events[cal->visual_ind].vevent : NULL;
+	ptarget = get_target(cal);
+	if (ptarget)
+		target = *ptarget;
+
+	n = 0;
+	total = 0;
+
+	for (i = 0; i < cal->ncalendars; ++i) {
+		calendar = &cal->calendars[i];
+
+		if (!calendar->visible)
+			continue;
+
+		if (calendar->dirty)
+			calendar_sort_events(calendar);
+
+		total += calendar->nevents;
+
+		if (calendar->nevents > 0) {
+			heap[n].calendar = i;
+			heap[n].pos = 0;
+			n++;
+		}
+	}
+
+	cal->events = grow_array(cal->events, &cal->events_size, total,
+				 sizeof(*cal->events));
+	cal->nevents = 0;
+
+	for (i = n/2 - 1; i >= 0; i--)
+		merge_heap_down(cal, heap, n, i);
+
+	while (n > 0) {
+		top = &heap[0];
+		calendar = &cal->calendars[top->calendar];
+		cal->events[cal->nevents++] = calendar->events[top->pos];
+
+		if (++top->pos == calendar->nevents)
+			heap[0] = heap[--n];
+
+		merge_heap_down(cal, heap, n, 0);
+	}
+
+	// selection disappears if its calendar was hidden
+	cal->selected_event_ind = find_event_index(cal, selected);
+	cal->visual_ind = find_event_index(cal, anchor);
+	cal->target = find_event_index(cal, ptarget ? target.vevent : NULL);
+
+	// keep an in-progress drag going
+	if ((ptarget = get_target(cal))) {
+		ptarget->flags = target.flags;
+		ptarget->dragx = target.dragx;
+		ptarget->dragy = target.dragy;
+		ptarget->dragx_off = target.dragx_off;
+		ptarget->dragy_off = target.dragy_off;
+		ptarget->drag_time = target.drag_time;
+	}
+
+	visual_mark(cal);
+
+	// useful for selecting a new event after insertion
+	if (cal->select_after_sort) {
+		for (i = 0; i < cal->nevents; i++) {
+			if (cal->events[i].vevent == cal->select_after_sort) {
+				select_event(cal, i);
+				// pastes and search jumps only want the selection
+				if (cal->flags & CAL_INSERTING)
+					edit_mode(cal, 0);
+				break;
+			}
+		}
+	}
+
+	cal->select_after_sort = NULL;
+
+	trace_end(TRACE_EVENTS_FOR_VIEW, trace);
+}
+
+
+static void on_change_view(struct cal *cal) {
+	events_for_view(cal, calendar_view_start(cal), calendar_view_end(cal));
+}
+
+
+// free/busy
+//
+// the busy time of the visible calendars merged into disjoint intervals.
+// every calendar's events are sorted by start and know where they end,
+// so this is the view's k-way merge run over just the range, joining
+// overlaps as it goes. an event can't start further back than the
+// calendar's longest one and still reach into the range.
+struct busy {
+	time_t st, et;
+};
+
+// first event starting at or after t
+static int event_lower_bound(struct ical *ical, time_t t)
+{
+	int lo = 0, hi = ical->nevents, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ical->events[mid].start < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int freebusy(struct cal *cal, time_t from, time_t to,
+		    struct busy **busy, int *busy_size)
+{
+	struct merge_head heap[ARRAY_SIZE(cal->calendars)];
+	int last[ARRAY_SIZE(cal->calendars)];
+	struct merge_head *top;
+	struct ical *ical;
+	struct event *ev;
+	time_t st, et;
+	int i, n = 0, nbusy = 0;
+
+	for (i = 0; i < cal->ncalendars; ++i) {
+		ical = &cal->calendars[i];
+
+		if (!ical->visible)
+			continue;
+
+		if (ical->dirty)
+			calendar_sort_events(ical);
+
+		heap[n].calendar = i;
+		heap[n].pos = event_lower_bound(ical, from - ical->longest);
+		last[i] = event_lower_bound(ical, to);
+
+		if (heap[n].pos < last[i])
+			n++;
+	}
+
+	for (i = n/2 - 1; i >= 0; i--)
+		merge_heap_down(cal, heap, n, i);
+
+	while (n > 0) {
+		top = &heap[0];
+		ical = &cal->calendars[top->calendar];
+		ev = &ical->events[top->pos];
+
+		st = max(ev->start, from);
+		et = min(ev->end, to);
+
+		if (!(ev->flags & EV_FREE) && et > st) {
+			if (nbusy > 0 && st <= (*busy)[nbusy - 1].et) {
+				(*busy)[nbusy - 1].et = max((*busy)[nbusy - 1].et, et);
+			} else {
+				*busy = grow_array(*busy, busy_size, nbusy + 1,
+						   sizeof(**busy));
+				(*busy)[nbusy].st = st;
+				(*busy)[nbusy++].et = et;
+			}
+		}
+
+		if (++top->pos == last[top->calendar])
+			heap[0] = heap[--n];
+
+		merge_heap_down(cal, heap, n, 0);
+	}
+
+	return nbusy;
+}
+
+static void format_utc(char *buffer, int bsize, time_t t, int json)
+{
+	long year, days = floor_div(t, DAY_SECONDS);
+	long secs = t - days * DAY_SECONDS;
+	unsigned month, day;
+
+	civil_from_days(days, &year, &month, &day);
+	snprintf(buffer, bsize, json ? "%04ld-%02u-%02uT%02ld:%02ld:%02ldZ"
+				     : "%04ld%02u%02uT%02ld%02ld%02ldZ",
+		 year, month, day, secs / 3600, secs / 60 % 60, secs % 60);
+}
+
+// a VFREEBUSY, or {"start", "end", "busy": [[start, end], ...]} in json
+static void export_freebusy(struct cal *cal, FILE *out, time_t from,
+			    time_t to, int json)
+{
+	struct busy *busy = NULL;
+	int i, nbusy, busy_size = 0;
+	char st[32], et[32];
+
+	gint64 trace = trace_begin();
+	nbusy = freebusy(cal, from, to, &busy, &busy_size);
+	trace_end(TRACE_FREEBUSY, trace);
+
+	format_utc(st, sizeof(st), from, json);
+	format_utc(et, sizeof(et), to, json);
+
+	if (json) {
+		fprintf(out, "{\"start\":\"%s\",\"end\":\"%s\",\"busy\":[",
+			st, et);
+	} else {
+		fprintf(out, "BEGIN:VCALENDAR\r\n"
+			"VERSION:2.0\r\n"
+			"PRODID:-//viscal//EN\r\n"
+			"METHOD:PUBLISH\r\n"
+			"BEGIN:VFREEBUSY\r\n");
+		fprintf(out, "DTSTART:%s\r\nDTEND:%s\r\n", st, et);
+		format_utc(st, sizeof(st), time(NULL), json);
+		fprintf(out, "DTSTAMP:%s\r\n", st);
+	}
+
+	for (i = 0; i < nbusy; i++) {
+		format_utc(st, sizeof(st), busy[i].st, json);
+		format_utc(et, sizeof(et), busy[i].et, json);
+
+		if (json)
+			fprintf(out, "%s[\"%s\",\"%s\"]", i ? "," : "", st, et);
+		else
+			fprintf(out, "FREEBUSY:%s/%s\r\n", st, et);
+	}
+
+	if (json)
+		fprintf(out, "]}\n");
+	else
+		fprintf(out, "END:VFREEBUSY\r\nEND:VCALENDAR\r\n");
+
+	free(busy);
+}
+
+
+/* static void */
+/* calendar_print_state(struct cal *cal) { */
+/* 	static int c = 0; */
+/* 	printf("%f %d %d %s %s %d\r", */
+/* 	       cal->zoom, cal->mx, cal->my, */
+/* 	       (cal->flags & CAL_DRAGGING) != 0 ? "D " : "  ", */
+/* 	       (cal->flags & CAL_MDOWN)    != 0 ? "M " : "  ", */
+/* 	       c++ */
+/* 		); */
+/* 	fflush(stdout); */
+/* } */
+
+// gtk redraws on its own, sdl.c draws a frame when it sees needs_draw
+static void calendar_queue_draw(struct cal *cal) {
+	cal->needs_draw = 1;
+
+	if (cal->widget)
+		gtk_widget_queue_draw(cal->widget);
+}
+
+static void calendar_refresh_events(struct cal *cal) {
+	cal->refresh_events = 1;
+	calendar_queue_draw(cal);
+}
+
+// call whenever a calendar's events are added, removed or rescheduled
+static void calendar_changed(struct cal *cal, struct ical *ical) {
+	ical->dirty = true;
+	ical->search_dirty = true;
+	calendar_refresh_events(cal);
+}
+
+
+static int on_state_change(GtkWidget *widget, GdkEvent *ev, gpointer user_data) {
+	struct extra_data *data = (struct extra_data*)user_data;
+	struct cal *cal = data->cal;
+
+		/* calendar_refresh_events(cal); */
+	calendar_queue_draw(cal);
+	/* calendar_print_state(cal); */
+
+	return 1;
+}
+
+
+static char * file_load(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (!f) return NULL;
+	fseek(f, 0, SEEK_END);
+	long fsize = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	char *string = malloc(fsize + 1);
+	int res = fread(string, fsize, 1, f);
+	fclose(f);
+	if (!res) {
+		free(string);
+		return NULL;
+	}
+	string[fsize] = '\0';
+	return string;
+}
+
+// read and parse an ics file. doesn't touch any viscal state, so this is
+// safe to call from the loader threads
+static icalcomponent *calendar_parse_file(const char *path)
+{
+	// TODO: free icalcomponent somewhere
+	const char *str = file_load(path);
+	if (str == NULL) {
+		log_error("failed to read calendar %s", path);
+		return NULL;
+	}
+
+	icalcomponent *calendar = icalparser_parse_string(str);
+	free((void*)str);
+
+	if (!calendar) {
+		log_error("failed to parse calendar %s", path);
+		return NULL;
+	}
+
+	return calendar;
+}
+
+static void calendar_init(struct ical *ical, icalcomponent *calendar,
+			  const char *path)
+{
+	memset(ical, 0, sizeof(*ical));
+	ical->calendar = calendar;
+	ical->source = SOURCE_FILE;
+	ical->source_location = path;
+	ical->visible = true;
+	ical->dirty = true;
+	ical->search_dirty = true;
+}
+
+// caldav
+//
+// a calendar given as an http(s) url is a CalDAV collection. it opens from
+// a local copy in $XDG_CACHE_HOME/viscal/caldav and is brought up to date
+// in the background. with a sync-token the server lists only what changed
+// since last time (RFC 6578), otherwise the ctag says whether anything
+// changed and the etags say what. only changed resources are fetched.
+//
+// saving a calendar only notes that it changed. a couple of seconds later
+// the events that differ from the server's copy are queued by UID, each at
+// most once, so a burst of edits to one event is one upload of its final
+// state. uploads carry the etag we last saw, so if someone else changed an
+// event the server refuses and its copy comes down with the next sync.
+// failed uploads are retried with backoff, the queue is kept with the
+// cache so it survives a restart.
+//
+// a few uploads run at once. syncs wait for them, and they for syncs
+
+static bool caldav_is_url(const char *path)
+{
+	return g_str_has_prefix(path, "http://") ||
+	       g_str_has_prefix(path, "https://");
+}
+
+#ifdef VISCAL_CALDAV
+#define CALDAV_SYNC_INTERVAL 300
+#define CALDAV_MULTIGET 64
+#define CALDAV_UPLOADS 4
+#define CALDAV_FLUSH_DELAY (2 * G_TIME_SPAN_SECOND)
+#define CALDAV_BACKOFF_MIN (5 * G_TIME_SPAN_SECOND)
+#define CALDAV_BACKOFF_MAX (10 * G_TIME_SPAN_MINUTE)
+// how often sdl.c checks on requests in flight
+#define CALDAV_POLL_MS 50
+
+struct caldav;
+
+// uid is set for uploads
+typedef void (caldav_done)(struct caldav *, SoupMessage *, const char *uid);
+
+// what we know about an event on the server. etag is NULL until the
+// server has a copy
+struct caldav_resource {
+	char *uid;
+	char *href;
+	char *etag;
+	guint hash; // of the server's copy, as we'd upload it
+	guint sending_hash;
+	bool deleted; // here, maybe not on the server yet
+	bool queued;
+	bool sending;
+	bool seen;
+};
+
+struct caldav_request {
+	struct caldav *dav;
+	caldav_done *done;
+	char *uid;
+};
+
+struct caldav {
+	struct cal *cal;
+	struct ical *ical;
+	SoupURI *base;
+	char *cache;
+
+	char *sync_token, *ctag;
+	GHashTable *resources; // uid -> resource
+	GHashTable *hrefs; // href -> resource, not owned
+
+	GQueue outbox; // UIDs with changes to upload
+	int inflight;
+	bool syncing;
+	bool want_sync;
+	bool unsaved; // saved since the last flush
+
+	// monotonic times, 0 for not scheduled
+	gint64 flush_at, retry_at, sync_at;
+	gint64 backoff;
+	guint timer;
+
+	// during a sync
+	char *next_token, *next_ctag;
+	GPtrArray *fetch;
+	guint fetched;
+};
+
+static SoupSession *g_soup;
+
+// multistatus responses, parsed with GMarkup. we only look at the local
+// part of element names, servers disagree on namespace prefixes
+struct dav_response {
+	char *href;
+	char *etag;
+	char *data;
+	int status;
+};
+
+struct dav_parse {
+	GPtrArray *responses;
+	struct dav_response *cur;
+	GString *text;
+	bool in_propstat;
+	int propstat_status;
+	char *etag, *data;
+	char *sync_token, *ctag;
+};
+
+static void dav_response_free(gpointer data)
+{
+	struct dav_response *res = data;
+
+	g_free(res->href);
+	g_free(res->etag);
+	g_free(res->data);
+	g_free(res);
+}
+
+static const char *dav_local_name(const char *name)
+{
+	const char *colon = strrchr(name, ':');
+	return colon ? colon + 1 : name;
+}
+
+static int dav_status(const char *line)
+{
+	int status = 0;
+	sscanf(line, "%*s %d", &status);
+	return status;
+}
+
+static void dav_start(GMarkupParseContext *ctx, const char *name,
+		      const char **attr_names, const char **attr_values,
+		      gpointer user_data, GError **err)
+{
+	struct dav_parse *p = user_data;
+
+	name = dav_local_name(name);
+	g_string_truncate(p->text, 0);
+
+	if (!strcmp(name, "response")) {
+		p->cur = g_new0(struct dav_response, 1);
+		p->cur->status = 200;
+		g_ptr_array_add(p->responses, p->cur);
+	} else if (!strcmp(name, "propstat")) {
+		p->in_propstat = true;
+		p->propstat_status = 200;
+	}
+}
+
+static void dav_end(GMarkupParseContext *ctx, const char *name,
+		    gpointer user_data, GError **err)
+{
+	struct dav_parse *p = user_data;
+	struct dav_response *cur = p->cur;
+	char **field = NULL;
+
+	name = dav_local_name(name);
+
+	if (!strcmp(name, "response")) {
+		p->cur = NULL;
+	} else if (!strcmp(name, "propstat")) {
+		// properties the server couldn't give us don't count
+		if (cur && p->propstat_status == 200 && p->etag) {
+			g_free(cur->etag);
+			cur->etag = g_steal_pointer(&p->etag);
+		}
+		if (cur && p->propstat_status == 200 && p->data) {
+			g_free(cur->data);
+			cur->data = g_steal_pointer(&p->data);
+		}
+		g_clear_pointer(&p->etag, g_free);
+		g_clear_pointer(&p->data, g_free);
+		p->in_propstat = false;
+	} else if (!strcmp(name, "status")) {
+		if (p->in_propstat)
+			p->propstat_status = dav_status(p->text->str);
+		else if (cur)
+			cur->status = dav_status(p->text->str);
+	} else if (!strcmp(name, "href") && cur && !cur->href) {
+		field = &cur->href;
+	} else if (!strcmp(name, "getetag")) {
+		field = &p->etag;
+	} else if (!strcmp(name, "calendar-data")) {
+		field = &p->data;
+	} else if (!strcmp(name, "sync-token")) {
+		field = &p->sync_token;
+	} else if (!strcmp(name, "getctag")) {
+		field = &p->ctag;
+	}
+
+	if (field) {
+		g_free(*field);
+		*field = g_strdup(g_strstrip(p->text->str));
+	}
+}
+
+static void dav_text(GMarkupParseContext *ctx, const char *text, gsize len,
+		     gpointer user_data, GError **err)
+{
+	struct dav_parse *p = user_data;
+	g_string_append_len(p->text, text, len);
+}
+
+// some servers wrap calendar-data in CDATA, which GMarkup passes through
+static void dav_passthrough(GMarkupParseContext *ctx, const char *text,
+			    gsize len, gpointer user_data, GError **err)
+{
+	static const char open[] = "<![CDATA[", close[] = "]]>";
+	struct dav_parse *p = user_data;
+
+	if (len >= strlen(open) + strlen(close) && g_str_has_prefix(text, open))
+		g_string_append_len(p->text, text + strlen(open),
+				    len - strlen(open) - strlen(close));
+}
+
+static const GMarkupParser dav_parser = {
+	.start_element = dav_start,
+	.end_element = dav_end,
+	.text = dav_text,
+	.passthrough = dav_passthrough,
+};
+
+static bool dav_parse(SoupMessage *msg, struct dav_parse *p)
+{
+	GMarkupParseContext *ctx;
+	GError *err = NULL;
+	bool ok;
+
+	memset(p, 0, sizeof(*p));
+	p->responses = g_ptr_array_new_with_free_func(dav_response_free);
+	p->text = g_string_new(NULL);
+
+	ctx = g_markup_parse_context_new(&dav_parser, 0, p, NULL);
+	ok = g_markup_parse_context_parse(ctx, msg->response_body->data,
+					  msg->response_body->length, &err) &&
+	     g_markup_parse_context_end_parse(ctx, &err);
+	g_markup_parse_context_free(ctx);
+
+	if (!ok) {
+		log_warn("caldav: bad multistatus: %s", err->message);
+		g_error_free(err);
+	}
+
+	return ok;
+}
+
+static void dav_parse_free(struct dav_parse *p)
+{
+	g_ptr_array_unref(p->responses);
+	g_string_free(p->text, TRUE);
+	g_free(p->etag);
+	g_free(p->data);
+	g_free(p->sync_token);
+	g_free(p->ctag);
+}
+
+static void caldav_resource_free(gpointer data)
+{
+	struct caldav_resource *res = data;
+
+	g_free(res->uid);
+	g_free(res->href);
+	g_free(res->etag);
+	g_free(res);
+}
+
+static struct caldav_resource *caldav_resource(struct caldav *dav,
+					       const char *uid,
+					       const char *href)
+{
+	struct caldav_resource *res;
+
+	res = g_hash_table_lookup(dav->resources, uid);
+	if (res)
+		return res;
+
+	res = g_new0(struct caldav_resource, 1);
+	res->uid = g_strdup(uid);
+	res->href = g_strdup(href);
+	g_hash_table_insert(dav->resources, res->uid, res);
+	g_hash_table_insert(dav->hrefs, res->href, res);
+	return res;
+}
+
+static void caldav_resource_move(struct caldav *dav,
+				 struct caldav_resource *res, const char *href)
+{
+	if (!strcmp(res->href, href))
+		return;
+
+	g_hash_table_remove(dav->hrefs, res->href);
+	g_free(res->href);
+	res->href = g_strdup(href);
+	g_hash_table_insert(dav->hrefs, res->href, res);
+}
+
+static void caldav_resource_drop(struct caldav *dav,
+				 struct caldav_resource *res)
+{
+	g_hash_table_remove(dav->hrefs, res->href);
+	g_hash_table_remove(dav->resources, res->uid);
+}
+
+static char *caldav_cache_dir(const char *url)
+{
+	char *name, *dir;
+
+	name = g_compute_checksum_for_string(G_CHECKSUM_SHA1, url, -1);
+	dir = g_build_filename(g_get_user_cache_dir(), "viscal", "caldav",
+			       name, NULL);
+	g_free(name);
+	return dir;
+}
+
+// the local copy, parsed on the loader threads like any other calendar
+static icalcomponent *caldav_load_cache(const char *url)
+{
+	char *dir = caldav_cache_dir(url);
+	char *path = g_build_filename(dir, "calendar.ics", NULL);
+	icalcomponent *calendar = NULL;
+
+	if (g_file_test(path, G_FILE_TEST_EXISTS))
+		calendar = calendar_parse_file(path);
+
+	if (calendar == NULL)
+		calendar = icalcomponent_new(ICAL_VCALENDAR_COMPONENT);
+
+	g_free(path);
+	g_free(dir);
+	return calendar;
+}
+
+static bool caldav_write(struct caldav *dav, const char *name,
+			 const char *contents)
+{
+	GError *err = NULL;
+	char *path;
+	bool ok;
+
+	if (g_mkdir_with_parents(dav->cache, 0700) != 0) {
+		log_warn("caldav: can't create %s", dav->cache);
+		return false;
+	}
+
+	path = g_build_filename(dav->cache, name, NULL);
+	ok = g_file_set_contents(path, contents, -1, &err);
+	if (!ok) {
+		log_warn("caldav: %s", err->message);
+		g_error_free(err);
+	}
+	g_free(path);
+	return ok;
+}
+
+// etags, hashes and the outbox, small enough to write after every upload
+static void caldav_store_state(struct caldav *dav)
+{
+	GHashTableIter iter;
+	GKeyFile *state;
+	GPtrArray *outbox;
+	struct caldav_resource *res;
+	char *str;
+
+	state = g_key_file_new();
+	if (dav->sync_token)
+		g_key_file_set_string(state, "collection", "sync-token",
+				      dav->sync_token);
+	if (dav->ctag)
+		g_key_file_set_string(state, "collection", "ctag", dav->ctag);
+
+	g_hash_table_iter_init(&iter, dav->resources);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&res)) {
+		g_key_file_set_string(state, res->href, "uid", res->uid);
+		if (res->etag)
+			g_key_file_set_string(state, res->href, "etag",
+					      res->etag);
+		g_key_file_set_uint64(state, res->href, "hash", res->hash);
+		if (res->deleted)
+			g_key_file_set_boolean(state, res->href, "deleted",
+					       TRUE);
+	}
+
+	// uploads in flight go first, they might not make it
+	outbox = g_ptr_array_new();
+	g_hash_table_iter_init(&iter, dav->resources);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&res)) {
+		if (res->sending)
+			g_ptr_array_add(outbox, res->uid);
+	}
+	for (GList *l = dav->outbox.head; l; l = l->next)
+		g_ptr_array_add(outbox, l->data);
+
+	if (outbox->len)
+		g_key_file_set_string_list(state, "outbox", "uids",
+			(const char * const *)outbox->pdata, outbox->len);
+	g_ptr_array_unref(outbox);
+
+	str = g_key_file_to_data(state, NULL, NULL);
+	caldav_write(dav, "state", str);
+	g_free(str);
+	g_key_file_free(state);
+}
+
+static void caldav_store(struct caldav *dav)
+{
+	char *str = icalcomponent_as_ical_string_r(dav->ical->calendar);
+
+	caldav_write(dav, "calendar.ics", str);
+	free(str);
+	caldav_store_state(dav);
+}
+
+static void caldav_queue(struct caldav *dav, struct caldav_resource *res,
+			 bool front);
+
+static void caldav_load_state(struct caldav *dav)
+{
+	struct caldav_resource *res;
+	GKeyFile *state = g_key_file_new();
+	char *path, **groups, **outbox, *uid;
+
+	path = g_build_filename(dav->cache, "state", NULL);
+
+	if (g_key_file_load_from_file(state, path, 0, NULL)) {
+		dav->sync_token = g_key_file_get_string(state, "collection",
+							"sync-token", NULL);
+		dav->ctag = g_key_file_get_string(state, "collection", "ctag",
+						  NULL);
+
+		groups = g_key_file_get_groups(state, NULL);
+		for (int i = 0; groups[i]; i++) {
+			uid = g_key_file_get_string(state, groups[i], "uid",
+						    NULL);
+			if (!uid)
+				continue;
+
+			res = caldav_resource(dav, uid, groups[i]);
+			res->etag = g_key_file_get_string(state, groups[i],
+							  "etag", NULL);
+			res->hash = g_key_file_get_uint64(state, groups[i],
+							  "hash", NULL);
+			res->deleted = g_key_file_get_boolean(state, groups[i],
+							      "deleted", NULL);
+			g_free(uid);
+		}
+		g_strfreev(groups);
+
+		// what we didn't get to last time
+		outbox = g_key_file_get_string_list(state, "outbox", "uids",
+						    NULL, NULL);
+		for (int i = 0; outbox && outbox[i]; i++) {
+			res = g_hash_table_lookup(dav->resources, outbox[i]);
+			if (res)
+				caldav_queue(dav, res, false);
+		}
+		g_strfreev(outbox);
+	}
+
+	g_free(path);
+	g_key_file_free(state);
+}
+
+// every vevent in the calendar by UID. recurrence overrides share one
+static GHashTable *caldav_events_by_uid(struct ical *ical)
+{
+	GHashTable *uids;
+	GPtrArray *vevents;
+	icalcomponent *vevent;
+	const char *uid;
+	char *new_uid;
+
+	uids = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+				     (GDestroyNotify)g_ptr_array_unref);
+
+	for (vevent = icalcomponent_get_first_component(ical->calendar,
+						       ICAL_VEVENT_COMPONENT);
+	     vevent != NULL;
+	     vevent = icalcomponent_get_next_component(ical->calendar,
+						      ICAL_VEVENT_COMPONENT)) {
+		// a resource is named by its UID, events made here have none
+		if (!(uid = icalcomponent_get_uid(vevent))) {
+			new_uid = g_uuid_string_random();
+			icalcomponent_set_uid(vevent, new_uid);
+			g_free(new_uid);
+			uid = icalcomponent_get_uid(vevent);
+		}
+
+		vevents = g_hash_table_lookup(uids, uid);
+		if (!vevents) {
+			vevents = g_ptr_array_new();
+			g_hash_table_insert(uids, (gpointer)uid, vevents);
+		}
+		g_ptr_array_add(vevents, vevent);
+	}
+
+	return uids;
+}
+
+// the resource as we'd upload it: its events and the zones they use
+static char *caldav_body(struct ical *ical, GPtrArray *vevents)
+{
+	icalcomponent *vcal, *vevent;
+	char *str;
+
+	vcal = icalcomponent_new(ICAL_VCALENDAR_COMPONENT);
+	icalcomponent_add_property(vcal, icalproperty_new_version("2.0"));
+	icalcomponent_add_property(vcal,
+		icalproperty_new_prodid("-//jb55//viscal//EN"));
+
+	for (guint i = 0; i < vevents->len; i++) {
+		vevent = g_ptr_array_index(vevents, i);
+		calendar_copy_timezone(ical, vcal, icalcomponent_get_first_property(
+			vevent, ICAL_DTSTART_PROPERTY));
+		calendar_copy_timezone(ical, vcal, icalcomponent_get_first_property(
+			vevent, ICAL_DTEND_PROPERTY));
+	}
+
+	for (guint i = 0; i < vevents->len; i++) {
+		vevent = g_ptr_array_index(vevents, i);
+		icalcomponent_add_component(vcal,
+					    icalcomponent_new_clone(vevent));
+	}
+
+	str = icalcomponent_as_ical_string_r(vcal);
+	icalcomponent_free(vcal);
+	return str;
+}
+
+static SoupMessage *caldav_message(struct caldav *dav, const char *method,
+				   const char *href)
+{
+	SoupURI *uri = href ? soup_uri_new_with_base(dav->base, href)
+			    : soup_uri_copy(dav->base);
+	SoupMessage *msg = soup_message_new_from_uri(method, uri);
+
+	soup_uri_free(uri);
+	return msg;
+}
+
+static void caldav_set_body(SoupMessage *msg, const char *type,
+			    const char *body)
+{
+	soup_message_set_request(msg, type, SOUP_MEMORY_COPY, body,
+				 strlen(body));
+}
+
+static void caldav_kick(struct caldav *dav);
+
+static void caldav_response(SoupSession *session, SoupMessage *msg,
+			    gpointer user_data)
+{
+	struct caldav_request *req = user_data;
+	struct caldav *dav = req->dav;
+
+	dav->inflight--;
+	req->done(dav, msg, req->uid);
+
+	// a sync is a chain of requests, it's over when one doesn't send
+	// another
+	if (!req->uid && !dav->inflight)
+		dav->syncing = false;
+
+	g_free(req->uid);
+	g_free(req);
+	caldav_kick(dav);
+}
+
+// send a request, done runs with the response and may send another
+static void caldav_send(struct caldav *dav, SoupMessage *msg,
+			caldav_done *done, char *uid)
+{
+	struct caldav_request *req = g_new0(struct caldav_request, 1);
+
+	req->dav = dav;
+	req->done = done;
+	req->uid = uid;
+	dav->inflight++;
+	soup_session_queue_message(g_soup, msg, caldav_response, req);
+}
+
+static void caldav_report(struct caldav *dav, const char *method,
+			  const char *depth, char *body, caldav_done *done)
+{
+	SoupMessage *msg = caldav_message(dav, method, NULL);
+
+	soup_message_headers_append(msg->request_headers, "Depth", depth);
+	caldav_set_body(msg, "application/xml; charset=utf-8", body);
+	g_free(body);
+	caldav_send(dav, msg, done, NULL);
+}
+
+static bool caldav_failed(struct caldav *dav, SoupMessage *msg,
+			  const char *what)
+{
+	if (SOUP_STATUS_IS_SUCCESSFUL(msg->status_code))
+		return false;
+
+	log_warn("caldav: %s %s: %d %s", what, soup_uri_get_path(dav->base),
+		 msg->status_code, msg->reason_phrase);
+
+	return true;
+}
+
+// local changes the server hasn't seen yet
+static bool caldav_unsent(struct caldav_resource *res)
+{
+	return res->queued || res->sending;
+}
+
+// local events for a UID. they're left for the view and any script that
+// still points at them, like everywhere else events are removed
+static void caldav_remove_events(struct caldav *dav, const char *uid)
+{
+	icalcomponent *calendar = dav->ical->calendar, *vevent;
+	GPtrArray *doomed = g_ptr_array_new();
+	const char *vuid;
+
+	for (vevent = icalcomponent_get_first_component(calendar,
+						       ICAL_VEVENT_COMPONENT);
+	     vevent != NULL;
+	     vevent = icalcomponent_get_next_component(calendar,
+						      ICAL_VEVENT_COMPONENT)) {
+		vuid = icalcomponent_get_uid(vevent);
+		if (vuid && !strcmp(vuid, uid))
+			g_ptr_array_add(doomed, vevent);
+	}
+
+	for (guint i = 0; i < doomed->len; i++)
+		icalcomponent_remove_component(calendar,
+					       g_ptr_array_index(doomed, i));
+
+	if (doomed->len)
+		calendar_changed(dav->cal, dav->ical);
+
+	g_ptr_array_unref(doomed);
+}
+
+// replace our copy of a resource with the server's
+static void caldav_apply(struct caldav *dav, struct dav_response *resp)
+{
+	icalcomponent *vcal, *comp, *calendar = dav->ical->calendar;
+	struct caldav_resource *res;
+	GPtrArray *comps, *vevents;
+	icalproperty *tzid;
+	const char *uid = NULL;
+	char *body;
+
+	vcal = icalparser_parse_string(resp->data);
+	if (!vcal) {
+		log_warn("caldav: can't parse %s", resp->href);
+		return;
+	}
+
+	comp = icalcomponent_get_first_component(vcal, ICAL_VEVENT_COMPONENT);
+	if (comp)
+		uid = icalcomponent_get_uid(comp);
+
+	if (!uid) {
+		log_warn("caldav: no event with a UID in %s", resp->href);
+		icalcomponent_free(vcal);
+		return;
+	}
+
+	// the href had another event, or this event moved hrefs
+	res = g_hash_table_lookup(dav->hrefs, resp->href);
+	if (res && strcmp(res->uid, uid) && !caldav_unsent(res)) {
+		caldav_remove_events(dav, res->uid);
+		// freed by the resources table
+		caldav_resource_drop(dav, res);
+		res = NULL;
+	}
+
+	// our unsent changes go up with the old etag and get refused if the
+	// server's copy really is newer, it comes down on the next sync
+	if (res && caldav_unsent(res))
+		res = NULL;
+	else
+		res = caldav_resource(dav, uid, resp->href);
+
+	if (!res || caldav_unsent(res)) {
+		icalcomponent_free(vcal);
+		return;
+	}
+
+	caldav_resource_move(dav, res, resp->href);
+	g_free(res->etag);
+	res->etag = g_strdup(resp->etag);
+	res->deleted = false;
+
+	caldav_remove_events(dav, uid);
+
+	comps = g_ptr_array_new();
+	for (comp = icalcomponent_get_first_component(vcal, ICAL_ANY_COMPONENT);
+	     comp != NULL;
+	     comp = icalcomponent_get_next_component(vcal, ICAL_ANY_COMPONENT))
+		g_ptr_array_add(comps, comp);
+
+	vevents = g_ptr_array_new();
+	for (guint i = 0; i < comps->len; i++) {
+		comp = g_ptr_array_index(comps, i);
+
+		if (icalcomponent_isa(comp) == ICAL_VEVENT_COMPONENT) {
+			g_ptr_array_add(vevents, comp);
+		} else if (icalcomponent_isa(comp) == ICAL_VTIMEZONE_COMPONENT) {
+			tzid = icalcomponent_get_first_property(
+				comp, ICAL_TZID_PROPERTY);
+			if (!tzid || icalcomponent_get_timezone(calendar,
+					icalproperty_get_tzid(tzid)))
+				continue;
+		} else {
+			continue;
+		}
+
+		icalcomponent_remove_component(vcal, comp);
+		icalcomponent_add_component(calendar, comp);
+	}
+
+	// so saving doesn't send it straight back
+	body = caldav_body(dav->ical, vevents);
+	res->hash = g_str_hash(body);
+	free(body);
+
+	g_ptr_array_unref(vevents);
+	g_ptr_array_unref(comps);
+	icalcomponent_free(vcal);
+	calendar_changed(dav->cal, dav->ical);
+}
+
+static void caldav_forget(struct caldav *dav, struct caldav_resource *res)
+{
+	log_debug("caldav: %s is gone", res->href);
+	caldav_remove_events(dav, res->uid);
+	caldav_resource_drop(dav, res);
+}
+
+static void caldav_sync_done(struct caldav *dav)
+{
+	if (dav->next_token) {
+		g_free(dav->sync_token);
+		dav->sync_token = dav->next_token;
+		dav->next_token = NULL;
+	}
+
+	if (dav->next_ctag) {
+		g_free(dav->ctag);
+		dav->ctag = dav->next_ctag;
+		dav->next_ctag = NULL;
+	}
+
+	g_ptr_array_set_size(dav->fetch, 0);
+	dav->fetched = 0;
+
+	caldav_store(dav);
+
+	// the view still points at events that were replaced
+	on_change_view(dav->cal);
+}
+
+static void caldav_sync_abort(struct caldav *dav)
+{
+	g_clear_pointer(&dav->next_token, g_free);
+	g_clear_pointer(&dav->next_ctag, g_free);
+	g_ptr_array_set_size(dav->fetch, 0);
+	dav->fetched = 0;
+
+	// whatever did arrive is kept, the next sync asks again for the rest
+	caldav_store(dav);
+	on_change_view(dav->cal);
+}
+
+static void caldav_multiget(struct caldav *dav);
+
+static void caldav_multiget_done(struct caldav *dav, SoupMessage *msg,
+				 const char *uid)
+{
+	struct dav_parse p;
+	struct dav_response *resp;
+
+	if (caldav_failed(dav, msg, "multiget") || !dav_parse(msg, &p)) {
+		caldav_sync_abort(dav);
+		return;
+	}
+
+	for (guint i = 0; i < p.responses->len; i++) {
+		resp = g_ptr_array_index(p.responses, i);
+		if (resp->href && resp->data && resp->status == 200)
+			caldav_apply(dav, resp);
+	}
+
+	dav_parse_free(&p);
+	caldav_multiget(dav);
+}
+
+// fetch what the listing said changed, a batch at a time
+static void caldav_multiget(struct caldav *dav)
+{
+	GString *body;
+	char *href;
+	guint i;
+
+	if (dav->fetched == dav->fetch->len) {
+		log_info("caldav: %s: %u changed", soup_uri_get_path(dav->base),
+			 dav->fetch->len);
+		caldav_sync_done(dav);
+		return;
+	}
+
+	body = g_string_new(
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+		"<c:calendar-multiget xmlns:d=\"DAV:\" "
+		"xmlns:c=\"urn:ietf:params:xml:ns:caldav\">\n"
+		"<d:prop><d:getetag/><c:calendar-data/></d:prop>\n");
+
+	for (i = 0; i < CALDAV_MULTIGET && dav->fetched < dav->fetch->len;
+	     i++) {
+		href = g_markup_escape_text(
+			g_ptr_array_index(dav->fetch, dav->fetched++), -1);
+		g_string_append_printf(body, "<d:href>%s</d:href>\n", href);
+		g_free(href);
+	}
+
+	g_string_append(body, "</c:calendar-multiget>\n");
+	caldav_report(dav, "REPORT", "1", g_string_free(body, FALSE),
+		      caldav_multiget_done);
+}
+
+static void caldav_want(struct caldav *dav, struct dav_response *resp)
+{
+	struct caldav_resource *res = g_hash_table_lookup(dav->hrefs,
+							  resp->href);
+
+	if (res)
+		res->seen = true;
+
+	if (!res || !res->etag || !resp->etag || strcmp(res->etag, resp->etag))
+		g_ptr_array_add(dav->fetch, g_strdup(resp->href));
+}
+
+static bool caldav_is_collection(struct caldav *dav, const char *href)
+{
+	return !strcmp(href, soup_uri_get_path(dav->base));
+}
+
+static void caldav_list_done(struct caldav *dav, SoupMessage *msg,
+			     const char *uid)
+{
+	struct caldav_resource *res;
+	struct dav_response *resp;
+	struct dav_parse p;
+	GHashTableIter iter;
+	GPtrArray *gone;
+
+	if (caldav_failed(dav, msg, "calendar-query") || !dav_parse(msg, &p)) {
+		caldav_sync_abort(dav);
+		return;
+	}
+
+	g_hash_table_iter_init(&iter, dav->resources);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&res))
+		res->seen = false;
+
+	for (guint i = 0; i < p.responses->len; i++) {
+		resp = g_ptr_array_index(p.responses, i);
+		if (resp->href && resp->status == 200 &&
+		    !caldav_is_collection(dav, resp->href))
+			caldav_want(dav, resp);
+	}
+
+	// the server had these and doesn't anymore. ones without an etag
+	// were never uploaded
+	gone = g_ptr_array_new();
+	g_hash_table_iter_init(&iter, dav->resources);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&res)) {
+		if (!res->seen && res->etag && !caldav_unsent(res))
+			g_ptr_array_add(gone, res);
+	}
+
+	for (guint i = 0; i < gone->len; i++)
+		caldav_forget(dav, g_ptr_array_index(gone, i));
+
+	g_ptr_array_unref(gone);
+	dav_parse_free(&p);
+	caldav_multiget(dav);
+}
+
+// no usable sync-token, list every etag
+static void caldav_list(struct caldav *dav)
+{
+	caldav_report(dav, "REPORT", "1", g_strdup(
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+		"<c:calendar-query xmlns:d=\"DAV:\" "
+		"xmlns:c=\"urn:ietf:params:xml:ns:caldav\">\n"
+		"<d:prop><d:getetag/></d:prop>\n"
+		"<c:filter><c:comp-filter name=\"VCALENDAR\">"
+		"<c:comp-filter name=\"VEVENT\"/>"
+		"</c:comp-filter></c:filter>\n"
+		"</c:calendar-query>\n"),
+		caldav_list_done);
+}
+
+static void caldav_changes_done(struct caldav *dav, SoupMessage *msg,
+				const char *uid)
+{
+	struct caldav_resource *res;
+	struct dav_response *resp;
+	struct dav_parse p;
+
+	// the token expired or the server forgot it, start over
+	if (SOUP_STATUS_IS_CLIENT_ERROR(msg->status_code)) {
+		log_info("caldav: %s: sync-token refused, listing everything",
+			 soup_uri_get_path(dav->base));
+		g_clear_pointer(&dav->sync_token, g_free);
+		caldav_list(dav);
+		return;
+	}
+
+	if (caldav_failed(dav, msg, "sync-collection") || !dav_parse(msg, &p)) {
+		caldav_sync_abort(dav);
+		return;
+	}
+
+	for (guint i = 0; i < p.responses->len; i++) {
+		resp = g_ptr_array_index(p.responses, i);
+		if (!resp->href || caldav_is_collection(dav, resp->href))
+			continue;
+
+		if (resp->status == 404) {
+			res = g_hash_table_lookup(dav->hrefs, resp->href);
+			if (res && !caldav_unsent(res))
+				caldav_forget(dav, res);
+		} else if (resp->status == 200) {
+			caldav_want(dav, resp);
+		}
+	}
+
+	if (p.sync_token) {
+		g_free(dav->next_token);
+		dav->next_token = g_strdup(p.sync_token);
+	}
+
+	dav_parse_free(&p);
+	caldav_multiget(dav);
+}
+
+// what changed since our sync-token
+static void caldav_changes(struct caldav *dav)
+{
+	caldav_report(dav, "REPORT", "0", g_markup_printf_escaped(
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+		"<d:sync-collection xmlns:d=\"DAV:\">\n"
+		"<d:sync-token>%s</d:sync-token>\n"
+		"<d:sync-level>1</d:sync-level>\n"
+		"<d:prop><d:getetag/></d:prop>\n"
+		"</d:sync-collection>\n", dav->sync_token),
+		caldav_changes_done);
+}
+
+static void caldav_props_done(struct caldav *dav, SoupMessage *msg,
+			      const char *uid)
+{
+	struct dav_parse p;
+
+	if (caldav_failed(dav, msg, "propfind") || !dav_parse(msg, &p))
+		return;
+
+	g_free(dav->next_token);
+	g_free(dav->next_ctag);
+	dav->next_token = g_strdup(p.sync_token);
+	dav->next_ctag = g_strdup(p.ctag);
+
+	if (p.sync_token && dav->sync_token) {
+		if (strcmp(p.sync_token, dav->sync_token))
+			caldav_changes(dav);
+	} else if (!p.ctag || !dav->ctag || strcmp(p.ctag, dav->ctag)) {
+		caldav_list(dav);
+	}
+
+	dav_parse_free(&p);
+
+	// nothing changed
+	if (!dav->inflight) {
+		g_clear_pointer(&dav->next_token, g_free);
+		g_clear_pointer(&dav->next_ctag, g_free);
+	}
+}
+
+static void caldav_sync(struct caldav *dav)
+{
+	dav->syncing = true;
+	dav->want_sync = false;
+	dav->sync_at = g_get_monotonic_time() +
+		CALDAV_SYNC_INTERVAL * G_TIME_SPAN_SECOND;
+
+	caldav_report(dav, "PROPFIND", "0", g_strdup(
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+		"<d:propfind xmlns:d=\"DAV:\" "
+		"xmlns:cs=\"http://calendarserver.org/ns/\">\n"
+		"<d:prop><d:sync-token/><cs:getctag/></d:prop>\n"
+		"</d:propfind>\n"),
+		caldav_props_done);
+}
+
+static void caldav_queue(struct caldav *dav, struct caldav_resource *res,
+			 bool front)
+{
+	if (res->queued)
+		return;
+
+	res->queued = true;
+	if (front)
+		g_queue_push_head(&dav->outbox, g_strdup(res->uid));
+	else
+		g_queue_push_tail(&dav->outbox, g_strdup(res->uid));
+}
+
+static void caldav_retry_later(struct caldav *dav)
+{
+	dav->backoff = dav->backoff ? min(dav->backoff * 2, CALDAV_BACKOFF_MAX)
+				    : CALDAV_BACKOFF_MIN;
+	dav->retry_at = g_get_monotonic_time() + dav->backoff;
+
+	log_info("caldav: %s: retrying uploads in %" G_GINT64_FORMAT "s",
+		 soup_uri_get_path(dav->base), dav->backoff / G_TIME_SPAN_SECOND);
+}
+
+static void caldav_upload_done(struct caldav *dav, SoupMessage *msg,
+			       const char *uid)
+{
+	struct caldav_resource *res = g_hash_table_lookup(dav->resources, uid);
+	bool delete = !strcmp(msg->method, "DELETE");
+	guint status = msg->status_code;
+	const char *etag;
+
+	res->sending = false;
+
+	// not our fault, send it again later
+	if (SOUP_STATUS_IS_TRANSPORT_ERROR(status) ||
+	    SOUP_STATUS_IS_SERVER_ERROR(status)) {
+		caldav_failed(dav, msg, "upload");
+		caldav_queue(dav, res, true);
+		caldav_retry_later(dav);
+		caldav_store_state(dav);
+		return;
+	}
+
+	dav->backoff = 0;
+	dav->retry_at = 0;
+
+	if (status == SOUP_STATUS_PRECONDITION_FAILED) {
+		// someone else changed it, theirs wins
+		log_warn("caldav: %s changed on the server, dropping ours",
+			 res->href);
+		dav->want_sync = true;
+	} else if (delete && (SOUP_STATUS_IS_SUCCESSFUL(status) ||
+			      status == SOUP_STATUS_NOT_FOUND)) {
+		// unless it came back since, then it goes up as new
+		if (res->queued) {
+			g_clear_pointer(&res->etag, g_free);
+			res->hash = 0;
+		} else {
+			caldav_resource_drop(dav, res);
+		}
+	} else if (!caldav_failed(dav, msg, delete ? "DELETE" : "PUT")) {
+		// without one we refetch it next sync, it's the same event
+		etag = soup_message_headers_get_one(msg->response_headers,
+						    "ETag");
+		g_free(res->etag);
+		res->etag = g_strdup(etag);
+		res->hash = res->sending_hash;
+	}
+
+	caldav_store_state(dav);
+}
+
+// the body to upload for a UID, NULL if its events are gone
+static char *caldav_uid_body(struct caldav *dav, const char *uid)
+{
+	GHashTable *uids = caldav_events_by_uid(dav->ical);
+	GPtrArray *vevents = g_hash_table_lookup(uids, uid);
+	char *body = vevents ? caldav_body(dav->ical, vevents) : NULL;
+
+	g_hash_table_unref(uids);
+	return body;
+}
+
+// start the next upload. whatever the event looks like now is what goes
+// up, however many times it changed since it was queued. false when
+// there's nothing left to look at
+static bool caldav_upload(struct caldav *dav)
+{
+	struct caldav_resource *res;
+	SoupMessage *msg;
+	GList *link;
+	char *uid, *body = NULL;
+
+	// one upload at a time per event, or the second has a stale etag
+	for (link = dav->outbox.head; link; link = link->next) {
+		res = g_hash_table_lookup(dav->resources, link->data);
+		if (!res->sending)
+			break;
+	}
+
+	if (!link)
+		return false;
+
+	uid = link->data;
+	g_queue_delete_link(&dav->outbox, link);
+	res->queued = false;
+
+	if (res->deleted && !res->etag) {
+		// never made it to the server
+		caldav_resource_drop(dav, res);
+		g_free(uid);
+		return true;
+	}
+
+	if (!res->deleted) {
+		body = caldav_uid_body(dav, uid);
+		res->sending_hash = body ? g_str_hash(body) : 0;
+
+		// gone without a save, the next flush deletes it. or the
+		// server already has this version
+		if (!body || res->sending_hash == res->hash) {
+			free(body);
+			g_free(uid);
+			return true;
+		}
+	}
+
+	if (res->deleted) {
+		msg = caldav_message(dav, "DELETE", res->href);
+	} else {
+		msg = caldav_message(dav, "PUT", res->href);
+		caldav_set_body(msg, "text/calendar; charset=utf-8", body);
+		free(body);
+
+		if (!res->etag)
+			soup_message_headers_append(msg->request_headers,
+						    "If-None-Match", "*");
+	}
+
+	if (res->etag)
+		soup_message_headers_append(msg->request_headers, "If-Match",
+					    res->etag);
+
+	res->sending = true;
+	caldav_send(dav, msg, caldav_upload_done, uid);
+	return true;
+}
+
+// queue everything that differs from the server's copy
+static void caldav_flush(struct caldav *dav)
+{
+	struct caldav_resource *res;
+	GHashTableIter iter;
+	GHashTable *uids;
+	GPtrArray *vevents;
+	const char *uid;
+	char *body, *href;
+	guint hash;
+	int queued = g_queue_get_length(&dav->outbox);
+
+	dav->flush_at = 0;
+
+	if (!dav->unsaved)
+		return;
+
+	dav->unsaved = false;
+	uids = caldav_events_by_uid(dav->ical);
+
+	g_hash_table_iter_init(&iter, dav->resources);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&res))
+		res->seen = false;
+
+	g_hash_table_iter_init(&iter, uids);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&uid,
+				      (gpointer *)&vevents)) {
+		res = g_hash_table_lookup(dav->resources, uid);
+		if (!res) {
+			// new names are random, UIDs aren't safe in a path
+			body = g_uuid_string_random();
+			href = g_strconcat(soup_uri_get_path(dav->base), body,
+					   ".ics", NULL);
+			res = caldav_resource(dav, uid, href);
+			g_free(href);
+			g_free(body);
+		}
+
+		res->seen = true;
+
+		// back again, eg. moved out and back into this calendar
+		if (res->deleted) {
+			res->deleted = false;
+			caldav_queue(dav, res, false);
+		}
+
+		if (res->queued)
+			continue;
+
+		body = caldav_body(dav->ical, vevents);
+		hash = g_str_hash(body);
+		free(body);
+
+		if (hash != res->hash)
+			caldav_queue(dav, res, false);
+	}
+
+	g_hash_table_iter_init(&iter, dav->resources);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&res)) {
+		if (!res->seen && !res->deleted) {
+			res->deleted = true;
+			caldav_queue(dav, res, false);
+		}
+	}
+
+	log_debug("caldav: %s: %d queued", soup_uri_get_path(dav->base),
+		  g_queue_get_length(&dav->outbox) - queued);
+
+	g_hash_table_unref(uids);
+	caldav_store(dav);
+}
+
+static gboolean caldav_timer(gpointer data);
+
+// whichever of flush, retry or sync comes next. 0 when there's only
+// waiting on requests, their responses kick us
+static gint64 caldav_next(struct caldav *dav, gint64 now)
+{
+	gint64 at = 0, times[] = {
+		dav->flush_at,
+		dav->sync_at,
+		g_queue_is_empty(&dav->outbox) ? 0 : dav->retry_at,
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(times); i++) {
+		if (times[i] > now && (!at || times[i] < at))
+			at = times[i];
+	}
+
+	return at;
+}
+
+static void caldav_schedule(struct caldav *dav)
+{
+	gint64 now = g_get_monotonic_time();
+	gint64 at = caldav_next(dav, now);
+
+	if (dav->timer)
+		g_source_remove(dav->timer);
+
+	dav->timer = at ? g_timeout_add((at - now) / 1000 + 1, caldav_timer,
+					 dav)
+			: 0;
+}
+
+static void caldav_kick(struct caldav *dav)
+{
+	gint64 now = g_get_monotonic_time();
+
+	if (dav->flush_at && now >= dav->flush_at)
+		caldav_flush(dav);
+
+	if (now >= dav->sync_at)
+		dav->want_sync = true;
+
+	// uploads go first so the sync after sees them
+	if (!dav->syncing && now >= dav->retry_at) {
+		while (dav->inflight < CALDAV_UPLOADS && caldav_upload(dav))
+			;
+	}
+
+	if (!dav->syncing && !dav->inflight && dav->want_sync)
+		caldav_sync(dav);
+
+	caldav_schedule(dav);
+}
+
+static gboolean caldav_timer(gpointer data)
+{
+	struct caldav *dav = data;
+
+	dav->timer = 0;
+	caldav_kick(dav);
+
+	return G_SOURCE_REMOVE;
+}
+
+// called instead of writing the calendar out. the upload waits a moment
+// in case more edits are coming
+static void caldav_save(struct caldav *dav)
+{
+	dav->unsaved = true;
+
+	if (!dav->flush_at) {
+		dav->flush_at = g_get_monotonic_time() + CALDAV_FLUSH_DELAY;
+		caldav_schedule(dav);
+	}
+}
+
+static void caldav_open(struct cal *cal, struct ical *ical)
+{
+	struct caldav *dav = g_new0(struct caldav, 1);
+	const char *path;
+	char *dir;
+
+	if (!g_soup)
+		g_soup = soup_session_new_with_options(
+			SOUP_SESSION_USER_AGENT, "viscal", NULL);
+
+	dav->cal = cal;
+	dav->ical = ical;
+	dav->base = soup_uri_new(ical->source_location);
+
+	// resource hrefs are relative to the collection
+	path = soup_uri_get_path(dav->base);
+	if (!g_str_has_suffix(path, "/")) {
+		dir = g_strconcat(path, "/", NULL);
+		soup_uri_set_path(dav->base, dir);
+		g_free(dir);
+	}
+
+	dav->cache = caldav_cache_dir(ical->source_location);
+	dav->resources = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+					       caldav_resource_free);
+	dav->hrefs = g_hash_table_new(g_str_hash, g_str_equal);
+	dav->fetch = g_ptr_array_new_with_free_func(g_free);
+	g_queue_init(&dav->outbox);
+
+	caldav_load_state(dav);
+	ical->caldav = dav;
+
+	// sync now
+	caldav_kick(dav);
+}
+#endif // VISCAL_CALDAV
+
+
+struct calendar_load_job {
+	const char *path;
+	struct ical ical;
+	bool loaded;
+};
+
+// read -> parse -> extract spans -> sort, all off the main thread
+static void calendar_load_worker(gpointer data, gpointer user_data)
+{
+	struct calendar_load_job *job = (struct calendar_load_job*)data;
+	bool remote = caldav_is_url(job->path);
+	icalcomponent *calendar;
+
+#ifdef VISCAL_CALDAV
+	calendar = remote ? caldav_load_cache(job->path)
+			  : calendar_parse_file(job->path);
+#else
+	if (remote) {
+		log_error("%s: built without caldav, see CALDAV in the Makefile",
+			  job->path);
+		return;
+	}
+
+	calendar = calendar_parse_file(job->path);
+#endif
+
+	if (calendar == NULL)
+		return;
+
+	calendar_init(&job->ical, calendar, job->path);
+	if (remote)
+		job->ical.source = SOURCE_CALDAV;
+	calendar_sort_events(&job->ical);
+	job->loaded = true;
+}
+
+// load many calendars at once. each calendar is parsed and sorted on a
+// thread pool, then they are added in command line order on the calling
+// thread so calendar indices (F1, F2, ...) stay predictable. the view
+// itself is merged from the sorted lists on the next on_change_view
+static int calendars_load(struct cal *cal, char **paths, int npaths)
+{
+	struct calendar_load_job *jobs, *job;
+	struct ical *ical;
+	GThreadPool *pool;
+	GError *err = NULL;
+	int i, j, loaded = 0;
+	int nthreads = min((int)g_get_num_processors(), npaths);
+
+	if (npaths <= 0)
+		return 0;
+
+	// TODO: support >128 calendars
+	if (cal->ncalendars + npaths > (int)ARRAY_SIZE(cal->calendars)) {
+		log_warn("calendar too big (well its not too big, viscal just sucks");
+		npaths = ARRAY_SIZE(cal->calendars) - cal->ncalendars;
+	}
+
+	jobs = calloc(npaths, sizeof(*jobs));
+	assert(jobs);
+
+	pool = g_thread_pool_new(calendar_load_worker, NULL, nthreads, FALSE,
+				 &err);
+
+	for (i = 0; i < npaths; i++) {
+		job = &jobs[i];
+		job->path = paths[i];
+
+		log_info("loading calendar %s", job->path);
+
+		if (pool == NULL || !g_thread_pool_push(pool, job, NULL))
+			calendar_load_worker(job, NULL);
+	}
+
+	// wait for the queue to drain
+	if (pool)
+		g_thread_pool_free(pool, FALSE, TRUE);
+
+	for (i = 0; i < npaths; i++) {
+		job = &jobs[i];
+
+		if (!job->loaded)
+			continue;
+
+		ical = &cal->calendars[cal->ncalendars++];
+		*ical = job->ical;
+
+		// events still point at the job's copy of the calendar
+		for (j = 0; j < ical->nevents; j++)
+			ical->events[j].ical = ical;
+
+#ifdef VISCAL_CALDAV
+		if (ical->source == SOURCE_CALDAV)
+			caldav_open(cal, ical);
+#endif
+
+		loaded++;
+	}
+
+	free(jobs);
+	return loaded;
+}
+
+
+/* static void */
+/* event_set_start(struct event *ev, time_t time, const icaltimezone *zone) { */
+/*   if (zone == NULL) */
+/*     zone = g_timezone; */
+/*   icaltimetype ictime = icaltime_from_timet_with_zone_with_zone(time, 1, zone); */
+/*   icalcomponent_set_dtstart(ev->vevent, ictime); */
+/* } */
+
+/* static void */
+/* event_set_end(struct event *ev, time_t time, const icaltimezone *zone) { */
+/*   if (zone == NULL) */
+/*     zone = g_timezone; */
+/*   icaltimetype ictime = icaltime_from_timet_with_zone_with_zone(time, 1, zone); */
+/*   icalcomponent_set_dtend(ev->vevent, ictime); */
+/* } */
+
+
+static void calendar_drop(struct cal *cal, double mx, double my) {
+	struct event *ev = get_target(cal);
+
+	if (!ev)
+		return;
+
+	time_t st, et;
+
+	// TODO: use default event ARRAY_SIZE when dragging from gutter?
+	vevent_span_timet(ev->ical, ev->vevent, &st, &et);
+	vevent_set_span(ev->ical, ev->vevent, ev->drag_time,
+			ev->drag_time + (et - st));
+
+	calendar_changed(cal, ev->ical);
+}
+
+
+static time_t location_to_time(time_t start, time_t end, double loc) {
+	return (time_t)((double)start) + (loc * (end - start));
+}
+
+
+
+static time_t calendar_pos_to_time(struct cal *cal, double y) {
+	// TODO: this is wrong wrt. zoom
+	return location_to_time(calendar_view_start(cal),
+				calendar_view_end(cal),
+				y/((double)cal->height * cal->zoom));
+}
+
+static time_t calendar_loc_to_time(struct cal *cal, double y) {
+	return location_to_time(calendar_view_start(cal),
+				calendar_view_end(cal),
+				y/cal->zoom);
+}
+
+static void event_click(struct cal *cal, struct event *event, int mx, int my) {
+	log_debug("clicked %s", icalcomponent_get_summary(event->vevent));
+
+	calendar_pos_to_time(cal, my);
+}
+
+// TODO: this should handle zh_CN and others as well
+void time_remove_seconds(char *time, int n) {
+	int len = strlen(time);
+	int count = 0;
+	char *ws;
+	for (int i = 0; i < len; ++i) {
+		if (count == n) {
+			ws = &time[i];
+			while (*ws != '\0' &&
+			       (*ws == ':' ||
+				(*ws >= '0' && *ws <= '9'))) ws++;
+			len = strlen(ws);
+			memcpy(&time[i-1], ws, len);
+			time[i-1+len] = '\0';
+			return;
+		}
+		// FIXME: instead of (==':'), we want (!= 0..9), in a unicode-enumerated way
+		count += time[i] == ':' ? 1 : 0;
+	}
+}
+
+
+static char *format_locale_time(char *buffer, int bsize, struct tm *tm) {
+	strftime(buffer, bsize, "%X", tm);
+	time_remove_seconds(buffer, 2);
+	return buffer;
+}
+
+
+static char *format_locale_timet(char *buffer, int bsize, time_t time) {
+	struct tm lt;
+	local_tm(time, &lt);
+	return format_locale_time(buffer, bsize, &lt);
+}
+
+
+
+static icalcomponent *vevent_new(time_t start, time_t end,
+				 const char *summary) {
+	icalcomponent *vevent;
+	// new events are written in utc, which every client understands
+	icaltimetype dtstart = icaltime_from_timet_with_zone(start, 0, tz_utc);
+	icaltimetype dtend = icaltime_from_timet_with_zone(end, 0, tz_utc);
+
+	vevent = icalcomponent_new(ICAL_VEVENT_COMPONENT);
+
+	icalcomponent_set_summary(vevent, summary);
+	icalcomponent_set_dtstart(vevent, dtstart);
+	icalcomponent_set_dtend(vevent, dtend);
+
+	return vevent;
+}
+
+static icalcomponent *create_event(struct cal *cal, time_t start, time_t end,
+				   struct ical *ical) {
+	static const char *default_event_summary = "";
+	icalcomponent *vevent = vevent_new(start, end, default_event_summary);
+
+	icalcomponent_add_component(ical->calendar, vevent);
+
+	calendar_changed(cal, ical);
+	cal->select_after_sort = vevent;
+
+	return vevent;
+}
+
+static icalcomponent *calendar_def_cal(struct cal *cal) {
+  // TODO: configurable default calendar
+  if (cal->ncalendars > 0)
+    return cal->calendars[0].calendar;
+  return NULL;
+}
+
+static time_t closest_timeblock_for_timet(time_t st, int timeblock_size) {
+	int min = local_minute(st);
+	// zeroing the seconds removes jitter
+	return local_hour_at_minute(st, min / timeblock_size * timeblock_size);
+}
+
+static time_t closest_timeblock(struct cal *cal, int y) {
+	time_t st = calendar_pos_to_time(cal, y);
+	return closest_timeblock_for_timet(st, cal->timeblock_size);
+}
+
+
+
+static int event_hit (struct event *ev, double mx, double my) {
+	return
+		mx >= ev->x
+		&& mx <= (ev->x + ev->width)
+		&& my >= ev->y
+		&& my <= (ev->y + ev->height);
+}
+
+
+static int events_hit (struct event *events, int nevents,
+				 double mx, double my)
+{
+	for (int i = 0; i < nevents; ++i) {
+		if (event_hit(&events[i], mx, my))
+			return i;
+	}
+	return -1;
+}
+
+static const double ANIM_TIME = 0.06;
+static const double FLING_TIME = 0.35;
+static const double FLING_MIN = 60;
+
+static void view_anim_settle(struct cal *cal)
+{
+	struct view_anim *anim = &cal->anim;
+
+	anim->tick = 0;
+	anim->fling = 0;
+
+	if (anim->layer) {
+		cairo_surface_destroy(anim->layer);
+		anim->layer = NULL;
+	}
+
+	// the next draw does a full relayout
+	calendar_queue_draw(cal);
+}
+
+static gboolean view_anim_tick(GtkWidget *widget, GdkFrameClock *clock,
+			       gpointer user_data)
+{
+	struct cal *cal = (struct cal*)user_data;
+	struct view_anim *anim = &cal->anim;
+	gint64 now = gdk_frame_clock_get_frame_time(clock);
+	double dt, ease, zoom, anchor, moved;
+
+	dt = anim->last_frame ? (now - anim->last_frame) / 1e6 : 1.0 / 60.0;
+	dt = min(dt, 0.1);
+	anim->last_frame = now;
+
+	// something else moved the view, eg. zt. go along with it
+	if (cal->scroll != anim->scroll_set) {
+		moved = cal->scroll - anim->scroll_set;
+		anim->scroll += moved;
+		anim->scroll_target += moved;
+	}
+
+	if (anim->fling != 0) {
+		anim->scroll_target += anim->fling * dt;
+		anim->fling *= exp(-dt / FLING_TIME);
+		if (fabs(anim->fling) < FLING_MIN)
+			anim->fling = 0;
+	}
+
+	ease = 1.0 - exp(-dt / ANIM_TIME);
+
+	zoom = cal->zoom + (anim->zoom_target - cal->zoom) * ease;
+	if (fabs(anim->zoom_target - zoom) < 1e-3)
+		zoom = anim->zoom_target;
+
+	// keep the time under zoom_at where it is
+	if (zoom != cal->zoom) {
+		anchor = cal->zoom_at / (double)cal->height * DAY_SECONDS;
+		moved = anchor / cal->zoom - anchor / zoom;
+		anim->scroll += moved;
+		anim->scroll_target += moved;
+		cal->zoom = zoom;
+	}
+
+	anim->scroll += (anim->scroll_target - anim->scroll) * ease;
+	if (fabs(anim->scroll_target - anim->scroll) < 1.0)
+		anim->scroll = anim->scroll_target;
+
+	cal->scroll = anim->scroll_set = lround(anim->scroll);
+	calendar_queue_draw(cal);
+
+	if (anim->scroll == anim->scroll_target && anim->fling == 0 &&
+	    cal->zoom == anim->zoom_target) {
+		view_anim_settle(cal);
+		return G_SOURCE_REMOVE;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void view_anim_begin(struct cal *cal)
+{
+	struct view_anim *anim = &cal->anim;
+
+	if (anim->tick)
+		return;
+
+	anim->scroll = anim->scroll_target = cal->scroll;
+	anim->scroll_set = cal->scroll;
+	anim->zoom_target = cal->zoom;
+	anim->last_frame = 0;
+	anim->tick = gtk_widget_add_tick_callback(cal->widget, view_anim_tick,
+						  cal, NULL);
+}
+
+// without a widget (the benchmarks) these apply immediately
+static void view_scroll_by(struct cal *cal, double seconds)
+{
+	if (!cal->widget) {
+		cal->scroll += seconds;
+		return;
+	}
+
+	view_anim_begin(cal);
+	cal->anim.fling = 0;
+	cal->anim.scroll_target += seconds;
+}
+
+static void view_zoom_to(struct cal *cal, double zoom)
+{
+	if (!cal->widget) {
+		cal->zoom = zoom;
+		return;
+	}
+
+	view_anim_begin(cal);
+	cal->anim.zoom_target = zoom;
+}
+
+static void zoom(struct cal *cal, double amt)
+{
+	double from = cal->anim.tick ? cal->anim.zoom_target : cal->zoom;
+	double newzoom = from - amt * max(0.1, log(from)) * 0.5;
+
+	if (newzoom < ZOOM_MIN) {
+		newzoom = ZOOM_MIN;
+	}
+	else if (newzoom > ZOOM_MAX) {
+		newzoom = ZOOM_MAX;
+	}
+
+	cal->zoom_at = cal->my;
+	view_zoom_to(cal, newzoom);
+}
+
+static int event_minutes(struct event *event)
+{
+	time_t st, et;
+	vevent_span_timet(event->ical, event->vevent, &st, &et);
+	return (et - st) / 60;
+}
+
+
+static int timeblock_size(struct cal *cal)
+{
+	if (cal->selected_event_ind != -1) {
+		struct event *ev = get_selected_event(cal);
+		return event_minutes(ev);
+	}
+
+	return cal->timeblock_size;
+}
+
+static int find_closest_event(struct cal *cal, time_t near, int rel)
+{
+	struct event *ev;
+	int is_up, ind;
+	time_t start, end, prev;
+
+	is_up = rel == -1;
+	prev = near;
+
+	if (cal->nevents == 0)
+		return -1;
+	else if (cal->nevents == 1)
+		return 0;
+
+	for (int i = cal->nevents-1; i >= 0; i--) {
+		ev = &cal->events[i];
+		vevent_span_timet(ev->ical, ev->vevent, &start, &end);
+
+		if (end <= near) {
+			ind = is_up ? i : i+1;
+			return ind == cal->nevents ? -1 : ind;
+		}
+	}
+
+	return 0;
+}
+
+static inline int relative_selection(struct cal *cal, int rel)
+{
+	if (cal->selected_event_ind == -1) {
+		return find_closest_event(cal, cal->current, rel);
+	}
+
+	return clamp(cal->selected_event_ind + rel, 0, cal->nevents - 1);
+}
+
+static time_t get_hour(time_t current)
+{
+	return local_hour_start(current);
+}
+
+static int get_minute(time_t current)
+{
+	return local_minute(current);
+}
+
+static time_t get_smallest_closest_timeblock(time_t current, int round_by)
+{
+	int min = local_minute(current);
+	return local_hour_at_minute(current,
+				    round(min / (double)round_by) * round_by);
+}
+
+static void align_down(struct cal *cal)
+{
+	/* assert(!"implement me"); */
+	struct event *event =
+		get_selected_event(cal);
+	(void)event;
+}
+
+static void align_up(struct cal *cal)
+{
+	/* assert(!"implement me"); */
+	struct event *event =
+		get_selected_event(cal);
+	(void)event;
+}
+
+static void align_hour(struct cal *cal)
+{
+	int min = round(local_minute(cal->current) / 60.0) * 60;
+
+	log_debug("tm_min %d", min);
+
+	cal->current = local_hour_at_minute(cal->current, min);
+}
+
+static void move_event_to(struct cal *cal, struct event *event, time_t to)
+{
+	time_t st, et;
+
+	vevent_span_timet(event->ical, event->vevent, &st, &et);
+
+	log_debug("before moving start:%s end:%s",
+		  icaltime_as_ical_string(icalcomponent_get_dtstart(event->vevent)),
+		  icaltime_as_ical_string(icalcomponent_get_dtend(event->vevent)));
+
+	vevent_set_span(event->ical, event->vevent, to, to + (et - st));
+
+	log_debug("after moving start:%s end:%s",
+		  icaltime_as_ical_string(icalcomponent_get_dtstart(event->vevent)),
+		  icaltime_as_ical_string(icalcomponent_get_dtend(event->vevent)));
+
+	calendar_changed(cal, event->ical);
+}
+
+// the whole range shifts so its first event starts now, keeping the gaps
+static void move_event_now(struct cal *cal)
+{
+	int i, first, last;
+	time_t st, delta;
+
+	if (!selection_range(cal, &first, &last))
+		return;
+
+	time_t closest =
+		get_smallest_closest_timeblock(time(NULL), SMALLEST_TIMEBLOCK);
+
+	vevent_span_timet(cal->events[first].ical, cal->events[first].vevent,
+			  &st, NULL);
+	delta = closest - st;
+
+	for (i = first; i <= last; i++) {
+		if (!in_selection(cal, i))
+			continue;
+
+		vevent_span_timet(cal->events[i].ical, cal->events[i].vevent,
+				  &st, NULL);
+		move_event_to(cal, &cal->events[i], st + delta);
+	}
+}
+
+static int time_in_view(struct cal *cal, time_t time) {
+	time_t st = calendar_loc_to_time(cal, 0);
+	time_t et = calendar_loc_to_time(cal, 1.0);
+
+	return time >= st && time <= et;
+}
+
+static int timeline_in_view(struct cal *cal)
+{
+	return time_in_view(cal, cal->current);
+}
+
+static void deselect(struct cal *cal)
+{
+	cal->selected_event_ind = -1;
+}
+
+static void normal_mode(struct cal *cal)
+{
+	cal->flags &= ~CAL_VISUAL;
+	cal->visual_ind = -1;
+	cal->visual_cursor = NULL;
+	cal->nvisual = 0;
+	visual_mark(cal);
+}
+
+// anchor a range at the selected event, selection motions extend it
+static void visual_mode(struct cal *cal)
+{
+	if (cal->flags & CAL_VISUAL)
+		return normal_mode(cal);
+
+	if (cal->selected_event_ind == -1)
+		return;
+
+	cal->visual_ind = cal->selected_event_ind;
+	cal->visual_cursor = NULL;
+	cal->flags |= CAL_VISUAL;
+	visual_update(cal);
+}
+
+static void move_now(struct cal *cal)
+{
+	deselect(cal);
+
+	cal->current =
+		get_smallest_closest_timeblock(time(NULL), SMALLEST_TIMEBLOCK);
+
+	if (!timeline_in_view(cal))
+		center_view(cal);
+}
+
+static void insert_event(struct cal *cal, time_t st, time_t et,
+			 struct ical *ical)
+{
+	cal->flags |= CAL_INSERTING;
+	create_event(cal, st, et, ical);
+}
+
+static void insert_event_action_with(struct cal *cal, time_t st)
+{
+	// we should eventually always have a calendar
+	// at least a temporary one
+	if (cal->ncalendars == 0)
+		return;
+
+	time_t et = st + cal->timeblock_size * 60;
+
+	insert_event(cal, st, et, current_calendar(cal));
+}
+
+static void insert_event_after_action(struct cal *cal)
+{
+	time_t start = cal->current + cal->timeblock_size * 60;
+	insert_event_action_with(cal, start);
+}
+
+
+static void insert_event_action(struct cal *cal)
+{
+	insert_event_action_with(cal, cal->current);
+}
+
+
+static void calendar_view_clicked(struct cal *cal, int mx, int my) {
+	time_t closest;
+	/* int y; */
+	char buf[32];
+
+	closest = closest_timeblock(cal, my);
+
+	log_debug("(%d,%d) clicked @%s", mx, my,
+		  format_locale_timet(buf, sizeof(buf), closest));
+	insert_event_action(cal);
+}
+
+
+static int query_span(struct cal *cal, int index_hint, time_t start, time_t end,
+		      time_t min_start, time_t max_end)
+{
+	time_t st, et;
+	struct event *ev;
+
+	for (int i=index_hint; i < cal->nevents; i++) {
+		ev = &cal->events[i];
+
+		icaltimetype dtstart =
+			icalcomponent_get_dtstart(ev->vevent);
+
+		// date events aren't spans
+		if (dtstart.is_date)
+			continue;
+
+		vevent_span_timet(ev->ical, ev->vevent, &st, &et);
+
+		if ((min_start != 0 && st < min_start) ||
+		    (max_end   != 0 && et > max_end))
+			continue;
+		else if (span_overlaps(st, et, start, end))
+			return i;
+	}
+
+	return -1;
+}
+
+// TODO comebine parts with move_event?
+static void move_relative(struct cal *cal, int rel)
+{
+	time_t st;
+	time_t et;
+	int hit;
+	int timeblock = cal->timeblock_size * 60;
+
+	// no current event selection
+	if (cal->selected_event_ind == -1)  {
+		cal->current += rel * timeblock;
+	}
+	else { // and event is selection
+		struct event *ev = get_selected_event(cal);
+		vevent_span_timet(ev->ical, ev->vevent, &st, &et);
+
+		cal->current = rel > 0 ? et : st - timeblock;
+	}
+
+	st = cal->current;
+	et = cal->current + timeblock;
+
+	if ((hit = query_span(cal, 0, st, et, 0, 0)) != -1) {
+		struct event *ev = &cal->events[hit];
+		vevent_span_timet(ev->ical, ev->vevent, &st, &et);
+
+		cal->current = st;
+	}
+
+	cal->selected_event_ind = hit;
+}
+
+static void move_up(struct cal *cal, int repeat)
+{
+	move_relative(cal, -1);
+}
+
+static void move_down(struct cal *cal, int repeat)
+{
+	move_relative(cal, 1);
+}
+
+static int number_of_hours_in_view(struct cal *cal)
+{
+	time_t st = calendar_loc_to_time(cal, 0);
+	time_t et = calendar_loc_to_time(cal, 1.0);
+
+	return (et - st) / 60 / 60;
+}
+
+
+static void relative_view(struct cal *cal, int hours)
+{
+	time_t current_hour;
+
+	// currently needed because the grid is hour-aligned
+	current_hour = get_hour(cal->current);
+
+	// zt -> cal->current - cal->today
+	cal->start_at = current_hour - cal->today - (hours * 60 * 60);
+	cal->scroll = 0;
+}
+
+
+static void top_view(struct cal *cal)
+{
+	relative_view(cal, 0);
+}
+
+static void bottom_view(struct cal *cal)
+{
+	relative_view(cal, number_of_hours_in_view(cal) - 1);
+}
+
+static void center_view(struct cal *cal)
+{
+	int half_hours = number_of_hours_in_view(cal) / 2;
+	relative_view(cal, half_hours);
+}
+
+static void expand_event(struct event *event, int minutes)
+{
+	time_t st, et;
+
+	vevent_span_timet(event->ical, event->vevent, &st, &et);
+	vevent_set_span(event->ical, event->vevent, st, et + minutes * 60);
+	// TODO: push down
+}
+
+static void expand_selection_relative(struct cal *cal, int sign)
+{
+	int *step = &cal->timeblock_step;
+	*step = SMALLEST_TIMEBLOCK;
+
+	struct event *event = get_selected_event(cal);
+
+	int size = timeblock_size(cal);
+
+	/* *step = min(*step, size); */
+
+	/* if (sign < 0 && size <= 15) */
+	/* 	*step = 5; */
+	/* else if (sign > 0 && size >= 15) */
+	/* 	*step = 15; */
+
+	int minutes = *step * sign;
+
+	if (size + minutes <= 0)
+		return;
+
+	// no selected event, just expand selector
+	if (event == NULL) {
+		cal->timeblock_size += minutes;
+		return;
+	} else {
+		// expand event if it's selected
+		expand_event(event, minutes);
+		calendar_changed(cal, event->ical);
+	}
+}
+
+static void lock_selection(struct cal *cal)
+{
+	int i, first, last, lock;
+	struct event *event, *source;
+
+	log_debug("locking event");
+	if (!selection_range(cal, &first, &last))
+		return;
 
-	// useful for selecting a new event after insertion
-	if (cal->select_after_sort) {
-		for (i = 0; i < cal->nevents; i++) {
-			if (cal->events[i].vevent == cal->select_after_sort) {
-				select_event(cal, i);
-				// HACK: we might not always want to do this...
-				edit_mode(cal, 0);
+	// a mixed range ends up all locked or all unlocked
+	lock = !(cal->events[first].flags & EV_IMMOVABLE);
+
+	for (i = first; i <= last; i++) {
+		if (!in_selection(cal, i))
+			continue;
+
+		event = &cal->events[i];
+
+		// locking lives in the calendar's event list, the view is a copy
+		source = calendar_event(event->ical, event->vevent);
+
+		if (lock) {
+			event->flags |= EV_IMMOVABLE;
+			if (source)
+				source->flags |= EV_IMMOVABLE;
+		} else {
+			event->flags &= ~EV_IMMOVABLE;
+			if (source)
+				source->flags &= ~EV_IMMOVABLE;
+		}
+	}
+}
+
+static void expand_selection(struct cal *cal)
+{
+	expand_selection_relative(cal, 1);
+}
+
+static void shrink_selection(struct cal *cal)
+{
+	expand_selection_relative(cal, -1);
+}
+
+static void select_dir(struct cal *cal, int rel)
+{
+	int ind = relative_selection(cal, rel);
+	select_event(cal, ind);
+	if (!timeline_in_view(cal)) {
+		center_view(cal);
+	}
+}
+
+static void select_up(struct cal *cal) 
+{
+	for (int i = 0; i < cal->repeat; i++) {
+		select_dir(cal, -1);
+	}
+}
+
+static void select_down(struct cal *cal)
+{
+	for (int i = 0; i < cal->repeat; i++) {
+		select_dir(cal, 1);
+	}
+}
+
+// TODO: make zoom_amt configurable
+static const int zoom_amt = 1.5;
+
+static void zoom_in(struct cal *cal) {
+	for (int i=0; i < cal->repeat; i++)
+		zoom(cal, -zoom_amt);
+}
+
+static void zoom_out(struct cal *cal) {
+	for (int i=0; i < cal->repeat; i++)
+		zoom(cal, zoom_amt);
+}
+
+static int can_push(struct event *ev) {
+	if (ev->flags & EV_IMMOVABLE)
+		return 0;
+
+	icaltimetype dtstart = icalcomponent_get_dtstart(ev->vevent);
+	if (dtstart.is_date)
+		return 0;
+
+	return 1;
+}
+
+
+// locked timed events stay put and pushed events go around them
+static int is_wall(struct event *ev) {
+	if (!(ev->flags & EV_IMMOVABLE))
+		return 0;
+
+	return !icalcomponent_get_dtstart(ev->vevent).is_date;
+}
+
+static void calendars_changed(struct cal *cal, bool *changed)
+{
+	for (int i = 0; i < cal->ncalendars; i++) {
+		if (changed[i])
+			calendar_changed(cal, &cal->calendars[i]);
+	}
+}
+
+// start cal->events[ind] at push_to and push down whatever that runs
+// into, in one pass over the sorted events. all day events are left
+// alone and pushed events hop over locked ones. nothing moves if
+// cal->events[ind] itself can't
+static void push_down(struct cal *cal, int ind, time_t push_to)
+{
+	bool changed[ARRAY_SIZE(cal->calendars)] = {0};
+	time_t st, et, dur, w_st, w_et;
+	struct event *ev, *wall;
+	int w = 0;
+
+	if (ind < 0 || ind >= cal->nevents || !can_push(&cal->events[ind]))
+		return;
+
+	for (; ind < cal->nevents; ind++) {
+		ev = &cal->events[ind];
+		if (!can_push(ev))
+			continue;
+
+		vevent_span_timet(ev->ical, ev->vevent, &st, &et);
+		if (st >= push_to)
+			break;
+
+		dur = et - st;
+		st = push_to;
+
+		// push_to only grows, so walls behind us stay behind
+		for (; w < cal->nevents; w++) {
+			wall = &cal->events[w];
+			if (!is_wall(wall))
+				continue;
+
+			vevent_span_timet(wall->ical, wall->vevent, &w_st, &w_et);
+			if (w_st >= st + dur)
 				break;
-			}
+
+			if (w_et > st)
+				st = w_et;
 		}
+
+		vevent_set_span(ev->ical, ev->vevent, st, st + dur);
+		changed[ev->ical - cal->calendars] = true;
+		push_to = st + dur;
 	}
 
-	cal->select_after_sort = NULL;
+	calendars_changed(cal, changed);
 }
 
+// start cal->events[ind] at push_to and push up whatever ends after it
+// then, like push_down in reverse, and also not when cal->events[ind]
+// can't move. this assumes locked events don't overlap each other
+static void push_up(struct cal *cal, int ind, time_t push_to)
+{
+	bool changed[ARRAY_SIZE(cal->calendars)] = {0};
+	time_t st, et, dur, limit, w_st, w_et;
+	struct event *ev, *wall;
+	int w = cal->nevents - 1;
+
+	if (ind < 0 || ind >= cal->nevents || !can_push(&cal->events[ind]))
+		return;
 
-static void on_change_view(struct cal *cal) {
-	events_for_view(cal, calendar_view_start(cal), calendar_view_end(cal));
+	ev = &cal->events[ind];
+	vevent_span_timet(ev->ical, ev->vevent, &st, &et);
+	limit = push_to + (et - st);
+
+	for (; ind >= 0; ind--) {
+		ev = &cal->events[ind];
+		if (!can_push(ev))
+			continue;
+
+		vevent_span_timet(ev->ical, ev->vevent, &st, &et);
+		if (et <= limit)
+			break;
+
+		dur = et - st;
+		et = limit;
+
+		for (; w >= 0; w--) {
+			wall = &cal->events[w];
+			if (!is_wall(wall))
+				continue;
+
+			vevent_span_timet(wall->ical, wall->vevent, &w_st, &w_et);
+			if (w_st >= et)
+				continue;
+
+			if (w_et <= et - dur)
+				break;
+
+			et = w_st;
+		}
+
+		vevent_set_span(ev->ical, ev->vevent, et - dur, et);
+		changed[ev->ical - cal->calendars] = true;
+		limit = et - dur;
+	}
+
+	calendars_changed(cal, changed);
 }
 
+static void push_expand_selection(struct cal *cal)
+{
+	time_t st, et;
+	struct event *ev;
 
-/* static void */
-/* calendar_print_state(struct cal *cal) { */
-/* 	static int c = 0; */
-/* 	printf("%f %d %d %s %s %d\r", */
-/* 	       cal->zoom, cal->mx, cal->my, */
-/* 	       (cal->flags & CAL_DRAGGING) != 0 ? "D " : "  ", */
-/* 	       (cal->flags & CAL_MDOWN)    != 0 ? "M " : "  ", */
-/* 	       c++ */
-/* 		); */
-/* 	fflush(stdout); */
-/* } */
+	expand_selection(cal);
 
-static void calendar_refresh_events(struct cal *cal) {
-	cal->refresh_events = 1;
-	gtk_widget_queue_draw(cal->widget);
+	ev = get_selected_event(cal);
+
+	if (ev == NULL)
+		return;
+
+	vevent_span_timet(ev->ical, ev->vevent, &st, &et);
+
+	push_down(cal, cal->selected_event_ind+1, et);
+}
+
+static void pushmove_dir(struct cal *cal, int dir) {
+	time_t st, et, push_to;
+	struct event *ev;
+
+	ev = get_selected_event(cal);
+
+	if (ev == NULL)
+		return;
+
+	vevent_span_timet(ev->ical, ev->vevent, &st, &et);
+
+	// TODO: configurable?
+	static const int adjust = SMALLEST_TIMEBLOCK * 60;
+
+	push_to = st + (adjust * dir);
+
+	if (dir == 1)
+		push_down(cal, cal->selected_event_ind, push_to);
+	else
+		push_up(cal, cal->selected_event_ind, push_to);
+}
+
+static void pushmove_down(struct cal *cal) {
+	pushmove_dir(cal, 1);
+}
+
+static void pushmove_up(struct cal *cal) {
+	pushmove_dir(cal, -1);
+}
+
+static void open_below(struct cal *cal)
+{
+	time_t st, et;
+	int ind;
+	time_t push_to;
+	struct event *ev;
+
+	ev = get_selected_event(cal);
+
+	if (ev == NULL) {
+		insert_event_after_action(cal);
+		return;
+	}
+
+	vevent_span_timet(ev->ical, ev->vevent, &st, &et);
+
+	push_to = et + timeblock_size(cal) * 60;
+
+	// push down all nearby events
+	for (ind = cal->selected_event_ind + 1; ind != -1; ind++) {
+		ind = query_span(cal, ind, et, push_to, et, 0);
+
+		if (ind == -1)
+			break;
+		else
+			push_down(cal, ind, push_to);
+	}
+
+	set_current_calendar(cal, ev->ical);
+
+	insert_event(cal, et, push_to, ev->ical);
+}
+
+
+// auto scheduling
+//
+// VTODOs get blocks of time in the free parts of what's left of the
+// viewed day, most important first: PRIORITY, then DUE, then the longest.
+// DTSTART and DUE bound where a task may go and DURATION is how long it
+// takes, a timeblock if it doesn't say. a block is a VEVENT in the task's
+// calendar that names its task in X-VISCAL-TASK. scheduling again takes
+// back the blocks that are still to come and places everything anew,
+// lock a block to keep it where it is.
+#define TASK_PROP "X-VISCAL-TASK"
+
+struct task {
+	struct ical *ical;
+	icalcomponent *vtodo;
+	time_t earliest, latest, dur;
+	int priority;
+};
+
+struct gap {
+	time_t st, et;
+};
+
+static const char *vevent_task(icalcomponent *vevent)
+{
+	icalproperty *prop;
+
+	for (prop = icalcomponent_get_first_property(vevent, ICAL_X_PROPERTY);
+	     prop != NULL;
+	     prop = icalcomponent_get_next_property(vevent, ICAL_X_PROPERTY))
+	{
+		if (!strcmp(icalproperty_get_x_name(prop), TASK_PROP))
+			return icalproperty_get_x(prop);
+	}
+
+	return NULL;
+}
+
+static int sort_task(const void *a, const void *b)
+{
+	const struct task *ta = a, *tb = b;
+
+	if (ta->priority != tb->priority)
+		return ta->priority - tb->priority;
+
+	if (ta->latest != tb->latest)
+		return ta->latest < tb->latest ? -1 : 1;
+
+	if (ta->dur != tb->dur)
+		return ta->dur > tb->dur ? -1 : 1;
+
+	return 0;
+}
+
+static int todo_task(struct cal *cal, struct ical *ical, icalcomponent *vtodo,
+		     struct task *task)
+{
+	icalproperty *prop;
+	icalproperty_status status = icalcomponent_get_status(vtodo);
+
+	if (status == ICAL_STATUS_COMPLETED || status == ICAL_STATUS_CANCELLED ||
+	    icalcomponent_get_first_property(vtodo, ICAL_COMPLETED_PROPERTY))
+		return 0;
+
+	task->ical = ical;
+	task->vtodo = vtodo;
+
+	prop = icalcomponent_get_first_property(vtodo, ICAL_DURATION_PROPERTY);
+	task->dur = prop ? icaldurationtype_as_int(icalproperty_get_duration(prop))
+		: timeblock_size(cal) * 60;
+
+	prop = icalcomponent_get_first_property(vtodo, ICAL_DTSTART_PROPERTY);
+	task->earliest = prop ? prop_timet(ical, prop) : 0;
+
+	prop = icalcomponent_get_first_property(vtodo, ICAL_DUE_PROPERTY);
+	task->latest = prop ? prop_timet(ical, prop) : LONG_MAX;
+
+	// 0 is undefined, after 9 which is the least important
+	prop = icalcomponent_get_first_property(vtodo, ICAL_PRIORITY_PROPERTY);
+	task->priority = prop ? icalproperty_get_priority(prop) : 0;
+	if (task->priority <= 0)
+		task->priority = 10;
+
+	return task->dur > 0;
+}
+
+// first fit, splitting the gap it went in
+static int place_task(struct gap **gaps, int *ngaps, int *gaps_size,
+		      struct task *task, time_t *at)
+{
+	struct gap *g;
+	time_t st;
+
+	for (int i = 0; i < *ngaps; i++) {
+		g = &(*gaps)[i];
+		st = max(g->st, task->earliest);
+
+		if (st + task->dur > min(g->et, task->latest))
+			continue;
+
+		*at = st;
+
+		if (st == g->st) {
+			g->st = st + task->dur;
+			return 1;
+		}
+
+		*gaps = grow_array(*gaps, gaps_size, *ngaps + 1, sizeof(**gaps));
+		g = &(*gaps)[i];
+		memmove(g + 1, g, (*ngaps - i) * sizeof(*g));
+		(*ngaps)++;
+		g->et = st;
+		g[1].st = st + task->dur;
+		return 1;
+	}
+
+	return 0;
 }
 
+// what schedule_tasks works with, kept around between runs
+static struct task *g_tasks;
+static struct gap *g_gaps;
+static int g_tasks_size, g_gaps_size;
+
+static void schedule_tasks(struct cal *cal)
+{
+	bool changed[ARRAY_SIZE(cal->calendars)] = {0};
+	int i, ntasks = 0, ngaps = 0, placed = 0;
+	time_t from, to, st, et, cursor;
+	struct event *ev;
+	struct ical *ical;
+	icalcomponent *vtodo, *vevent;
+	icalproperty *prop;
+	GHashTable *scheduled;
+	const char *uid;
+	char *new_uid;
+	gint64 trace;
+
+	to = cal->today + DAY_SECONDS;
+	from = max(cal->today,
+		   get_smallest_closest_timeblock(time(NULL), SMALLEST_TIMEBLOCK));
+
+	if (from >= to)
+		return;
+
+	trace = trace_begin();
 
-static int on_state_change(GtkWidget *widget, GdkEvent *ev, gpointer user_data) {
-	struct extra_data *data = (struct extra_data*)user_data;
-	struct cal *cal = data->cal;
+	on_change_view(cal);
 
-		/* calendar_refresh_events(cal); */
-	gtk_widget_queue_draw(cal->widget);
-	/* calendar_print_state(cal); */
+	scheduled = g_hash_table_new(g_str_hash, g_str_equal);
+	cursor = from;
 
-	return 1;
-}
+	// one pass over the sorted view: take back the blocks still to
+	// come, note which tasks keep theirs, and collect the gaps
+	for (i = 0; i < cal->nevents; i++) {
+		ev = &cal->events[i];
+		vevent_span_timet(ev->ical, ev->vevent, &st, &et);
+		uid = vevent_task(ev->vevent);
 
+		if (uid && st >= from && st < to && !(ev->flags & EV_IMMOVABLE)) {
+			icalcomponent_remove_component(ev->ical->calendar,
+						       ev->vevent);
+			changed[ev->ical - cal->calendars] = true;
+			continue;
+		}
 
-static char * file_load(char *path) {
-	FILE *f = fopen(path, "rb");
-	if (!f) return NULL;
-	fseek(f, 0, SEEK_END);
-	long fsize = ftell(f);
-	fseek(f, 0, SEEK_SET);
+		if (uid)
+			g_hash_table_add(scheduled, (gpointer)uid);
 
-	char *string = malloc(fsize);
-	int res = fread(string, fsize, 1, f);
-	if (!res) return NULL;
-	fclose(f);
-	return string;
-}
+		if (st >= to || et <= cursor ||
+		    icalcomponent_get_dtstart(ev->vevent).is_date)
+			continue;
 
-static struct ical * calendar_load_ical(struct cal *cal, char *path) {
-	// TODO: don't load duplicate calendars
-	struct ical* ical;
+		if (st > cursor) {
+			g_gaps = grow_array(g_gaps, &g_gaps_size, ngaps + 1,
+					    sizeof(*g_gaps));
+			g_gaps[ngaps].st = cursor;
+			g_gaps[ngaps++].et = st;
+		}
 
-	// TODO: free icalcomponent somewhere
-	const char *str = file_load(path);
-	if (str == NULL) {
-		printf("failed to read calendar\n");
-		return NULL;
+		cursor = et;
 	}
 
-	icalcomponent *calendar = icalparser_parse_string(str);
-	if (!calendar) {
-		printf("failed to parse calendar\n");
-		return NULL;
+	if (cursor < to) {
+		g_gaps = grow_array(g_gaps, &g_gaps_size, ngaps + 1,
+				    sizeof(*g_gaps));
+		g_gaps[ngaps].st = cursor;
+		g_gaps[ngaps++].et = to;
 	}
 
-	// TODO: support >128 calendars
-	if (ARRAY_SIZE(cal->calendars) == cal->ncalendars) {
-		printf("calendar too big (well its not too big, viscal just sucks\n");
-		return NULL;
-	}
+	for (i = 0; i < cal->ncalendars; i++) {
+		ical = &cal->calendars[i];
+		if (!ical->visible)
+			continue;
 
-	ical = &cal->calendars[cal->ncalendars++];
-	ical->calendar = calendar;
-	ical->visible = true;
+		for (vtodo = icalcomponent_get_first_component(ical->calendar,
+							       ICAL_VTODO_COMPONENT);
+		     vtodo != NULL;
+		     vtodo = icalcomponent_get_next_component(ical->calendar,
+							      ICAL_VTODO_COMPONENT))
+		{
+			uid = icalcomponent_get_uid(vtodo);
+			if (uid && g_hash_table_contains(scheduled, uid))
+				continue;
 
-	free((void*)str);
-	return ical;
-}
+			g_tasks = grow_array(g_tasks, &g_tasks_size,
+					     ntasks + 1, sizeof(*g_tasks));
 
+			if (!todo_task(cal, ical, vtodo, &g_tasks[ntasks]) ||
+			    g_tasks[ntasks].latest <= from ||
+			    g_tasks[ntasks].earliest >= to)
+				continue;
 
-/* static void */
-/* event_set_start(struct event *ev, time_t time, const icaltimezone *zone) { */
-/*   if (zone == NULL) */
-/*     zone = g_timezone; */
-/*   icaltimetype ictime = icaltime_from_timet_with_zone_with_zone(time, 1, zone); */
-/*   icalcomponent_set_dtstart(ev->vevent, ictime); */
-/* } */
+			ntasks++;
+		}
+	}
 
-/* static void */
-/* event_set_end(struct event *ev, time_t time, const icaltimezone *zone) { */
-/*   if (zone == NULL) */
-/*     zone = g_timezone; */
-/*   icaltimetype ictime = icaltime_from_timet_with_zone_with_zone(time, 1, zone); */
-/*   icalcomponent_set_dtend(ev->vevent, ictime); */
-/* } */
+	qsort(g_tasks, ntasks, sizeof(*g_tasks), sort_task);
 
+	for (i = 0; i < ntasks; i++) {
+		if (!place_task(&g_gaps, &ngaps, &g_gaps_size, &g_tasks[i],
+				&st))
+			continue;
 
-static struct event *get_target(struct cal *cal) {
-	if (cal->target == -1)
-		return NULL;
+		// blocks find their task by UID
+		if (!(uid = icalcomponent_get_uid(g_tasks[i].vtodo))) {
+			new_uid = g_uuid_string_random();
+			icalcomponent_set_uid(g_tasks[i].vtodo, new_uid);
+			g_free(new_uid);
+			uid = icalcomponent_get_uid(g_tasks[i].vtodo);
+		}
 
-	return &cal->events[cal->target];
-}
+		vevent = vevent_new(st, st + g_tasks[i].dur,
+				    icalcomponent_get_summary(g_tasks[i].vtodo));
+		prop = icalproperty_new_x(uid);
+		icalproperty_set_x_name(prop, TASK_PROP);
+		icalcomponent_add_property(vevent, prop);
 
-static icaltimetype icaltime_from_timet_ours(time_t time, int is_date,
-					     struct cal *cal)
-{
-	icaltimezone *tz;
-	tz = cal == NULL ? g_cal_tz : cal->tz;
+		icalcomponent_add_component(g_tasks[i].ical->calendar, vevent);
+		changed[g_tasks[i].ical - cal->calendars] = true;
+		placed++;
+	}
 
-	return icaltime_from_timet_with_zone(time, is_date, tz_utc);
+	g_hash_table_destroy(scheduled);
+	calendars_changed(cal, changed);
+
+	log_info("scheduled %d of %d tasks", placed, ntasks);
+	trace_end(TRACE_SCHEDULE_TASKS, trace);
 }
 
-static void calendar_drop(struct cal *cal, double mx, double my) {
-	struct event *ev = get_target(cal);
+static void save_calendar(struct ical *calendar)
+{
+	gint64 trace = trace_begin();
 
-	if (!ev)
+#ifdef VISCAL_CALDAV
+	if (calendar->source == SOURCE_CALDAV) {
+		caldav_save(calendar->caldav);
+		trace_end(TRACE_SAVE_CALENDAR, trace);
 		return;
+	}
+#endif
 
-	icaltime_span span = icalcomponent_get_span(ev->vevent);
-
-	// TODO: use default event ARRAY_SIZE when dragging from gutter?
-	time_t len = span.end - span.start;
+	assert(calendar->source == SOURCE_FILE);
+	log_info("saving %s", calendar->source_location);
 
-	// XXX: should dragging timezone be the local timezone?
-	// XXX: this will probably destroy the timezone, we don't want that
-	// TODO: convert timezone on drag?
+	const char *str =
+		icalcomponent_as_ical_string_r(calendar->calendar);
 
-	icaltimetype startt =
-		icaltime_from_timet_ours(ev->drag_time, 0, cal);
+	FILE *fd = fopen(calendar->source_location, "w+");
 
-	icalcomponent_set_dtstart(ev->vevent, startt);
+	fwrite(str, strlen(str), 1, fd);
 
-	icaltimetype endt =
-		icaltime_from_timet_ours(ev->drag_time + len, 0, cal);
+	fclose(fd);
 
-	icalcomponent_set_dtend(ev->vevent, endt);
+	trace_end(TRACE_SAVE_CALENDAR, trace);
 }
 
 
-static time_t location_to_time(time_t start, time_t end, double loc) {
-	return (time_t)((double)start) + (loc * (end - start));
-}
+// search
+//
+// an inverted index from the lowercased words of SUMMARY, DESCRIPTION and
+// LOCATION to the events that have them. it's brought up to date when a
+// search runs: calendars that changed since are walked again, but only
+// events whose text hashes differently are split into words again.
+// finishing an edit updates its event straight away
+struct search_doc {
+	struct ical *ical;
+	icalcomponent *vevent;
+	char **words;
+	guint hash;
+	unsigned gen;
+};
 
+struct search_match {
+	struct ical *ical;
+	icalcomponent *vevent;
+	time_t start;
+};
 
+static struct {
+	GHashTable *words; // word -> set of search_doc
+	unsigned gen;
 
-static time_t calendar_pos_to_time(struct cal *cal, double y) {
-	// TODO: this is wrong wrt. zoom
-	return location_to_time(calendar_view_start(cal),
-				calendar_view_end(cal),
-				y/((double)cal->height * cal->zoom));
+	// the last search by start time, n and N walk these
+	struct search_match *matches;
+	int nmatches, matches_size;
+} g_search;
+
+static int search_sep(char c)
+{
+	// utf-8 sequences stay inside words
+	return (unsigned char)c < 0x80 && !g_ascii_isalnum(c);
 }
 
-static time_t calendar_loc_to_time(struct cal *cal, double y) {
-	return location_to_time(calendar_view_start(cal),
-				calendar_view_end(cal),
-				y/cal->zoom);
+static void search_split(const char *str, GPtrArray *words)
+{
+	const char *start;
+
+	if (str == NULL)
+		return;
+
+	while (*str) {
+		while (*str && search_sep(*str))
+			str++;
+
+		start = str;
+
+		while (*str && !search_sep(*str))
+			str++;
+
+		if (str > start)
+			g_ptr_array_add(words, g_ascii_strdown(start, str - start));
+	}
 }
 
-static void event_click(struct cal *cal, struct event *event, int mx, int my) {
-	printf("clicked %s\n", icalcomponent_get_summary(event->vevent));
+static guint search_hash(icalcomponent *vevent)
+{
+	const char *fields[] = {
+		icalcomponent_get_summary(vevent),
+		icalcomponent_get_description(vevent),
+		icalcomponent_get_location(vevent),
+	};
+	guint hash = 0;
 
-	calendar_pos_to_time(cal, my);
+	for (size_t i = 0; i < ARRAY_SIZE(fields); i++)
+		hash = hash * 31 + (fields[i] ? g_str_hash(fields[i]) : 0);
+
+	return hash;
 }
 
-// TODO: this should handle zh_CN and others as well
-void time_remove_seconds(char *time, int n) {
-	int len = strlen(time);
-	int count = 0;
-	char *ws;
-	for (int i = 0; i < len; ++i) {
-		if (count == n) {
-			ws = &time[i];
-			while (*ws != '\0' &&
-			       (*ws == ':' ||
-				(*ws >= '0' && *ws <= '9'))) ws++;
-			len = strlen(ws);
-			memcpy(&time[i-1], ws, len);
-			time[i-1+len] = '\0';
-			return;
+static void search_index_doc(struct search_doc *doc)
+{
+	GPtrArray *words = g_ptr_array_new();
+	GHashTable *set;
+
+	search_split(icalcomponent_get_summary(doc->vevent), words);
+	search_split(icalcomponent_get_description(doc->vevent), words);
+	search_split(icalcomponent_get_location(doc->vevent), words);
+
+	for (guint i = 0; i < words->len; i++) {
+		set = g_hash_table_lookup(g_search.words,
+					  g_ptr_array_index(words, i));
+		if (!set) {
+			set = g_hash_table_new(g_direct_hash, g_direct_equal);
+			g_hash_table_insert(g_search.words,
+					    g_strdup(g_ptr_array_index(words, i)),
+					    set);
 		}
-		// FIXME: instead of (==':'), we want (!= 0..9), in a unicode-enumerated way
-		count += time[i] == ':' ? 1 : 0;
+
+		g_hash_table_add(set, doc);
 	}
+
+	g_ptr_array_add(words, NULL);
+	doc->words = (char **)g_ptr_array_free(words, FALSE);
+	doc->hash = search_hash(doc->vevent);
 }
 
+static void search_unindex_doc(struct search_doc *doc)
+{
+	GHashTable *set;
 
-static char *format_locale_time(char *buffer, int bsize, struct tm *tm) {
-	strftime(buffer, bsize, "%X", tm);
-	time_remove_seconds(buffer, 2);
-	return buffer;
-}
+	for (char **word = doc->words; word && *word; word++) {
+		// a word can come up more than once
+		if (!(set = g_hash_table_lookup(g_search.words, *word)))
+			continue;
 
+		g_hash_table_remove(set, doc);
 
-static char *format_locale_timet(char *buffer, int bsize, time_t time) {
-	struct tm lt;
-	lt = *localtime(&time);
-	return format_locale_time(buffer, bsize, &lt);
+		if (g_hash_table_size(set) == 0)
+			g_hash_table_remove(g_search.words, *word);
+	}
+
+	g_strfreev(doc->words);
+	doc->words = NULL;
+}
+
+static void search_doc_free(gpointer data)
+{
+	search_unindex_doc(data);
+	g_free(data);
 }
 
+static void search_update_event(struct ical *ical, icalcomponent *vevent)
+{
+	struct search_doc *doc = g_hash_table_lookup(ical->search_docs, vevent);
+
+	if (!doc) {
+		doc = g_new0(struct search_doc, 1);
+		doc->ical = ical;
+		doc->vevent = vevent;
+		g_hash_table_insert(ical->search_docs, vevent, doc);
+		search_index_doc(doc);
+	} else if (doc->hash != search_hash(vevent)) {
+		search_unindex_doc(doc);
+		search_index_doc(doc);
+	}
 
+	doc->gen = g_search.gen;
+}
 
-static icalcomponent *create_event(struct cal *cal, time_t start, time_t end,
-				   icalcomponent *ical) {
-	static const char *default_event_summary = "";
+static void search_update_calendar(struct ical *ical)
+{
+	GHashTableIter iter;
+	gpointer doc;
 	icalcomponent *vevent;
-	icaltimetype dtstart = icaltime_from_timet_ours(start, 0, cal);
-	icaltimetype dtend = icaltime_from_timet_ours(end, 0, cal);
-
-	vevent = icalcomponent_new(ICAL_VEVENT_COMPONENT);
 
-	icalcomponent_set_summary(vevent, default_event_summary);
-	icalcomponent_set_dtstart(vevent, dtstart);
-	icalcomponent_set_dtend(vevent, dtend);
-	icalcomponent_add_component(ical, vevent);
+	if (!ical->search_dirty)
+		return;
 
-	calendar_refresh_events(cal);
-	cal->select_after_sort = vevent;
+	if (!ical->search_docs)
+		ical->search_docs = g_hash_table_new_full(g_direct_hash,
+							  g_direct_equal, NULL,
+							  search_doc_free);
+
+	g_search.gen++;
+
+	for (vevent = icalcomponent_get_first_component(ical->calendar,
+							ICAL_VEVENT_COMPONENT);
+	     vevent != NULL;
+	     vevent = icalcomponent_get_next_component(ical->calendar,
+						       ICAL_VEVENT_COMPONENT))
+		search_update_event(ical, vevent);
+
+	// whatever we didn't see this time is gone
+	g_hash_table_iter_init(&iter, ical->search_docs);
+	while (g_hash_table_iter_next(&iter, NULL, &doc)) {
+		if (((struct search_doc *)doc)->gen != g_search.gen)
+			g_hash_table_iter_remove(&iter);
+	}
 
-	return vevent;
+	ical->search_dirty = false;
 }
 
-static icalcomponent *calendar_def_cal(struct cal *cal) {
-  // TODO: configurable default calendar
-  if (cal->ncalendars > 0)
-    return cal->calendars[0].calendar;
-  return NULL;
+// an edit we know about, no need to walk its calendar for it
+static void search_event_changed(struct ical *ical, icalcomponent *vevent)
+{
+	if (ical->search_docs)
+		search_update_event(ical, vevent);
 }
 
-static time_t closest_timeblock_for_timet(time_t st, int timeblock_size) {
-	struct tm lt;
-	lt = *localtime(&st);
-	lt.tm_min = round(lt.tm_min / timeblock_size) * timeblock_size;
-	lt.tm_sec = 0; // removes jitter
-	return mktime(&lt);
+static int sort_search_match(const void *a, const void *b)
+{
+	const struct search_match *ma = a, *mb = b;
+	return (ma->start > mb->start) - (ma->start < mb->start);
 }
 
-static time_t closest_timeblock(struct cal *cal, int y) {
-	time_t st = calendar_pos_to_time(cal, y);
-	return closest_timeblock_for_timet(st, cal->timeblock_size);
-}
+// events in visible calendars that have every word of query
+static int search(struct cal *cal, const char *query)
+{
+	GPtrArray *words = g_ptr_array_new_with_free_func(g_free);
+	GHashTable *set, *smallest = NULL;
+	GHashTableIter iter;
+	gpointer key;
+	struct search_doc *doc;
+	guint i;
+	int c;
+
+	if (!g_search.words)
+		g_search.words = g_hash_table_new_full(g_str_hash, g_str_equal,
+						       g_free,
+						       (GDestroyNotify)g_hash_table_unref);
+
+	for (c = 0; c < cal->ncalendars; c++)
+		search_update_calendar(&cal->calendars[c]);
+
+	g_search.nmatches = 0;
+	search_split(query, words);
+
+	for (i = 0; i < words->len; i++) {
+		set = g_hash_table_lookup(g_search.words,
+					  g_ptr_array_index(words, i));
+		if (!set) {
+			smallest = NULL;
+			break;
+		}
 
+		if (!smallest || g_hash_table_size(set) < g_hash_table_size(smallest))
+			smallest = set;
+	}
 
+	if (!smallest) {
+		g_ptr_array_unref(words);
+		return 0;
+	}
 
-static int event_hit (struct event *ev, double mx, double my) {
-	return
-		mx >= ev->x
-		&& mx <= (ev->x + ev->width)
-		&& my >= ev->y
-		&& my <= (ev->y + ev->height);
-}
+	// check the rarest word's events for the others
+	g_hash_table_iter_init(&iter, smallest);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		doc = key;
 
+		for (i = 0; i < words->len; i++) {
+			set = g_hash_table_lookup(g_search.words,
+						  g_ptr_array_index(words, i));
+			if (set != smallest && !g_hash_table_contains(set, doc))
+				break;
+		}
 
-static int events_hit (struct event *events, int nevents,
-				 double mx, double my)
-{
-	for (int i = 0; i < nevents; ++i) {
-		if (event_hit(&events[i], mx, my))
-			return i;
+		if (i < words->len || !doc->ical->visible)
+			continue;
+
+		g_search.matches = grow_array(g_search.matches,
+					      &g_search.matches_size,
+					      g_search.nmatches + 1,
+					      sizeof(*g_search.matches));
+		g_search.matches[g_search.nmatches].ical = doc->ical;
+		g_search.matches[g_search.nmatches].vevent = doc->vevent;
+		vevent_span_timet(doc->ical, doc->vevent,
+				  &g_search.matches[g_search.nmatches].start, NULL);
+		g_search.nmatches++;
 	}
-	return -1;
+
+	qsort(g_search.matches, g_search.nmatches, sizeof(*g_search.matches),
+	      sort_search_match);
+
+	g_ptr_array_unref(words);
+	return g_search.nmatches;
 }
 
-static void zoom(struct cal *cal, double amt)
+// the next match after the selection, or the one before it, wrapping
+static void search_jump(struct cal *cal, int dir)
 {
-	double newzoom = cal->zoom - amt * max(0.1, log(cal->zoom)) * 0.5;
+	struct event *sel = get_selected_event(cal);
+	struct search_match *m;
+	time_t from = sel ? sel->start : cal->current;
+	int lo = 0, hi = g_search.nmatches, mid, i;
 
-	if (newzoom < ZOOM_MIN) {
-		newzoom = ZOOM_MIN;
+	if (g_search.nmatches == 0)
+		return;
+
+	// first match starting after from
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (g_search.matches[mid].start <= from)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	else if (newzoom > ZOOM_MAX) {
-		newzoom = ZOOM_MAX;
+
+	if (dir > 0) {
+		i = lo % g_search.nmatches;
+	} else {
+		// skip back over the one we're on
+		for (i = lo - 1; i >= 0 && g_search.matches[i].start >= from; i--)
+			;
+		if (i < 0)
+			i = g_search.nmatches - 1;
 	}
 
-	cal->zoom = newzoom;
-	cal->zoom_at = cal->my;
+	m = &g_search.matches[i];
+
+	// deleted since the search
+	if (!icalcomponent_get_parent(m->vevent))
+		return;
+
+	cal->current = m->start;
+	if (!timeline_in_view(cal))
+		center_view(cal);
+
+	cal->select_after_sort = m->vevent;
+	calendar_refresh_events(cal);
 }
 
-static int event_minutes(struct event *event)
+static void search_mode(struct cal *cal)
 {
-	time_t st, et;
-	vevent_span_timet(event->vevent, &st, &et);
-	return (et - st) / 60;
+	set_edit_buffer("");
+	cal->flags |= CAL_SEARCHING;
 }
 
-
-static int timeblock_size(struct cal *cal)
+static void search_next(struct cal *cal)
 {
-	if (cal->selected_event_ind != -1) {
-		struct event *ev = get_selected_event(cal);
-		return event_minutes(ev);
-	}
+	for (int i = 0; i < cal->repeat; i++)
+		search_jump(cal, 1);
+}
 
-	return cal->timeblock_size;
+static void search_prev(struct cal *cal)
+{
+	for (int i = 0; i < cal->repeat; i++)
+		search_jump(cal, -1);
 }
 
-static int find_closest_event(struct cal *cal, time_t near, int rel)
+static void finish_searching(struct cal *cal)
 {
-	struct event *ev;
-	int is_up, ind;
-	time_t start, end, prev;
+	gint64 trace = trace_begin();
+	const char *query = edit_buffer_text(false);
+	int n = search(cal, query);
+	trace_end(TRACE_SEARCH, trace);
 
-	is_up = rel == -1;
-	prev = near;
+	cal->flags &= ~CAL_SEARCHING;
+	log_info("%d events match '%s'", n, query);
 
-	if (cal->nevents == 0)
-		return -1;
-	else if (cal->nevents == 1)
-		return 0;
+	search_jump(cal, 1);
+}
 
-	for (int i = cal->nevents-1; i >= 0; i--) {
-		ev = &cal->events[i];
-		vevent_span_timet(ev->vevent, &start, &end);
+static void finish_editing(struct cal *cal)
+{
+	struct event *event = get_selected_event(cal);
+	const char *text = edit_buffer_text(false);
+	icalproperty *prop;
+
+	if (!event)
+		return;
+
+	switch (cal->edit_field) {
+	case FIELD_SUMMARY:
+		icalcomponent_set_summary(event->vevent, text);
+		break;
 
-		if (end <= near) {
-			ind = is_up ? i : i+1;
-			return ind == cal->nevents ? -1 : ind;
+	// an empty one goes away rather than staying blank
+	case FIELD_DESCRIPTION:
+	case FIELD_LOCATION:
+		prop = icalcomponent_get_first_property(event->vevent,
+			cal->edit_field == FIELD_DESCRIPTION
+			? ICAL_DESCRIPTION_PROPERTY : ICAL_LOCATION_PROPERTY);
+
+		if (prop && *text == '\0') {
+			icalcomponent_remove_property(event->vevent, prop);
+			icalproperty_free(prop);
+		} else if (*text && cal->edit_field == FIELD_DESCRIPTION) {
+			icalcomponent_set_description(event->vevent, text);
+		} else if (*text) {
+			icalcomponent_set_location(event->vevent, text);
 		}
+		break;
 	}
 
-	return 0;
+	search_event_changed(event->ical, event->vevent);
+
+	// leave edit mode, clear inserting flag
+	cal->flags &= ~(CAL_CHANGING | CAL_INSERTING);
+
+	// save the calendar
+	save_calendar(event->ical);
 }
 
-static inline int relative_selection(struct cal *cal, int rel)
+static time_t get_selection_end(struct cal *cal)
 {
-	if (cal->selected_event_ind == -1) {
-		return find_closest_event(cal, cal->current, rel);
-	}
-
-	return clamp(cal->selected_event_ind + rel, 0, cal->nevents - 1);
+	return cal->current + cal->timeblock_size * 60;
 }
 
-static time_t get_hour(time_t current)
+static int event_is_today(time_t today, struct event *event)
 {
-	struct tm current_tm;
-	current_tm = *localtime(&current);
-	current_tm.tm_min = 0;
-	current_tm.tm_sec = 0;
-	return mktime(&current_tm);
+	time_t st;
+	vevent_span_timet(event->ical, event->vevent, &st, NULL);
+	return st < today + DAY_SECONDS;
 }
 
-static int get_minute(time_t current)
+static void move_event(struct event *event, int minutes)
 {
-	struct tm current_tm;
-	current_tm = *localtime(&current);
-	return current_tm.tm_min;
+	time_t st, et;
+
+	vevent_span_timet(event->ical, event->vevent, &st, &et);
+	vevent_set_span(event->ical, event->vevent, st + minutes * 60,
+			et + minutes * 60);
 }
 
-static time_t get_smallest_closest_timeblock(time_t current, int round_by)
+
+
+static void move_event_action(struct cal *cal, int direction)
 {
-	struct tm current_tm;
-	current_tm = *localtime(&current);
-	current_tm.tm_min =
-		round(current_tm.tm_min / (double)round_by) * round_by;
-	current_tm.tm_sec = 0;
+	int i, first, last;
 
-	return mktime(&current_tm);
+	if (!selection_range(cal, &first, &last))
+		return;
+
+	// each calendar is marked dirty and re-sorted once on the next view
+	for (i = first; i <= last; i++) {
+		if (!in_selection(cal, i))
+			continue;
+
+		move_event(&cal->events[i],
+			   direction * cal->repeat * SMALLEST_TIMEBLOCK);
+		calendar_changed(cal, cal->events[i].ical);
+	}
 }
 
-static void align_down(struct cal *cal)
+static void save_calendars(struct cal *cal)
 {
-	/* assert(!"implement me"); */
-	struct event *event =
-		get_selected_event(cal);
-	(void)event;
+	log_debug("saving calendars");
+	for (int i = 0; i < cal->ncalendars; ++i)
+		save_calendar(&cal->calendars[i]);
 }
 
-static void align_up(struct cal *cal)
+// registers
+//
+// "a to "z, and the unnamed one in slot 0. a register holds the yanked
+// events themselves rather than copies: removed events are never freed,
+// so it stays good after a delete, and the copies are only made when
+// pasting. it does see edits made to its events after the yank.
+struct yanked {
+	struct ical *ical;
+	icalcomponent *vevent;
+};
+
+struct event_register {
+	struct yanked *events;
+	int nevents, size;
+};
+
+static struct event_register g_registers[1 + 26];
+
+static void yank_range(struct cal *cal, int first, int last)
 {
-	/* assert(!"implement me"); */
-	struct event *event =
-		get_selected_event(cal);
-	(void)event;
+	struct event_register *reg = &g_registers[cal->reg];
+	int i;
+
+	reg->events = grow_array(reg->events, &reg->size, last - first + 1,
+				 sizeof(*reg->events));
+	reg->nevents = 0;
+
+	for (i = first; i <= last; i++) {
+		if (!in_selection(cal, i))
+			continue;
+
+		reg->events[reg->nevents].ical = cal->events[i].ical;
+		reg->events[reg->nevents].vevent = cal->events[i].vevent;
+		reg->nevents++;
+	}
 }
 
-static void align_hour(struct cal *cal)
+static void yank_action(struct cal *cal)
 {
-	struct tm current_tm;
-	time_t hour;
-	current_tm = *localtime(&cal->current);
-	current_tm.tm_min =
-		round(current_tm.tm_min / 60.0) * 60;
-	current_tm.tm_sec = 0;
-	hour = mktime(&current_tm);
+	int first, last;
 
-	printf("tm_min %d\n", current_tm.tm_min);
+	if (!selection_range(cal, &first, &last))
+		return;
 
-	cal->current = hour;
+	yank_range(cal, first, last);
+	normal_mode(cal);
 }
 
-static void move_event_to(struct cal *cal, struct event *event, time_t to)
+// the pasted copies keep the register's spacing, count copies are laid
+// end to end and everything in their way is pushed down once
+static void paste_dir(struct cal *cal, int before)
 {
-	time_t st, et;
+	struct event_register *reg = &g_registers[cal->reg];
+	struct event *sel = get_selected_event(cal);
+	struct ical *ical;
+	icalcomponent *vevent, *first = NULL;
+	icalproperty *uid;
+	time_t at, reg_st, reg_et, span, st, et;
+	int i, k, ind;
 
-	vevent_span_timet(event->vevent, &st, &et);
+	if (reg->nevents == 0)
+		return;
 
-	icaltimetype dtstart =
-		icaltime_from_timet_ours(to, 0, cal);
+	vevent_span_timet(reg->events[0].ical, reg->events[0].vevent,
+			  &reg_st, NULL);
+	reg_et = reg_st;
 
-	icaltimetype dtend =
-		icaltime_from_timet_ours(to + (et - st), 0, cal);
+	for (i = 0; i < reg->nevents; i++) {
+		vevent_span_timet(reg->events[i].ical, reg->events[i].vevent,
+				  NULL, &et);
+		reg_et = max(reg_et, et);
+	}
 
-	char *dtstart_str, *dtend_str;
+	span = reg_et - reg_st;
+	if (span == 0)
+		span = timeblock_size(cal) * 60;
 
-	dtstart_str = icaltime_as_ical_string(icalcomponent_get_dtstart(event->vevent));
-	dtend_str = icaltime_as_ical_string(icalcomponent_get_dtend(event->vevent));
-	printf("before moving start:%s end:%s\n", dtstart_str, dtend_str);
+	if (sel) {
+		vevent_span_timet(sel->ical, sel->vevent, &st, &et);
+		at = before ? st : et;
+		ind = cal->selected_event_ind + !before;
+		ical = sel->ical;
+	} else {
+		at = cal->current;
+		for (ind = 0; ind < cal->nevents; ind++) {
+			vevent_span_timet(cal->events[ind].ical,
+					  cal->events[ind].vevent, &st, NULL);
+			if (st >= at)
+				break;
+		}
+		ical = get_selected_calendar(cal);
+	}
 
-	icalcomponent_set_dtstart(event->vevent, dtstart);
-	icalcomponent_set_dtend(event->vevent, dtend);
+	if (ical == NULL)
+		return;
 
-	dtstart = icalcomponent_get_dtstart(event->vevent);
-	dtend = icalcomponent_get_dtend(event->vevent);
-	dtstart_str = icaltime_as_ical_string(dtstart);
-	dtend_str = icaltime_as_ical_string(dtend);
-	printf("after moving start:%s end:%s\n", dtstart_str, dtend_str);
+	for (k = 0; k < cal->repeat; k++) {
+		for (i = 0; i < reg->nevents; i++) {
+			vevent_span_timet(reg->events[i].ical,
+					  reg->events[i].vevent, &st, &et);
 
-	calendar_refresh_events(cal);
-}
+			vevent = icalcomponent_new_clone(reg->events[i].vevent);
+			vevent_copy_timezones(reg->events[i].ical, ical, vevent);
 
-static void move_event_now(struct cal *cal)
-{
-	struct event *event =
-		get_selected_event(cal);
+			// a copy is a new event
+			uid = icalcomponent_get_first_property(vevent,
+							       ICAL_UID_PROPERTY);
+			if (uid) {
+				icalcomponent_remove_property(vevent, uid);
+				icalproperty_free(uid);
+			}
 
-	if (event == NULL)
-		return;
+			st += at - reg_st + k * span;
+			et += at - reg_st + k * span;
+			vevent_set_span(ical, vevent, st, et);
+			icalcomponent_add_component(ical->calendar, vevent);
 
-	time_t closest =
-		get_smallest_closest_timeblock(time(NULL), SMALLEST_TIMEBLOCK);
+			if (!first)
+				first = vevent;
+		}
+	}
 
-	move_event_to(cal, event, closest);
-}
+	calendar_changed(cal, ical);
 
-static int time_in_view(struct cal *cal, time_t time) {
-	time_t st = calendar_loc_to_time(cal, 0);
-	time_t et = calendar_loc_to_time(cal, 1.0);
+	// the view doesn't have the copies yet, so this only pushes what
+	// was already there. locked events are hopped over, not in the way
+	while (ind < cal->nevents && !can_push(&cal->events[ind]))
+		ind++;
 
-	return time >= st && time <= et;
-}
+	push_down(cal, ind, at + cal->repeat * span);
 
-static int timeline_in_view(struct cal *cal)
-{
-	return time_in_view(cal, cal->current);
+	set_current_calendar(cal, ical);
+	cal->select_after_sort = first;
 }
 
-static void deselect(struct cal *cal)
+static void paste_after(struct cal *cal)
 {
-	cal->selected_event_ind = -1;
+	paste_dir(cal, 0);
 }
 
-static void move_now(struct cal *cal)
+static void paste_before(struct cal *cal)
 {
-	deselect(cal);
-
-	cal->current =
-		get_smallest_closest_timeblock(time(NULL), SMALLEST_TIMEBLOCK);
-
-	if (!timeline_in_view(cal))
-		center_view(cal);
+	paste_dir(cal, 1);
 }
 
-static void insert_event(struct cal *cal, time_t st, time_t et,
-			 struct ical *ical)
+static int closest_to_current(struct cal *cal, int ind_hint)
 {
-	cal->flags |= CAL_INSERTING;
-	create_event(cal, st, et, ical->calendar);
+	int timeblock = timeblock_size(cal);
+	return query_span(cal, ind_hint-1 < 0 ? 0 : ind_hint-1, cal->current,
+			  cal->current + timeblock * 60, 0, 0);
 }
 
-static void insert_event_action_with(struct cal *cal, time_t st)
+static void delete_event(struct cal *cal, struct event *event)
 {
-	// we should eventually always have a calendar
-	// at least a temporary one
-	if (cal->ncalendars == 0)
-		return;
+	int i, ind = -1;
+	time_t st;
+	vevent_span_timet(event->ical, event->vevent, &st, NULL);
+	icalcomponent_remove_component(event->ical->calendar, event->vevent);
+	calendar_changed(cal, event->ical);
 
-	time_t et = st + cal->timeblock_size * 60;
+	for (i = cal->nevents - 1; i >= 0; i--) {
+		if (&cal->events[i] == event) {
+			ind = i;
+			break;
+		}
+	}
 
-	insert_event(cal, st, et, current_calendar(cal));
+	assert(ind != -1);
+
+	memmove(&cal->events[ind],
+		&cal->events[ind + 1],
+		(cal->nevents - ind - 1) * sizeof(*cal->events));
+
+	// adjust indices
+	cal->nevents--;
+	cal->selected_event_ind = closest_to_current(cal, 0);
+	cal->target--;
+	normal_mode(cal);
 }
 
-static void insert_event_after_action(struct cal *cal)
+// delete the event, and then pull everything below upwards (within that day)
+static void delete_timeblock(struct cal *cal)
 {
-	time_t start = cal->current + cal->timeblock_size * 60;
-	insert_event_action_with(cal, start);
-}
+	bool changed[ARRAY_SIZE(cal->calendars)] = {0};
+	int first;
+	int i;
+	int timeblock = timeblock_size(cal);
+
+	struct event *event =
+		get_selected_event(cal);
 
+	if (event) {
+		yank_range(cal, cal->selected_event_ind,
+			   cal->selected_event_ind);
+		delete_event(cal, event);
+	}
 
-static void insert_event_action(struct cal *cal)
-{
-	insert_event_action_with(cal, cal->current);
-}
+	// get all events in current day past dtend of current selection
+	time_t starting_at =
+		get_selection_end(cal);
 
+	first =
+		first_event_starting_at(cal, starting_at);
 
-static void calendar_view_clicked(struct cal *cal, int mx, int my) {
-	time_t closest;
-	/* int y; */
-	char buf[32];
+	// nothing to push down today
+	if (first == -1)
+		return;
 
-	closest = closest_timeblock(cal, my);
+	for (i = first;
+	     i < cal->nevents && event_is_today(cal->today, &cal->events[i]);
+	     i++) {
+		struct event *event = &cal->events[i];
+		move_event(event, -timeblock);
+		changed[event->ical - cal->calendars] = true;
+	}
 
-	format_locale_timet(buf, sizeof(buf), closest);
-	printf("DEBUG (%d,%d) clicked @%s\n", mx, my, buf);
-	insert_event_action(cal);
+	calendars_changed(cal, changed);
+
+	cal->selected_event_ind = closest_to_current(cal, first);
 }
 
 
-static int query_span(struct cal *cal, int index_hint, time_t start, time_t end,
-		      time_t min_start, time_t max_end)
+static void delete_event_action(struct cal *cal)
 {
-	time_t st, et;
-	struct event *ev;
-
-	for (int i=index_hint; i < cal->nevents; i++) {
-		ev = &cal->events[i];
+	int i, n, first, last;
+	struct event *event;
 
-		if (!ev->ical->visible)
-			continue;
+	n = selection_range(cal, &first, &last);
+	if (n == 0)
+		return;
 
-		icaltimetype dtstart =
-			icalcomponent_get_dtstart(ev->vevent);
+	yank_range(cal, first, last);
 
-		// date events aren't spans
-		if (dtstart.is_date)
-			continue;
+	if (n == 1)
+		return delete_event(cal, &cal->events[first]);
 
-		vevent_span_timet(ev->vevent, &st, &et);
+	vevent_span_timet(cal->events[first].ical, cal->events[first].vevent,
+			  &cal->current, NULL);
 
-		if ((min_start != 0 && st < min_start) ||
-		    (max_end   != 0 && et > max_end))
+	for (i = first; i <= last; i++) {
+		if (!in_selection(cal, i))
 			continue;
-		else if (span_overlaps(st, et, start, end))
-			return i;
+
+		event = &cal->events[i];
+		icalcomponent_remove_component(event->ical->calendar,
+					       event->vevent);
+		calendar_changed(cal, event->ical);
 	}
 
-	return -1;
+	// rebuild the view once for the whole range
+	normal_mode(cal);
+	cal->selected_event_ind = -1;
+	on_change_view(cal);
+	cal->selected_event_ind = closest_to_current(cal, 0);
 }
 
-// TODO comebine parts with move_event?
-static void move_relative(struct cal *cal, int rel)
+static void cancel_editing(struct cal *cal)
 {
-	time_t st;
-	time_t et;
-	int hit;
-	int timeblock = cal->timeblock_size * 60;
+	// delete the event if we cancel during insert
+	if (cal->flags & CAL_INSERTING) {
+		struct event *event =
+			get_selected_event(cal);
 
-	// no current event selection
-	if (cal->selected_event_ind == -1)  {
-		cal->current += rel * timeblock;
+		// we should have a selected event if we're cancelling
+		assert(event);
+
+		delete_event(cal, event);
 	}
-	else { // and event is selection
-		struct event *ev = get_selected_event(cal);
-		vevent_span_timet(ev->vevent, &st, &et);
 
-		cal->current = rel > 0 ? et : st - timeblock;
+	cal->flags &= ~(CAL_CHANGING | CAL_INSERTING);
+}
+
+
+// a key press from gtk or sdl.c. like GdkEventKey, Ctrl-<letter> types
+// its control character into string
+struct key_press {
+	const char *string;
+	guint keyval;
+	bool ctrl;
+};
+
+// typing into the edit buffer, for editing and searching alike
+static void edit_buffer_keypress(struct key_press *event)
+{
+	unsigned char key = *event->string;
+
+	switch (event->keyval) {
+	case GDK_KEY_BackSpace:
+		edit_buffer_backspace();
+		return;
+
+	case GDK_KEY_Delete:
+		edit_buffer_delete();
+		return;
+
+	case GDK_KEY_Left:
+		edit_buffer_left();
+		return;
+
+	case GDK_KEY_Right:
+		edit_buffer_right();
+		return;
+
+	case GDK_KEY_Home:
+		edit_buffer_home();
+		return;
+
+	case GDK_KEY_End:
+		edit_buffer_end();
+		return;
 	}
 
-	st = cal->current;
-	et = cal->current + timeblock;
+	switch (key) {
+	// Ctrl-a
+	case 0x01:
+		edit_buffer_home();
+		return;
 
-	if ((hit = query_span(cal, 0, st, et, 0, 0)) != -1) {
-		struct event *ev = &cal->events[hit];
-		vevent_span_timet(ev->vevent, &st, &et);
+	// Ctrl-e
+	case 0x05:
+		edit_buffer_end();
+		return;
+
+	// Ctrl-u
+	case 0x15:
+		g_edit.gap = 0;
+		return;
 
-		cal->current = st;
+	// Ctrl-w
+	case 0x17:
+		edit_buffer_pop_word();
+		return;
 	}
 
-	cal->selected_event_ind = hit;
-}
-
-static void move_up(struct cal *cal, int repeat)
-{
-	move_relative(cal, -1);
+	// multibyte characters come in whole
+	if (key >= 0x20 && key != 0x7f)
+		edit_buffer_insert(event->string);
 }
 
-static void move_down(struct cal *cal, int repeat)
+static int on_edit_keypress(struct cal *cal, struct key_press *event)
 {
-	move_relative(cal, 1);
-}
+	switch (event->keyval) {
+	case GDK_KEY_Escape:
+		cancel_editing(cal);
+		return 1;
 
-static int number_of_hours_in_view(struct cal *cal)
-{
-	time_t st = calendar_loc_to_time(cal, 0);
-	time_t et = calendar_loc_to_time(cal, 1.0);
+	case GDK_KEY_Return:
+		finish_editing(cal);
+		return 1;
+	}
 
-	return (et - st) / 60 / 60;
+	edit_buffer_keypress(event);
+	return 1;
 }
 
-
-static void relative_view(struct cal *cal, int hours)
+static int on_search_keypress(struct cal *cal, struct key_press *event)
 {
-	time_t current_hour;
+	switch (event->keyval) {
+	case GDK_KEY_Escape:
+		cal->flags &= ~CAL_SEARCHING;
+		return 1;
 
-	// currently needed because the grid is hour-aligned
-	current_hour = get_hour(cal->current);
+	case GDK_KEY_Return:
+		finish_searching(cal);
+		return 1;
+	}
 
-	// zt -> cal->current - cal->today
-	cal->start_at = current_hour - cal->today - (hours * 60 * 60);
-	cal->scroll = 0;
+	edit_buffer_keypress(event);
+	return 1;
 }
 
-
-static void top_view(struct cal *cal)
+static void debug_edit_buffer(struct key_press *event)
 {
-	relative_view(cal, 0);
+	log_debug("edit buffer: %s[%x][%ld] %d %d '%s'",
+		  event->string,
+		  *event->string,
+		  strlen(event->string),
+		  event->ctrl,
+		  g_edit.gap,
+		  edit_buffer_text(true));
 }
 
-static void bottom_view(struct cal *cal)
+static void move_event_to_calendar(struct cal *cal, struct event *event,
+				   struct ical *from, struct ical *to)
 {
-	relative_view(cal, number_of_hours_in_view(cal) - 1);
-}
+	vevent_copy_timezones(from, to, event->vevent);
+	icalcomponent_remove_component(from->calendar, event->vevent);
+	icalcomponent_add_component(to->calendar, event->vevent);
+	event->ical = to;
 
-static void center_view(struct cal *cal)
-{
-	int half_hours = number_of_hours_in_view(cal) / 2;
-	relative_view(cal, half_hours);
+	calendar_changed(cal, from);
+	calendar_changed(cal, to);
 }
 
-static void expand_event(struct event *event, int minutes)
+static void next_calendar(struct cal *cal)
 {
-	icaltimetype dtend =
-		icalcomponent_get_dtend(event->vevent);
+	struct event *event;
+	struct ical *from;
+	struct ical *to;
 
-	struct icaldurationtype add_minutes =
-		icaldurationtype_from_int(minutes * 60);
+	from = &cal->calendars[cal->selected_calendar_ind];
+	cal->selected_calendar_ind =
+		(cal->selected_calendar_ind + 1) % cal->ncalendars;
 
-	icaltimetype new_dtend =
-		icaltime_add(dtend, add_minutes);
+	while((to = &cal->calendars[cal->selected_calendar_ind]) != from && !to->visible) {
+		cal->selected_calendar_ind =
+			(cal->selected_calendar_ind + 1) % cal->ncalendars;
+	}
 
-	icalcomponent_set_dtend(event->vevent, new_dtend);
-	// TODO: push down
-}
+	// only one selectable calendar
+	if (from == to)
+		return;
 
-static void expand_selection_relative(struct cal *cal, int sign)
-{
-	int *step = &cal->timeblock_step;
-	*step = SMALLEST_TIMEBLOCK;
+	log_info("using calendar %s", to->source_location);
 
-	struct event *event = get_selected_event(cal);
+	// a visual range follows the calendar selection
+	if (cal->flags & CAL_VISUAL) {
+		int i, first, last;
 
-	int size = timeblock_size(cal);
+		if (!selection_range(cal, &first, &last))
+			return;
 
-	/* *step = min(*step, size); */
+		for (i = first; i <= last; i++) {
+			event = &cal->events[i];
+			if (in_selection(cal, i) && event->ical != to)
+				move_event_to_calendar(cal, event, event->ical, to);
+		}
+	}
+	// move event to next calendar if we're editing it
+	else if (cal->flags & CAL_CHANGING) {
+		event = get_selected_event(cal);
+		if (!event)
+			assert(!"no selected event when CAL_CHANGING");
 
-	/* if (sign < 0 && size <= 15) */
-	/* 	*step = 5; */
-	/* else if (sign > 0 && size >= 15) */
-	/* 	*step = 15; */
+		move_event_to_calendar(cal, event, from, to);
+	}
+}
 
-	int minutes = *step * sign;
+static void toggle_calendar_visibility(struct cal *cal, int ind)
+{
+	struct ical *ical;
 
-	if (size + minutes <= 0)
+	if (ind+1 > cal->ncalendars)
 		return;
 
-	// no selected event, just expand selector
-	if (event == NULL) {
-		cal->timeblock_size += minutes;
-		return;
-	} else {
-		// expand event if it's selected
-		expand_event(event, minutes);
+	ical = &cal->calendars[ind];
+	ical->visible = !ical->visible;
+
+	// don't keep inserting into a calendar we can't see
+	if (!ical->visible && ical == current_calendar(cal)) {
+		for (int i = 0; i < cal->ncalendars; i++) {
+			if (cal->calendars[i].visible) {
+				cal->selected_calendar_ind = i;
+				break;
+			}
+		}
 	}
+
+	// rebuild the event view without the hidden events
+	calendar_refresh_events(cal);
 }
 
-static void lock_selection(struct cal *cal)
+static void scroll_down(struct cal *cal)
 {
-	printf("locking event\n");
-	struct event *event = get_selected_event(cal);
-	if (!event)
-		return;
+	view_scroll_by(cal, 60*60);
+}
 
-	event->flags ^= EV_IMMOVABLE;
+static void scroll_up(struct cal *cal)
+{
+	view_scroll_by(cal, -60*60);
 }
 
-static void expand_selection(struct cal *cal)
+static void font_smaller(struct cal *cal)
 {
-	expand_selection_relative(cal, 1);
+	cal->font_size -= 2;
 }
 
-static void shrink_selection(struct cal *cal)
+static void font_bigger(struct cal *cal)
 {
-	expand_selection_relative(cal, -1);
+	cal->font_size += 2;
 }
 
-static void select_dir(struct cal *cal, int rel)
+static void change_event(struct cal *cal)
 {
-	int ind = relative_selection(cal, rel);
-	select_event(cal, ind);
-	if (!timeline_in_view(cal)) {
-		center_view(cal);
-	}
+	edit_mode(cal, EDIT_CLEAR);
 }
 
-static void select_up(struct cal *cal) 
+static void append_event(struct cal *cal)
 {
-	for (int i = 0; i < cal->repeat; i++) {
-		select_dir(cal, -1);
-	}
+	if (cal->selected_event_ind != -1)
+		edit_mode(cal, 0);
 }
 
-static void select_down(struct cal *cal)
+static void change_description(struct cal *cal)
 {
-	for (int i = 0; i < cal->repeat; i++) {
-		select_dir(cal, 1);
-	}
+	edit_mode(cal, EDIT_DESCRIPTION);
 }
 
-// TODO: make zoom_amt configurable
-static const int zoom_amt = 1.5;
+static void change_location(struct cal *cal)
+{
+	edit_mode(cal, EDIT_LOCATION);
+}
 
-static void zoom_in(struct cal *cal) {
-	for (int i=0; i < cal->repeat; i++)
-		zoom(cal, -zoom_amt);
+static void move_event_up(struct cal *cal)
+{
+	move_event_action(cal, -1);
 }
 
-static void zoom_out(struct cal *cal) {
-	for (int i=0; i < cal->repeat; i++)
-		zoom(cal, zoom_amt);
+static void move_event_down(struct cal *cal)
+{
+	move_event_action(cal, 1);
 }
 
-static int can_push(struct event *ev) {
-	if (ev->flags & EV_IMMOVABLE)
-		return 0;
+static void select_next(struct cal *cal)
+{
+	move_down(cal, cal->repeat);
+}
 
-	icaltimetype dtstart = icalcomponent_get_dtstart(ev->vevent);
-	if (dtstart.is_date)
-		return 0;
+static void select_prev(struct cal *cal)
+{
+	move_up(cal, cal->repeat);
+}
 
-	return 1;
+static void dump_trace(struct cal *cal)
+{
+	trace_dump();
 }
 
+#define TOGGLE_CALENDAR(n)					\
+	static void toggle_calendar_##n(struct cal *cal)	\
+	{							\
+		toggle_calendar_visibility(cal, n - 1);		\
+	}
 
-static void push_down(struct cal *cal, int ind, time_t push_to)
-{
-	time_t st, et, new_et;
-	struct event *ev;
+TOGGLE_CALENDAR(1)
+TOGGLE_CALENDAR(2)
+TOGGLE_CALENDAR(3)
+TOGGLE_CALENDAR(4)
+TOGGLE_CALENDAR(5)
+TOGGLE_CALENDAR(6)
+
+// key bindings
+//
+// bindings are compiled into a trie of key sequences at startup. the
+// children of every node live in one open addressed table keyed by
+// (node, key), so a keystroke is a single probe however many bindings
+// there are. digits typed before a sequence are its count, which
+// commands see as cal->repeat.
+//
+// a sequence is written like vim: "gj", "<C-d>", "<Tab>", "<C-F12>".
+// $XDG_CONFIG_HOME/viscal/config can add to and take away from the
+// defaults, one per line:
+//
+//   map <C-n> select-next
+//   unmap dd
+struct command {
+	const char *name;
+	chord_cmd *cmd;
+};
 
-	ev = &cal->events[ind];
-	vevent_span_timet(ev->vevent, &st, &et);
+static struct command commands[] = {
+	{ "align-hour",        align_hour },
+	{ "align-up",          align_up },
+	{ "align-down",        align_down },
+	{ "center-view",       center_view },
+	{ "top-view",          top_view },
+	{ "bottom-view",       bottom_view },
+	{ "zoom-in",           zoom_in },
+	{ "zoom-out",          zoom_out },
+	{ "select-down",       select_down },
+	{ "select-up",         select_up },
+	{ "delete-timeblock",  delete_timeblock },
+	{ "scroll-down",       scroll_down },
+	{ "scroll-up",         scroll_up },
+	{ "font-smaller",      font_smaller },
+	{ "font-bigger",       font_bigger },
+	{ "next-calendar",     next_calendar },
+	{ "save",              save_calendars },
+	{ "change",            change_event },
+	{ "append",            append_event },
+	{ "change-description", change_description },
+	{ "change-location",   change_location },
+	{ "delete-event",      delete_event_action },
+	{ "move-now",          move_now },
+	{ "move-event-now",    move_event_now },
+	{ "move-event-up",     move_event_up },
+	{ "move-event-down",   move_event_down },
+	{ "select-next",       select_next },
+	{ "select-prev",       select_prev },
+	{ "pushmove-down",     pushmove_down },
+	{ "pushmove-up",       pushmove_up },
+	{ "lock",              lock_selection },
+	{ "visual",            visual_mode },
+	{ "normal",            normal_mode },
+	{ "yank",              yank_action },
+	{ "paste",             paste_after },
+	{ "paste-before",      paste_before },
+	{ "expand",            expand_selection },
+	{ "push-expand",       push_expand_selection },
+	{ "shrink",            shrink_selection },
+	{ "insert",            insert_event_action },
+	{ "open-below",        open_below },
+	{ "schedule-tasks",    schedule_tasks },
+	{ "search",            search_mode },
+	{ "search-next",       search_next },
+	{ "search-prev",       search_prev },
+	{ "toggle-calendar-1", toggle_calendar_1 },
+	{ "toggle-calendar-2", toggle_calendar_2 },
+	{ "toggle-calendar-3", toggle_calendar_3 },
+	{ "toggle-calendar-4", toggle_calendar_4 },
+	{ "toggle-calendar-5", toggle_calendar_5 },
+	{ "toggle-calendar-6", toggle_calendar_6 },
+	{ "toggle-trace",      toggle_trace_overlay },
+	{ "dump-trace",        dump_trace },
+};
 
-	if (st >= push_to)
-		return;
+static const char *default_bindings[][2] = {
+	{ "ah",      "align-hour" },
+	{ "ak",      "align-up" },
+	{ "aj",      "align-down" },
+	{ "zz",      "center-view" },
+	{ "zt",      "top-view" },
+	{ "zb",      "bottom-view" },
+	{ "zi",      "zoom-in" },
+	{ "zo",      "zoom-out" },
+	{ "gj",      "select-down" },
+	{ "gk",      "select-up" },
+	{ "dd",      "delete-timeblock" },
+	{ "<C-d>",   "scroll-down" },
+	{ "<C-u>",   "scroll-up" },
+	{ "<C-->",   "font-smaller" },
+	{ "<C-=>",   "font-bigger" },
+	{ "<Tab>",   "next-calendar" },
+	{ "<C-Tab>", "next-calendar" },
+	{ "<C-s>",   "save" },
+	{ "c",       "change" },
+	{ "C",       "change" },
+	{ "s",       "change" },
+	{ "S",       "change" },
+	{ "A",       "append" },
+	{ "gd",      "change-description" },
+	{ "gl",      "change-location" },
+	{ "x",       "delete-event" },
+	{ "t",       "move-now" },
+	{ "T",       "move-event-now" },
+	{ "K",       "move-event-up" },
+	{ "J",       "move-event-down" },
+	{ "j",       "select-next" },
+	{ "k",       "select-prev" },
+	{ "<C-j>",   "pushmove-down" },
+	{ "<C-k>",   "pushmove-up" },
+	{ "l",       "lock" },
+	{ "gv",      "visual" },
+	{ "<Esc>",   "normal" },
+	{ "yy",      "yank" },
+	{ "Y",       "yank" },
+	{ "p",       "paste" },
+	{ "P",       "paste-before" },
+	{ "v",       "expand" },
+	{ "<C-v>",   "push-expand" },
+	{ "V",       "shrink" },
+	{ "i",       "insert" },
+	{ "o",       "open-below" },
+	{ "gs",      "schedule-tasks" },
+	{ "/",       "search" },
+	{ "n",       "search-next" },
+	{ "N",       "search-prev" },
+	{ "<F1>",    "toggle-calendar-1" },
+	{ "<F2>",    "toggle-calendar-2" },
+	{ "<F3>",    "toggle-calendar-3" },
+	{ "<F4>",    "toggle-calendar-4" },
+	{ "<F5>",    "toggle-calendar-5" },
+	{ "<F6>",    "toggle-calendar-6" },
+	{ "<F12>",   "toggle-trace" },
+	{ "<C-F12>", "dump-trace" },
+};
 
-	new_et = et - st + push_to;
+#define KEY_CTRL (1u << 30)
+#define KEY_SEQ_MAX 16
+#define COUNT_MAX 9999
 
-	while (++ind < cal->nevents) {
-		if (can_push(&cal->events[ind]))
-			break;
-	}
+struct key_node {
+	chord_cmd *cmd;
+	int arg; // for cmd, in g_key_arg while it runs
+	int nchildren;
+};
 
-	move_event_to(cal, ev, push_to);
+// the root is never anyone's child, so to == 0 is a free slot
+struct key_edge {
+	int from, to;
+	guint key;
+};
 
-	if (ind >= cal->nevents)
-		return;
+static struct key_node *g_key_nodes;
+static int g_nkey_nodes, g_key_nodes_size;
+static struct key_edge *g_key_edges;
+static int g_nkey_edges, g_key_edges_size;
+static int g_key_arg;
 
-	// push rest
-	push_down(cal, ind, new_et);
-}
+#ifdef VISCAL_LUA
+static void script_key_unbind(struct key_node *node);
+#endif
 
-static void push_up(struct cal *cal, int ind, time_t push_to)
+static struct key_edge *key_edge(struct key_edge *edges, int size, int from,
+				 guint key)
 {
-	time_t st, et, a_st, a_et, new_st;
-	struct event *ev, *above;
+	guint i = ((guint)from * 31 + key) * 2654435761u & (size - 1);
 
-	// our event
-	ev = &cal->events[ind];
-	vevent_span_timet(ev->vevent, &st, &et);
+	while (edges[i].to && (edges[i].from != from || edges[i].key != key))
+		i = (i + 1) & (size - 1);
 
-	move_event_to(cal, ev, push_to);
+	return &edges[i];
+}
 
-	if (ind - 1 < 0)
-		return;
+static int key_child(int node, guint key)
+{
+	if (!g_key_edges)
+		return 0;
 
-	// above event
-	above = &cal->events[ind - 1 < 0 ? 0 : ind - 1];
-	vevent_span_timet(above->vevent, &a_st, &a_et);
+	return key_edge(g_key_edges, g_key_edges_size, node, key)->to;
+}
 
-	if (push_to > a_et)
-		return;
+// keep the edge table at most half full
+static void key_edges_grow()
+{
+	struct key_edge *edges, *edge;
+	int i, size = max(64, g_key_edges_size * 2);
 
-	new_st = push_to - (a_et - a_st);
-	push_up(cal, ind-1, new_st);
+	edges = calloc(size, sizeof(*edges));
+	assert(edges);
+
+	for (i = 0; i < g_key_edges_size; i++) {
+		edge = &g_key_edges[i];
+		if (edge->to)
+			*key_edge(edges, size, edge->from, edge->key) = *edge;
+	}
+
+	free(g_key_edges);
+	g_key_edges = edges;
+	g_key_edges_size = size;
 }
 
-static void push_expand_selection(struct cal *cal)
+static int key_node_new()
 {
-	time_t st, et;
-	struct event *ev;
+	g_key_nodes = grow_array(g_key_nodes, &g_key_nodes_size,
+				 g_nkey_nodes + 1, sizeof(*g_key_nodes));
+	memset(&g_key_nodes[g_nkey_nodes], 0, sizeof(*g_key_nodes));
 
-	expand_selection(cal);
+	return g_nkey_nodes++;
+}
 
-	ev = get_selected_event(cal);
+// the node keys lead to, 0 if they aren't in the trie
+static int key_find(const guint *keys, int nkeys)
+{
+	int i, node = 0;
 
-	if (ev == NULL)
-		return;
+	if (g_nkey_nodes == 0)
+		return 0;
 
-	vevent_span_timet(ev->vevent, &st, &et);
+	for (i = 0; i < nkeys; i++) {
+		if (!(node = key_child(node, keys[i])))
+			return 0;
+	}
 
-	push_down(cal, cal->selected_event_ind+1, et);
+	return node;
 }
 
-static void pushmove_dir(struct cal *cal, int dir) {
-	time_t st, et, push_to;
-	struct event *ev;
+static void key_set(int node, chord_cmd *cmd, int arg)
+{
+#ifdef VISCAL_LUA
+	script_key_unbind(&g_key_nodes[node]);
+#endif
+	g_key_nodes[node].cmd = cmd;
+	g_key_nodes[node].arg = arg;
+}
 
-	ev = get_selected_event(cal);
+// a NULL cmd unbinds. that never adds nodes, or a sequence that was never
+// bound would turn its first keys into a prefix that waits for more
+static void key_bind(const guint *keys, int nkeys, chord_cmd *cmd, int arg)
+{
+	struct key_edge *edge;
+	int i, node = 0, next;
 
-	if (ev == NULL)
+	if (!cmd) {
+		if ((node = key_find(keys, nkeys)))
+			key_set(node, NULL, 0);
 		return;
+	}
 
-	vevent_span_timet(ev->vevent, &st, &et);
-
-	// TODO: configurable?
-	static const int adjust = SMALLEST_TIMEBLOCK * 60;
-
-	push_to = st + (adjust * dir);
+	if (g_nkey_nodes == 0)
+		key_node_new();
 
-	if (dir == 1)
-		push_down(cal, cal->selected_event_ind, push_to);
-	else
-		push_up(cal, cal->selected_event_ind, push_to);
-}
+	for (i = 0; i < nkeys; i++) {
+		if ((next = key_child(node, keys[i]))) {
+			node = next;
+			continue;
+		}
 
-static void pushmove_down(struct cal *cal) {
-	pushmove_dir(cal, 1);
-}
+		if ((g_nkey_edges + 1) * 2 > g_key_edges_size)
+			key_edges_grow();
+
+		next = key_node_new();
+		edge = key_edge(g_key_edges, g_key_edges_size, node, keys[i]);
+		edge->from = node;
+		edge->key = keys[i];
+		edge->to = next;
+		g_nkey_edges++;
+		g_key_nodes[node].nchildren++;
+		node = next;
+	}
 
-static void pushmove_up(struct cal *cal) {
-	pushmove_dir(cal, -1);
+	key_set(node, cmd, arg);
 }
 
-static void open_below(struct cal *cal)
+// vim style names, and whatever gdk calls the rest
+static guint key_from_name(const char *name)
 {
-	time_t st, et;
-	int ind;
-	time_t push_to;
-	struct event *ev;
+	static const char *aliases[][2] = {
+		{ "CR",    "Return" },
+		{ "Enter", "Return" },
+		{ "Esc",   "Escape" },
+		{ "BS",    "BackSpace" },
+		{ "Space", "space" },
+		{ "lt",    "less" },
+	};
 
-	ev = get_selected_event(cal);
+	if (g_utf8_strlen(name, -1) == 1)
+		return gdk_unicode_to_keyval(g_utf8_get_char(name));
 
-	if (ev == NULL) {
-		insert_event_after_action(cal);
-		return;
+	for (size_t i = 0; i < ARRAY_SIZE(aliases); i++) {
+		if (!strcmp(name, aliases[i][0]))
+			return gdk_keyval_from_name(aliases[i][1]);
 	}
 
-	vevent_span_timet(ev->vevent, &st, &et);
-
-	push_to = et + timeblock_size(cal) * 60;
+	return gdk_keyval_from_name(name);
+}
 
-	// push down all nearby events
-	// TODO: filter on visible calendars
-	// TODO: don't push down immovable events
-	for (ind = cal->selected_event_ind + 1; ind != -1; ind++) {
-		ind = query_span(cal, ind, et, push_to, et, 0);
+// returns the number of keys, or -1 if spec isn't a key sequence
+static int parse_keys(const char *spec, guint *keys, int max)
+{
+	char name[32];
+	const char *p = spec, *end;
+	guint ctrl;
+	int n = 0;
+	size_t len;
 
-		if (ind == -1)
-			break;
-		else
-			push_down(cal, ind, push_to);
-	}
+	while (*p) {
+		if (n == max)
+			return -1;
 
-	set_current_calendar(cal, ev->ical);
+		if (*p != '<' || !(end = strchr(p + 1, '>')) || end == p + 1) {
+			keys[n++] = gdk_unicode_to_keyval(g_utf8_get_char(p));
+			p = g_utf8_next_char(p);
+			continue;
+		}
 
-	insert_event(cal, et, push_to, ev->ical);
-}
+		// <C->> is ctrl and >, not an empty name
+		if (end[1] == '>' && end == p + 3 && !strncmp(p, "<C-", 3))
+			end++;
 
+		len = end - (p + 1);
+		if (len >= sizeof(name))
+			return -1;
 
-static void save_calendar(struct ical *calendar)
-{
-	// TODO: caldav saving
-	assert(calendar->source == SOURCE_FILE);
-	printf("DEBUG saving %s\n", calendar->source_location);
+		memcpy(name, p + 1, len);
+		name[len] = '\0';
 
-	const char *str =
-		icalcomponent_as_ical_string_r(calendar->calendar);
+		ctrl = 0;
+		if (!strncmp(name, "C-", 2) && len > 2) {
+			ctrl = KEY_CTRL;
+			memmove(name, name + 2, len - 1);
+		}
 
-	FILE *fd = fopen(calendar->source_location, "w+");
+		keys[n] = key_from_name(name);
+		if (keys[n] == GDK_KEY_VoidSymbol || keys[n] == 0)
+			return -1;
 
-	fwrite(str, strlen(str), 1, fd);
+		keys[n++] |= ctrl;
+		p = end + 1;
+	}
 
-	fclose(fd);
+	return n;
 }
 
-
-static void finish_editing(struct cal *cal)
+static chord_cmd *command_named(const char *name)
 {
-	struct event *event = get_selected_event(cal);
+	for (size_t i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(commands[i].name, name))
+			return commands[i].cmd;
+	}
 
-	if (!event)
-		return;
+	return NULL;
+}
 
-	// TODO: what are we editing?
-	// Right now we can only edit the summary
+static int bind_keys(const char *spec, const char *name)
+{
+	guint keys[KEY_SEQ_MAX];
+	chord_cmd *cmd = NULL;
+	int n = parse_keys(spec, keys, KEY_SEQ_MAX);
 
-	// set summary of selected event
-	icalcomponent_set_summary(event->vevent, g_editbuf);
+	if (n <= 0)
+		return 0;
 
-	// leave edit mode, clear inserting flag
-	cal->flags &= ~(CAL_CHANGING | CAL_INSERTING);
+	if (name && !(cmd = command_named(name)))
+		return 0;
 
-	// save the calendar
-	save_calendar(event->ical);
+	key_bind(keys, n, cmd, 0);
+	return 1;
 }
 
-static void append_str_edit_buffer(const char *src)
+static void bindings_load(const char *path)
 {
-	if (*src == '\0')
-		return;
+	char *contents, **lines, **words;
+	int i, n;
 
-	char *dst = &g_editbuf[g_editbuf_pos];
-	int c = g_editbuf_pos;
+	if (!g_file_get_contents(path, &contents, NULL, NULL))
+		return;
 
-	while (c < EDITBUF_MAX && (*dst++ = *src++))
-		c++;
+	log_info("loading key bindings from %s", path);
 
-	if (c == EDITBUF_MAX-1)
-		g_editbuf[EDITBUF_MAX-1] = '\0';
+	lines = g_strsplit(contents, "\n", -1);
 
-	g_editbuf_pos = c;
+	for (i = 0; lines[i]; i++) {
+		words = g_strsplit_set(g_strstrip(lines[i]), " \t", -1);
+		n = g_strv_length(words);
 
-}
+		if (n == 0 || words[0][0] == '\0' || words[0][0] == '#')
+			;
+		else if (n == 3 && !strcmp(words[0], "map") &&
+			 bind_keys(words[1], words[2]))
+			;
+		else if (n == 2 && !strcmp(words[0], "unmap") &&
+			 bind_keys(words[1], NULL))
+			;
+		else
+			log_warn("%s:%d: can't make sense of '%s'", path, i + 1,
+				 lines[i]);
 
-/* static void append_edit_buffer(char key) */
-/* { */
-/* 	if (g_editbuf_pos + 1 >= EDITBUF_MAX) { */
-/* 		warn("attempting to write past end of edit buffer"); */
-/* 		return; */
-/* 	} */
-/* 	g_editbuf[g_editbuf_pos++] = key; */
-/* } */
+		g_strfreev(words);
+	}
 
-static void pop_edit_buffer(int amount)
-{
-	amount = clamp(amount, 0, EDITBUF_MAX-1);
-	int top = g_editbuf_pos - amount;
-	top = clamp(top, 0, EDITBUF_MAX-1);
-	g_editbuf[top] = '\0';
-	g_editbuf_pos = top;
+	g_strfreev(lines);
+	g_free(contents);
 }
 
-static time_t get_selection_end(struct cal *cal)
+static void bindings_init()
 {
-	return cal->current + cal->timeblock_size * 60;
+	char *path;
+
+	for (size_t i = 0; i < ARRAY_SIZE(default_bindings); i++) {
+		if (!bind_keys(default_bindings[i][0], default_bindings[i][1]))
+			assert(!"bad default binding");
+	}
+
+	path = g_build_filename(g_get_user_config_dir(), "viscal", "config",
+				NULL);
+	bindings_load(path);
+	g_free(path);
 }
 
-static int event_is_today(time_t today, struct event *event)
+static void key_run(struct cal *cal, struct key_node *node)
 {
-	time_t st;
-	vevent_span_timet(event->vevent, &st, NULL);
-	return st < today + DAY_SECONDS;
+	cal->repeat = cal->count ? cal->count : 1;
+	g_key_arg = node->arg;
+	node->cmd(cal);
+	cal->repeat = 1;
+	cal->count = 0;
+	cal->reg = 0;
 }
 
-static void move_event(struct event *event, int minutes)
+// returns whether the key changed anything that needs drawing
+static int calendar_keypress(struct cal *cal, struct key_press *event)
 {
-	icaltimetype st, et;
-	struct icaldurationtype add;
+	guint key = event->keyval | (event->ctrl ? KEY_CTRL : 0);
+	int node = cal->key_node, next;
 
-	st = icalcomponent_get_dtstart(event->vevent);
-	et = icalcomponent_get_dtend(event->vevent);
+	log_debug("keystring 0x%x keyval:0x%x ctrl?:%d",
+		  *event->string, event->keyval, event->ctrl);
 
-	add = icaldurationtype_from_int(minutes * 60);
+	if (cal->flags & CAL_SEARCHING)
+		return on_search_keypress(cal, event);
 
-	st = icaltime_add(st, add);
-	et = icaltime_add(et, add);
+	// Ctrl-tab during editing still switch cal
+	if (*event->string != '\t' && (cal->flags & CAL_CHANGING)) {
+		int state_changed = on_edit_keypress(cal, event);
+		debug_edit_buffer(event);
+		return state_changed;
+	}
 
-	icalcomponent_set_dtstart(event->vevent, st);
-	icalcomponent_set_dtend(event->vevent, et);
-}
+	// "a picks the register for the next command, much like a count
+	if (cal->flags & CAL_REGISTER) {
+		cal->flags &= ~CAL_REGISTER;
+		if (event->keyval >= 'a' && event->keyval <= 'z' && !event->ctrl)
+			cal->reg = event->keyval - 'a' + 1;
+		return 1;
+	}
 
+	if (node == 0 && event->keyval == '"' && !event->ctrl) {
+		cal->flags |= CAL_REGISTER;
+		return 1;
+	}
 
+	if (node == 0 && event->keyval >= '0' && event->keyval <= '9' &&
+	    !event->ctrl && (cal->count || event->keyval != '0')) {
+		cal->count = min(cal->count * 10 + (int)(event->keyval - '0'),
+				 COUNT_MAX);
+		log_debug("count %d", cal->count);
+		return 1;
+	}
 
-static void move_event_action(struct cal *cal, int direction)
-{
-	struct event *event =
-		get_selected_event(cal);
+	if (!g_nkey_nodes || !(next = key_child(node, key))) {
+		cal->key_node = 0;
 
-	if (!event)
-		return;
+		if (node == 0) {
+			cal->count = 0;
+			cal->reg = 0;
+			return 1;
+		}
 
-	move_event(event, direction * cal->repeat * SMALLEST_TIMEBLOCK);
+		// a bound prefix of a longer sequence that didn't come. run it
+		// and start over with this key, otherwise the sequence is junk
+		if (g_key_nodes[node].cmd) {
+			key_run(cal, &g_key_nodes[node]);
+		} else {
+			cal->count = 0;
+			cal->reg = 0;
+		}
+
+		return calendar_keypress(cal, event);
+	}
+
+	// wait and see if this is the start of something longer
+	if (g_key_nodes[next].nchildren > 0) {
+		cal->key_node = next;
+		return 1;
+	}
+
+	cal->key_node = 0;
+
+	if (g_key_nodes[next].cmd) {
+		key_run(cal, &g_key_nodes[next]);
+	} else {
+		cal->count = 0;
+		cal->reg = 0;
+	}
+
+	return 1;
 }
 
-static void save_calendars(struct cal *cal)
+#ifdef VISCAL_LUA
+// scripting. $XDG_CONFIG_HOME/viscal/init.lua is run at startup with a
+// `viscal` table for working on many events at once:
+//
+//   viscal.now()                        current unix time
+//   viscal.calendars()                  { {path=, visible=, nevents=}, ... }
+//   viscal.events(start, finish[, n])   events overlapping start..finish
+//   viscal.move(ev, start)              keeps the event's length
+//   viscal.resize(ev, start, finish)
+//   viscal.create{start=, finish=[, summary=][, calendar=]}
+//   viscal.delete(ev)
+//   viscal.save()                       write out changed calendars
+//   viscal.batch(fn)                    run fn as one transaction
+//   viscal.map(keys, fn)                bind keys to fn(count)
+//
+// events are tables with summary, uid, start, finish and calendar fields.
+// everything done inside batch() is undone if fn raises an error, and the
+// changed calendars are only re-sorted and saved once, when the outermost
+// batch returns. changes made outside of batch() are a batch of one
+static lua_State *g_script;
+
+enum tx_op {
+	TX_SPAN,
+	TX_CREATE,
+	TX_DELETE,
+};
+
+static const icalproperty_kind tx_span_props[] = {
+	ICAL_DTSTART_PROPERTY,
+	ICAL_DTEND_PROPERTY,
+	ICAL_DURATION_PROPERTY,
+};
+
+struct tx_entry {
+	enum tx_op op;
+	struct ical *ical;
+	icalcomponent *vevent;
+	// TX_SPAN: copies of the span properties before the change
+	icalproperty *props[ARRAY_SIZE(tx_span_props)];
+};
+
+static struct {
+	int depth;
+	bool save;
+	struct tx_entry *log;
+	int nlog, log_size;
+	// changed in this transaction, their sorted events are stale
+	bool touched[ARRAY_SIZE(((struct cal *)0)->calendars)];
+	bool unsaved[ARRAY_SIZE(((struct cal *)0)->calendars)];
+} g_tx;
+
+static struct tx_entry *tx_record(struct cal *cal, enum tx_op op,
+				  struct ical *ical, icalcomponent *vevent)
 {
-	printf("DEBUG saving calendars\n");
-	for (int i = 0; i < cal->ncalendars; ++i)
-		save_calendar(&cal->calendars[i]);
+	struct tx_entry *entry;
+	icalproperty *prop;
+
+	g_tx.log = grow_array(g_tx.log, &g_tx.log_size, g_tx.nlog + 1,
+			      sizeof(*g_tx.log));
+	entry = &g_tx.log[g_tx.nlog++];
+	memset(entry, 0, sizeof(*entry));
+	entry->op = op;
+	entry->ical = ical;
+	entry->vevent = vevent;
+
+	for (size_t i = 0; op == TX_SPAN && i < ARRAY_SIZE(tx_span_props); i++) {
+		prop = icalcomponent_get_first_property(vevent, tx_span_props[i]);
+		entry->props[i] = prop ? icalproperty_new_clone(prop) : NULL;
+	}
+
+	g_tx.touched[ical - cal->calendars] = true;
+	return entry;
 }
 
-static int closest_to_current(struct cal *cal, int ind_hint)
+static void tx_entry_free(struct tx_entry *entry)
 {
-	int timeblock = timeblock_size(cal);
-	return query_span(cal, ind_hint-1 < 0 ? 0 : ind_hint-1, cal->current,
-			  cal->current + timeblock * 60, 0, 0);
+	for (size_t i = 0; i < ARRAY_SIZE(entry->props); i++) {
+		if (entry->props[i])
+			icalproperty_free(entry->props[i]);
+	}
 }
 
-static void delete_event(struct cal *cal, struct event *event)
+// removed events are never freed, a script can still be holding them
+static void tx_undo(struct tx_entry *entry)
 {
-	int i, ind = -1;
-	time_t st;
-	vevent_span_timet(event->vevent, &st, NULL);
-	icalcomponent_remove_component(event->ical->calendar, event->vevent);
+	icalproperty *prop;
+
+	switch (entry->op) {
+	case TX_SPAN:
+		for (size_t i = 0; i < ARRAY_SIZE(tx_span_props); i++) {
+			while ((prop = icalcomponent_get_first_property(
+					entry->vevent, tx_span_props[i]))) {
+				icalcomponent_remove_property(entry->vevent, prop);
+				icalproperty_free(prop);
+			}
 
-	for (i = cal->nevents - 1; i >= 0; i--) {
-		if (&cal->events[i] == event) {
-			ind = i;
-			break;
+			if (entry->props[i])
+				icalcomponent_add_property(entry->vevent,
+							   entry->props[i]);
+			entry->props[i] = NULL;
 		}
+		break;
+	case TX_CREATE:
+		icalcomponent_remove_component(entry->ical->calendar,
+					       entry->vevent);
+		break;
+	case TX_DELETE:
+		icalcomponent_add_component(entry->ical->calendar,
+					    entry->vevent);
+		break;
 	}
+}
 
-	assert(ind != -1);
-
-	memmove(&cal->events[ind],
-		&cal->events[ind + 1],
-		(cal->nevents - ind - 1) * sizeof(*cal->events));
+static void tx_rollback(int mark)
+{
+	log_warn("script: rolling back %d changes", g_tx.nlog - mark);
 
-	// adjust indices
-	cal->nevents--;
-	cal->selected_event_ind = closest_to_current(cal, 0);
-	cal->target--;
+	while (g_tx.nlog > mark) {
+		struct tx_entry *entry = &g_tx.log[--g_tx.nlog];
+		tx_undo(entry);
+		tx_entry_free(entry);
+	}
 }
 
-// delete the event, and then pull everything below upwards (within that day)
-static void delete_timeblock(struct cal *cal)
+// one re-sort, and maybe one save, for everything the transaction touched
+static void tx_commit(struct cal *cal)
 {
-	int first;
+	gint64 trace = trace_begin();
 	int i;
-	int timeblock = timeblock_size(cal);
-
-	struct event *event =
-		get_selected_event(cal);
 
-	if (event)
-		delete_event(cal, event);
+	for (i = 0; i < g_tx.nlog; i++)
+		tx_entry_free(&g_tx.log[i]);
 
-	// get all events in current day past dtend of current selection
-	time_t starting_at =
-		get_selection_end(cal);
+	if (g_tx.nlog > 0)
+		log_debug("script: committing %d changes", g_tx.nlog);
 
-	first =
-		first_event_starting_at(cal, starting_at);
+	for (i = 0; i < cal->ncalendars; i++) {
+		if (g_tx.touched[i]) {
+			calendar_changed(cal, &cal->calendars[i]);
+			g_tx.unsaved[i] = true;
+		}
 
-	// nothing to push down today
-	if (first == -1)
-		return;
+		if (g_tx.save && g_tx.unsaved[i]) {
+			save_calendar(&cal->calendars[i]);
+			g_tx.unsaved[i] = false;
+		}
 
-	for (i = first;
-	     i < cal->nevents && event_is_today(cal->today, &cal->events[i]);
-	     i++) {
-		struct event *event = &cal->events[i];
-		move_event(event, -timeblock);
+		g_tx.touched[i] = false;
 	}
 
-	cal->selected_event_ind = closest_to_current(cal, first);
+	g_tx.nlog = 0;
+	g_tx.save = false;
+
+	// the view still points at deleted events, don't wait for a redraw
+	on_change_view(cal);
+
+	trace_end(TRACE_SCRIPT_COMMIT, trace);
 }
 
+static void tx_done(struct cal *cal)
+{
+	if (g_tx.depth == 0)
+		tx_commit(cal);
+}
 
-static void delete_event_action(struct cal *cal)
+static struct cal *script_cal(lua_State *L)
 {
-	struct event *event =
-		get_selected_event(cal);
+	return lua_touserdata(L, lua_upvalueindex(1));
+}
 
-	if (event == NULL)
-		return;
+// like span_overlaps, but zero length events count too
+static bool script_in_range(time_t st, time_t et, time_t start, time_t finish)
+{
+	return st < finish && (et > start || st >= start);
+}
 
-	delete_event(cal, event);
+static void script_set_span(lua_State *L, int ind, time_t st, time_t et)
+{
+	lua_pushinteger(L, st);
+	lua_setfield(L, ind, "start");
+	lua_pushinteger(L, et);
+	lua_setfield(L, ind, "finish");
 }
 
-static void cancel_editing(struct cal *cal)
+static void script_push_event(lua_State *L, struct cal *cal, struct ical *ical,
+			      icalcomponent *vevent)
 {
-	// delete the event if we cancel during insert
-	if (cal->flags & CAL_INSERTING) {
-		struct event *event =
-			get_selected_event(cal);
+	const char *str;
+	time_t st, et;
 
-		// we should have a selected event if we're cancelling
-		assert(event);
+	vevent_span_timet(ical, vevent, &st, &et);
 
-		delete_event(cal, event);
-	}
+	lua_createtable(L, 0, 6);
+	script_set_span(L, lua_gettop(L), st, et);
+	lua_pushlightuserdata(L, vevent);
+	lua_setfield(L, -2, "vevent");
+	lua_pushinteger(L, ical - cal->calendars + 1);
+	lua_setfield(L, -2, "calendar");
 
-	cal->flags &= ~(CAL_CHANGING | CAL_INSERTING);
+	str = icalcomponent_get_summary(vevent);
+	lua_pushstring(L, str ? str : "");
+	lua_setfield(L, -2, "summary");
+
+	if ((str = icalcomponent_get_uid(vevent))) {
+		lua_pushstring(L, str);
+		lua_setfield(L, -2, "uid");
+	}
 }
 
-static void pop_word_edit_buffer()
+// an event table back to its vevent, if it's still in its calendar
+static icalcomponent *script_check_event(lua_State *L, int arg,
+					 struct ical **ical)
 {
-	int c = clamp(g_editbuf_pos - 2, 0, EDITBUF_MAX-1);
-	char *p = &g_editbuf[c];
-
-	while (p >= g_editbuf && *(p--) != ' ')
-		;
+	struct cal *cal = script_cal(L);
+	icalcomponent *vevent;
+	lua_Integer ind;
 
-	if (*(p + 1) == ' ') {
-		p += 2;
-		*p = '\0';
-	}
-	else
-		*(++p) = '\0';
+	luaL_checktype(L, arg, LUA_TTABLE);
+	lua_getfield(L, arg, "calendar");
+	ind = lua_tointeger(L, -1) - 1;
+	lua_getfield(L, arg, "vevent");
+	vevent = lua_touserdata(L, -1);
+	lua_pop(L, 2);
 
-	g_editbuf_pos = p - g_editbuf;
+	if (ind < 0 || ind >= cal->ncalendars || vevent == NULL ||
+	    icalcomponent_get_parent(vevent) != cal->calendars[ind].calendar)
+		luaL_argerror(L, arg, "not an event, or it was deleted");
 
-	return;
+	*ical = &cal->calendars[ind];
+	return vevent;
 }
 
-
-static int on_edit_keypress(struct cal *cal, GdkEventKey *event)
+static int script_now(lua_State *L)
 {
-	char key = *event->string;
-
-	switch (event->keyval) {
-	case GDK_KEY_Escape:
-		cancel_editing(cal);
-		return 1;
+	lua_pushinteger(L, time(NULL));
+	return 1;
+}
 
-	case GDK_KEY_Return:
-		finish_editing(cal);
-		return 1;
+static int script_calendars(lua_State *L)
+{
+	struct cal *cal = script_cal(L);
+	struct ical *ical;
 
-	case GDK_KEY_BackSpace:
-		pop_edit_buffer(1);
-		return 1;
-	}
+	lua_createtable(L, cal->ncalendars, 0);
 
-	switch (key) {
-	// Ctrl-w
-	case 0x17:
-		pop_word_edit_buffer();
-		break;
+	for (int i = 0; i < cal->ncalendars; i++) {
+		ical = &cal->calendars[i];
+		lua_createtable(L, 0, 3);
+		lua_pushstring(L, ical->source_location);
+		lua_setfield(L, -2, "path");
+		lua_pushboolean(L, ical->visible);
+		lua_setfield(L, -2, "visible");
+		lua_pushinteger(L, ical->nevents);
+		lua_setfield(L, -2, "nevents");
+		lua_rawseti(L, -2, i + 1);
 	}
 
-	// TODO: more special edit keys
-
-	if (*event->string >= 0x20)
-		append_str_edit_buffer(event->string);
-
 	return 1;
 }
 
-static void debug_edit_buffer(GdkEventKey *event)
+static int script_events(lua_State *L)
 {
-	int len = strlen(event->string);
-	printf("DEBUG edit buffer: %s[%x][%ld] %d %d '%s'\n",
-	       event->string,
-	       len > 0 ? *event->string : '\0',
-	       strlen(event->string),
-	       event->state,
-	       g_editbuf_pos,
-	       g_editbuf);
-}
+	struct cal *cal = script_cal(L);
+	time_t start = luaL_checkinteger(L, 1);
+	time_t finish = luaL_checkinteger(L, 2);
+	lua_Integer only = luaL_optinteger(L, 3, 0);
+	icalcomponent *vevent;
+	struct ical *ical;
+	time_t st, et;
+	int i, j, n = 0;
 
-static chord_cmd *get_chord_cmd(char current_chord, char key) {
-	struct chord *chord;
+	lua_newtable(L);
 
-	for (size_t i = 0; i < ARRAY_SIZE(chords); ++i) {
-		chord = &chords[i];
-		if (chord->keys[0] == current_chord && chord->keys[1] == key) {
-			return chord->cmd;
+	for (i = 0; i < cal->ncalendars; i++) {
+		if (only && i != only - 1)
+			continue;
+
+		ical = &cal->calendars[i];
+
+		// changed earlier in this batch, the sorted events are stale
+		if (g_tx.touched[i]) {
+			for (vevent = icalcomponent_get_first_component(
+				     ical->calendar, ICAL_VEVENT_COMPONENT);
+			     vevent != NULL;
+			     vevent = icalcomponent_get_next_component(
+				     ical->calendar, ICAL_VEVENT_COMPONENT)) {
+				vevent_span_timet(ical, vevent, &st, &et);
+				if (!script_in_range(st, et, start, finish))
+					continue;
+				script_push_event(L, cal, ical, vevent);
+				lua_rawseti(L, -2, ++n);
+			}
+			continue;
+		}
+
+		if (ical->dirty)
+			calendar_sort_events(ical);
+
+		for (j = 0; j < ical->nevents && ical->events[j].start < finish;
+		     j++) {
+			vevent = ical->events[j].vevent;
+			vevent_span_timet(ical, vevent, &st, &et);
+			if (!script_in_range(st, et, start, finish))
+				continue;
+			script_push_event(L, cal, ical, vevent);
+			lua_rawseti(L, -2, ++n);
 		}
 	}
 
-	return NULL;
+	return 1;
 }
 
-static void set_chord(struct cal *cal, char c)
+static int script_resize(lua_State *L)
 {
-	assert(cal->chord == 0);
-	cal->chord = c;
+	struct cal *cal = script_cal(L);
+	struct ical *ical;
+	icalcomponent *vevent = script_check_event(L, 1, &ical);
+	time_t st = luaL_checkinteger(L, 2);
+	time_t et = luaL_checkinteger(L, 3);
+
+	if (et < st)
+		return luaL_argerror(L, 3, "event would end before it starts");
+
+	tx_record(cal, TX_SPAN, ical, vevent);
+	vevent_set_span(ical, vevent, st, et);
+	script_set_span(L, 1, st, et);
+
+	tx_done(cal);
+	return 0;
 }
 
-static void move_event_to_calendar(struct cal *cal, struct event *event,
-				   struct ical *from, struct ical *to)
+static int script_move(lua_State *L)
 {
-	icalcomponent_remove_component(from->calendar, event->vevent);
-	icalcomponent_add_component(to->calendar, event->vevent);
-	event->ical = to;
+	struct ical *ical;
+	icalcomponent *vevent = script_check_event(L, 1, &ical);
+	time_t to = luaL_checkinteger(L, 2);
+	time_t st, et;
+
+	vevent_span_timet(ical, vevent, &st, &et);
+
+	lua_settop(L, 2);
+	lua_pushinteger(L, to + (et - st));
+	return script_resize(L);
 }
 
-static void next_calendar(struct cal *cal)
+static int script_create(lua_State *L)
 {
-	struct event *event;
-	struct ical *from;
-	struct ical *to;
-
-	from = &cal->calendars[cal->selected_calendar_ind];
-	cal->selected_calendar_ind =
-		(cal->selected_calendar_ind + 1) % cal->ncalendars;
+	struct cal *cal = script_cal(L);
+	struct ical *ical = current_calendar(cal);
+	icalcomponent *vevent;
+	const char *summary;
+	lua_Integer ind;
+	time_t st, et;
 
-	while((to = &cal->calendars[cal->selected_calendar_ind]) != from && !to->visible) {
-		cal->selected_calendar_ind =
-			(cal->selected_calendar_ind + 1) % cal->ncalendars;
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	lua_getfield(L, 1, "start");
+	lua_getfield(L, 1, "finish");
+	lua_getfield(L, 1, "summary");
+	lua_getfield(L, 1, "calendar");
+	st = luaL_checkinteger(L, 2);
+	et = luaL_checkinteger(L, 3);
+	summary = luaL_optstring(L, 4, "");
+
+	if (!lua_isnoneornil(L, 5)) {
+		ind = luaL_checkinteger(L, 5) - 1;
+		if (ind < 0 || ind >= cal->ncalendars)
+			return luaL_argerror(L, 1, "no such calendar");
+		ical = &cal->calendars[ind];
 	}
 
-	// only one selectable calendar
-	if (from == to)
-		return;
+	if (ical == NULL)
+		return luaL_error(L, "no calendars to create events in");
 
-	printf("using calendar %s\n", to->source_location);
+	if (et < st)
+		return luaL_argerror(L, 1, "event would end before it starts");
 
-	// move event to next calendar if we're editing it
-	if (cal->flags & CAL_CHANGING) {
-		event = get_selected_event(cal);
-		if (!event)
-			assert(!"no selected event when CAL_CHANGING");
+	vevent = vevent_new(st, et, summary);
+	icalcomponent_add_component(ical->calendar, vevent);
+	tx_record(cal, TX_CREATE, ical, vevent);
 
-		move_event_to_calendar(cal, event, from, to);
-	}
+	script_push_event(L, cal, ical, vevent);
+	tx_done(cal);
+	return 1;
 }
 
-static void toggle_calendar_visibility(struct cal *cal, int ind)
+static int script_delete(lua_State *L)
 {
-	if (ind+1 > cal->ncalendars)
-		return;
-	cal->calendars[ind].visible =
-		!cal->calendars[ind].visible;
+	struct cal *cal = script_cal(L);
+	struct ical *ical;
+	icalcomponent *vevent = script_check_event(L, 1, &ical);
+
+	icalcomponent_remove_component(ical->calendar, vevent);
+	tx_record(cal, TX_DELETE, ical, vevent);
+
+	tx_done(cal);
+	return 0;
+}
+
+static int script_save(lua_State *L)
+{
+	g_tx.save = true;
+	tx_done(script_cal(L));
+	return 0;
 }
 
-static gboolean on_keypress (GtkWidget *widget, GdkEvent *event,
-			     gpointer user_data)
+static int script_batch(lua_State *L)
 {
-	struct extra_data *data = (struct extra_data*)user_data;
-	struct cal *cal = data->cal;
-	char key;
-	int hardware_key;
-	int state_changed = 1;
-	int ctrl = 0;
-	static const int scroll_amt = 60*60;
-
-	switch (event->type) {
-	case GDK_KEY_PRESS:
-		key = *event->key.string;
-		hardware_key = event->key.hardware_keycode;
-
-		ctrl = event->key.state & GDK_CONTROL_MASK;
-		printf("DEBUG keystring 0x%x %d hw:%d ctrl?:%d\n",
-		       key, event->key.state, event->key.hardware_keycode,
-		       ctrl);
-
-		// Ctrl-tab during editing still switch cal
-		if (key != '\t' && (cal->flags & CAL_CHANGING)) {
-			state_changed = on_edit_keypress(cal, &event->key);
-			debug_edit_buffer(&event->key);
-			goto check_state;
-		}
-
-		// handle chords
-		if (cal->chord) {
-			chord_cmd *cmd =
-				get_chord_cmd(cal->chord, key);
+	struct cal *cal = script_cal(L);
+	int mark = g_tx.nlog, err;
 
-			// no chord cmd found, reset chord
-			if (cmd == NULL)
-				cal->chord = 0;
-			else {
-				// execute chord
-				(*cmd)(cal);
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	lua_settop(L, 1);
 
-				// reset chord
-				cal->chord = 0;
+	g_tx.depth++;
+	err = lua_pcall(L, 0, LUA_MULTRET, 0);
+	g_tx.depth--;
 
-				// we've executed a command, so reset repeat
-				cal->repeat = 1;
+	if (err != LUA_OK) {
+		tx_rollback(mark);
+		return lua_error(L);
+	}
 
-				state_changed = 1;
-				goto check_state;
-			}
-		}
+	tx_done(cal);
+	return lua_gettop(L);
+}
 
-		int nkey = key - '0';
+static bool script_call(lua_State *L, int nargs)
+{
+	if (lua_pcall(L, nargs, 0, 0) == LUA_OK)
+		return true;
 
-		if (nkey >= 2 && nkey <= 9) {
-			printf("DEBUG repeat %d\n", nkey);
-			cal->repeat = nkey;
-			break;
-		}
+	log_warn("script: %s", lua_tostring(L, -1));
+	lua_pop(L, 1);
+	return false;
+}
 
-		switch (hardware_key) {
-			// f1, f2, ...
-		case 67: case 68: case 69:
-		case 70: case 71: case 72:
-			printf("f%d\n", hardware_key-66);
-			int ind = hardware_key-67;
-			assert(ind >= 0);
-			toggle_calendar_visibility(cal, ind);
-			break;
-		}
+// what viscal.map binds, the function is at g_key_arg in the registry
+static void script_key(struct cal *cal)
+{
+	lua_rawgeti(g_script, LUA_REGISTRYINDEX, g_key_arg);
+	lua_pushinteger(g_script, cal->repeat);
+	script_call(g_script, 1);
+}
 
-		switch (key) {
+// drops the function a viscal.map binding pinned in the registry
+static void script_key_unbind(struct key_node *node)
+{
+	if (node->cmd == script_key)
+		luaL_unref(g_script, LUA_REGISTRYINDEX, node->arg);
+}
 
-		case 'd':
-			if (ctrl)
-				cal->scroll += scroll_amt;
-			break;
+static int script_map(lua_State *L)
+{
+	guint keys[KEY_SEQ_MAX];
+	int n;
 
-		// Ctrl-u
-		case 'u':
-			if (ctrl)
-				cal->scroll -= scroll_amt;
-			break;
+	n = parse_keys(luaL_checkstring(L, 1), keys, KEY_SEQ_MAX);
+	if (n <= 0)
+		return luaL_argerror(L, 1, "bad key sequence");
 
-		// Ctrl--
-		case '-':
-			if (ctrl)
-				cal->font_size -= 2;
-			break;
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
+	key_bind(keys, n, script_key, luaL_ref(L, LUA_REGISTRYINDEX));
+	return 0;
+}
 
-		// Ctrl-=
-		case '=':
-			if (ctrl)
-				cal->font_size += 2;
-			break;
+static const luaL_Reg script_funcs[] = {
+	{ "now",       script_now },
+	{ "calendars", script_calendars },
+	{ "events",    script_events },
+	{ "move",      script_move },
+	{ "resize",    script_resize },
+	{ "create",    script_create },
+	{ "delete",    script_delete },
+	{ "save",      script_save },
+	{ "batch",     script_batch },
+	{ "map",       script_map },
+	{ NULL, NULL },
+};
 
-		// tab
-		case '\t':
-			next_calendar(cal);
-			break;
+static void script_init(struct cal *cal)
+{
+	lua_State *L;
+	char *path;
 
-		case 'C':
-		case 'c':
-		case 's':
-		case 'S':
-			if (key == 's' && ctrl)
-				save_calendars(cal);
-			else
-				edit_mode(cal, EDIT_CLEAR);
-			break;
+	path = g_build_filename(g_get_user_config_dir(), "viscal", "init.lua",
+				NULL);
 
-		case 'A':
-			if (cal->selected_event_ind != -1)
-				edit_mode(cal, 0);
-			break;
+	if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+		g_free(path);
+		return;
+	}
 
-		case 'x':
-			delete_event_action(cal);
-			break;
+	g_script = L = luaL_newstate();
+	luaL_openlibs(L);
 
-		case 't':
-			move_now(cal);
-			break;
+	lua_newtable(L);
+	lua_pushlightuserdata(L, cal);
+	luaL_setfuncs(L, script_funcs, 1);
+	lua_setglobal(L, "viscal");
 
-		case 'T':
-			move_event_now(cal);
-			break;
+	log_info("running %s", path);
 
-		case 'K':
-			move_event_action(cal, -1);
-			break;
+	if (luaL_loadfile(L, path) != LUA_OK) {
+		log_warn("script: %s", lua_tostring(L, -1));
+		lua_pop(L, 1);
+	} else {
+		script_call(L, 0);
+	}
 
-		case 'J':
-			move_event_action(cal, 1);
-			break;
+	g_free(path);
+}
+#endif // VISCAL_LUA
 
-		case 'j':
-			if (ctrl)
-				pushmove_down(cal);
-			else
-				move_down(cal, cal->repeat);
-			break;
 
-		case 'k':
-			if (ctrl)
-				pushmove_up(cal);
-			else
-				move_up(cal, cal->repeat);
-			break;
+static gboolean on_keypress (GtkWidget *widget, GdkEvent *event,
+			     gpointer user_data)
+{
+	struct extra_data *data = (struct extra_data*)user_data;
+	struct key_press key;
 
-		case 'l':
-			lock_selection(cal);
-			break;
+	if (event->type != GDK_KEY_PRESS)
+		return 1;
 
-		case 'v':
-			if (ctrl)
-				push_expand_selection(cal);
-			else
-				expand_selection(cal);
-			break;
+	// shift and friends on their own would break up counts, registers
+	// and sequences
+	if (event->key.is_modifier)
+		return 1;
 
-		case 'V':
-			shrink_selection(cal);
-			break;
+	key.string = event->key.string;
+	key.keyval = event->key.keyval;
+	key.ctrl = (event->key.state & GDK_CONTROL_MASK) != 0;
 
-		case 'i':
-			insert_event_action(cal);
-			break;
+	if (calendar_keypress(data->cal, &key))
+		on_state_change(widget, event, user_data);
 
-		case 'o':
-			open_below(cal);
-			break;
+	return 1;
+}
 
-		default:
-			set_chord(cal, key);
-		}
+static void calendar_button_press(struct cal *cal, double mx, double my)
+{
+	struct event *target;
+
+	cal->flags |= CAL_MDOWN;
+	cal->target = events_hit(cal->events, cal->nevents, mx, my);
+	target = get_target(cal);
+	if (target) {
+		target->dragy_off = target->y - my;
+		target->dragx_off = target->x - mx;
+	}
+}
 
-		//if (key != 0) {
-		//	printf("DEBUG resetting repeat\n");
-		//	cal->repeat = 1;
-		//}
+static void calendar_button_release(struct cal *cal, double mx, double my)
+{
+	struct event *target = get_target(cal);
 
-		break;
-	default:
-		state_changed = 0;
-		break;
+	if ((cal->flags & CAL_DRAGGING) != 0) {
+		// finished drag
+		// TODO: handle drop into and out of gutter
+		calendar_drop(cal, mx, my);
+	}
+	else {
+		// clicked target
+		if (target)
+			event_click(cal, target, mx, my);
+		else if (my < cal->y) {
+			// TODO: gutter clicked, create date event + increase gutter size
+		}
+		else {
+			calendar_view_clicked(cal, mx, my - cal->y);
+		}
 	}
 
-check_state:
-	if (state_changed)
-		on_state_change(widget, event, user_data);
+	// finished dragging
+	cal->flags &= ~(CAL_MDOWN | CAL_DRAGGING);
 
-	return 1;
+	// clear target drag state
+	if (target) {
+		target->dragx = 0.0;
+		target->dragy = 0.0;
+		vevent_span_timet(target->ical, target->vevent,
+				  &target->drag_time, NULL);
+	}
 }
 
 static int
 on_press(GtkWidget *widget, GdkEventButton *ev, gpointer user_data) {
 	struct extra_data *data = (struct extra_data*)user_data;
 	struct cal *cal = data->cal;
-	struct event *target = NULL;
-	double mx = ev->x;
-	double my = ev->y;
-	int state_changed = 1;
 
 	switch (ev->type) {
 	case GDK_BUTTON_PRESS:
-		cal->flags |= CAL_MDOWN;
-		cal->target = events_hit(cal->events, cal->nevents, mx, my);
-		target = get_target(cal);
-		if (target) {
-			target->dragy_off = target->y - my;
-			target->dragx_off = target->x - mx;
-		}
+		calendar_button_press(cal, ev->x, ev->y);
 		break;
 	case GDK_BUTTON_RELEASE:
-		target = get_target(cal);
-
-		if ((cal->flags & CAL_DRAGGING) != 0) {
-			// finished drag
-			// TODO: handle drop into and out of gutter
-			calendar_drop(cal, mx, my);
-		}
-		else {
-			// clicked target
-			if (target)
-				event_click(cal, target, mx, my);
-			else if (my < cal->y) {
-				// TODO: gutter clicked, create date event + increase gutter size
-			}
-			else {
-				calendar_view_clicked(cal, mx, my - cal->y);
-			}
-		}
-
-		// finished dragging
-		cal->flags &= ~(CAL_MDOWN | CAL_DRAGGING);
-
-		// clear target drag state
-		if (target) {
-			target->dragx = 0.0;
-			target->dragy = 0.0;
-			target->drag_time =
-				icaltime_as_timet(icalcomponent_get_dtstart(target->vevent));
-			target = NULL;
-		}
+		calendar_button_release(cal, ev->x, ev->y);
 		break;
-
 	default:
-		state_changed = 0;
-		break;
+		return 1;
 	}
 
-	if (state_changed)
-		on_state_change(widget, (GdkEvent*)ev, user_data);
+	on_state_change(widget, (GdkEvent*)ev, user_data);
 
 	return 1;
 }
@@ -1995,11 +6864,44 @@ on_scroll(GtkWidget *widget, GdkEventScroll *ev, gpointer user_data) {
 	// https://developer.gnome.org/gtk3/stable/GtkGestureZoom.html
 	struct extra_data *data = (struct extra_data*)user_data;
 	struct cal *cal = data->cal;
+	struct view_anim *anim = &cal->anim;
+	double delta, seconds, dt;
 
 	on_state_change(widget, (GdkEvent*)ev, user_data);
-	zoom(cal, ev->delta_y);
 
-	return 0;
+	switch (ev->direction) {
+	case GDK_SCROLL_UP: delta = -1; break;
+	case GDK_SCROLL_DOWN: delta = 1; break;
+	case GDK_SCROLL_SMOOTH: delta = ev->delta_y; break;
+	default: return 0;
+	}
+
+	// Ctrl-wheel zooms
+	if (ev->state & GDK_CONTROL_MASK) {
+		zoom(cal, delta);
+		return 1;
+	}
+
+	// touchpads tell us when the fingers lift, keep going from there
+	if (gdk_event_is_scroll_stop_event((GdkEvent*)ev)) {
+		if (anim->tick && fabs(anim->velocity) > FLING_MIN)
+			anim->fling = anim->velocity;
+		anim->velocity = 0;
+		return 1;
+	}
+
+	// a wheel notch is a twelfth of the view
+	seconds = delta * DAY_SECONDS / cal->zoom / 12.0;
+	view_scroll_by(cal, seconds);
+
+	dt = (ev->time - anim->last_scroll_time) / 1000.0;
+	anim->last_scroll_time = ev->time;
+	if (dt > 0 && dt < 0.1)
+		anim->velocity = anim->velocity * 0.5 + (seconds / dt) * 0.5;
+	else
+		anim->velocity = 0;
+
+	return 1;
 }
 
 static void
@@ -2021,27 +6923,22 @@ events_update_flags (struct event *events, int nevents, double mx, double my) {
 
 
 
-static int
-on_motion(GtkWidget *widget, GdkEventMotion *ev, gpointer user_data) {
+// returns the event under the pointer, *changed is set when the move
+// needs a redraw
+static struct event *
+calendar_motion(struct cal *cal, double mx, double my, int *changed) {
 	static struct event* prev_hit = NULL;
 
 	struct event *hit = NULL;
 	struct event *target = NULL;
 
-	int state_changed = 0;
 	int dragging_event = 0;
-	double mx = ev->x;
-	double my = ev->y;
-
-	struct extra_data *data = (struct extra_data*)user_data;
-	struct cal *cal = data->cal;
-	GdkWindow *gdkwin = gtk_widget_get_window(widget);
 
 	cal->mx = mx - cal->x;
 	cal->my = my - cal->y;
 
-	double px = ev->x;
-	double py = ev->y;
+	double px = mx;
+	double py = my;
 
 	// drag detection
 	if ((cal->flags & CAL_MDOWN) != 0)
@@ -2062,13 +6959,24 @@ on_motion(GtkWidget *widget, GdkEventMotion *ev, gpointer user_data) {
 	events_update_flags (cal->events, cal->nevents, mx, my);
 	hit = event_any_flags(cal->events, cal->nevents, EV_HIGHLIGHTED);
 
-	gdk_window_set_cursor(gdkwin, hit ? cursor_pointer : cursor_default);
-
-	state_changed = dragging_event || hit != prev_hit;
+	*changed = dragging_event || hit != prev_hit;
 
-	fflush(stdout);
 	prev_hit = hit;
 
+	return hit;
+}
+
+static int
+on_motion(GtkWidget *widget, GdkEventMotion *ev, gpointer user_data) {
+	struct extra_data *data = (struct extra_data*)user_data;
+	GdkWindow *gdkwin = gtk_widget_get_window(widget);
+	struct event *hit;
+	int state_changed;
+
+	hit = calendar_motion(data->cal, ev->x, ev->y, &state_changed);
+
+	gdk_window_set_cursor(gdkwin, hit ? cursor_pointer : cursor_default);
+
 	if (state_changed)
 		on_state_change(widget, (GdkEvent*)ev, user_data);
 
@@ -2130,7 +7038,7 @@ event_update (struct event *ev, struct cal *cal)
 	else {
 		// convert to local time
 		time_t st, et;
-		vevent_span_timet(ev->vevent, &st, &et);
+		vevent_span_timet(ev->ical, ev->vevent, &st, &et);
 
 		double sloc = calendar_time_to_loc(cal, st);
 		double eloc = calendar_time_to_loc(cal, et);
@@ -2149,6 +7057,7 @@ event_update (struct event *ev, struct cal *cal)
 static void
 update_calendar (struct cal *cal) {
 	int i, width, height;
+	gint64 trace = trace_begin();
 	width = cal->width;
 	height = cal->height;
 
@@ -2160,14 +7069,125 @@ update_calendar (struct cal *cal) {
 		cal->refresh_events = 0;
 	}
 
+	// DST transitions for what's on screen
+	tz_cache_prepare(&g_local_tz, calendar_view_start(cal),
+			 calendar_view_end(cal));
+
+	for (i = 0; i < cal->ncalendars; i++) {
+		if (cal->calendars[i].visible)
+			calendar_zones_prepare(&cal->calendars[i],
+					       calendar_view_start(cal),
+					       calendar_view_end(cal));
+	}
+
 	for (i = 0; i < cal->nevents; ++i) {
 		struct event *ev = &cal->events[i];
 		event_update(ev, cal);
 	}
+
+	trace_end(TRACE_UPDATE_CALENDAR, trace);
+}
+
+
+
+
+// text
+//
+// text goes through pango, so summaries in any script are shaped properly
+// and fall back to a font that has their glyphs. shaping isn't cheap, so
+// layouts are cached by (text, width, font size) in a direct mapped table
+// like the timezone offsets, and only rebuilt when one of those changes
+#define TEXT_CACHE 1024
+
+static const char *FONT_FAMILY = "terminus,monospace";
+
+struct text_entry {
+	guint hash;
+	int width, font_size;
+	char *text;
+	PangoLayout *layout;
+};
+
+static struct text_entry g_text_cache[TEXT_CACHE];
+static PangoContext *g_text_context;
+static PangoFontDescription *g_font;
+static int g_font_size;
+
+static void text_set_font(int size)
+{
+	if (g_font && g_font_size == size)
+		return;
+
+	if (!g_text_context)
+		g_text_context = pango_font_map_create_context(
+			pango_cairo_font_map_get_default());
+
+	if (g_font)
+		pango_font_description_free(g_font);
+
+	g_font = pango_font_description_from_string(FONT_FAMILY);
+	pango_font_description_set_absolute_size(g_font, size * PANGO_SCALE);
+	g_font_size = size;
+}
+
+// text wider than width pixels is ellipsized, -1 for no limit
+static PangoLayout *text_layout(const char *text, int width)
+{
+	guint hash = (g_str_hash(text) * 31 + width) * 31 + g_font_size;
+	struct text_entry *entry = &g_text_cache[hash % TEXT_CACHE];
+
+	if (entry->layout && entry->hash == hash && entry->width == width &&
+	    entry->font_size == g_font_size && !strcmp(entry->text, text))
+		return entry->layout;
+
+	if (entry->layout) {
+		g_object_unref(entry->layout);
+		g_free(entry->text);
+	}
+
+	entry->hash = hash;
+	entry->width = width;
+	entry->font_size = g_font_size;
+	entry->text = g_strdup(text);
+	entry->layout = pango_layout_new(g_text_context);
+
+	pango_layout_set_font_description(entry->layout, g_font);
+	pango_layout_set_single_paragraph_mode(entry->layout, TRUE);
+
+	if (width >= 0) {
+		pango_layout_set_width(entry->layout, width * PANGO_SCALE);
+		pango_layout_set_ellipsize(entry->layout, PANGO_ELLIPSIZE_END);
+	}
+
+	pango_layout_set_text(entry->layout, text, -1);
+
+	return entry->layout;
+}
+
+// like cairo_show_text, with its baseline at the current point
+static void draw_text(cairo_t *cr, const char *text, int width)
+{
+	PangoLayout *layout = text_layout(text, width);
+	double x, y;
+
+	cairo_get_current_point(cr, &x, &y);
+	cairo_move_to(cr, x, y - (double)pango_layout_get_baseline(layout)
+		      / PANGO_SCALE);
+	pango_cairo_show_layout(cr, layout);
 }
 
+// the size of the inked part of some text
+static void text_extents(const char *text, double *width, double *height)
+{
+	PangoRectangle ink;
 
+	pango_layout_get_pixel_extents(text_layout(text, -1), &ink, NULL);
 
+	if (width)
+		*width = ink.width;
+	if (height)
+		*height = ink.height;
+}
 
 static void draw_rectangle (cairo_t *cr, double x, double y) {
 	cairo_rel_line_to (cr, x, 0);
@@ -2176,16 +7196,176 @@ static void draw_rectangle (cairo_t *cr, double x, double y) {
 	cairo_close_path (cr);
 }
 
+// rendering backends
+//
+// the calendar is drawn with nothing more than filled rects, horizontal
+// lines and single line text runs, so that's all a backend has to do.
+// cairo draws into the gtk window (and the benchmarks' offscreen surface),
+// sdl.c draws the same calls with SDL2
+//
+// backends may hold on to rects until the color changes or something
+// else is drawn, so whole runs of same colored rects cost one fill.
+// flush when done drawing
+struct render;
+
+struct render_ops {
+	void (*color)(struct render *, double r, double g, double b, double a);
+	void (*rect)(struct render *, double x, double y, double w, double h);
+	void (*hline)(struct render *, double x, double y, double w,
+		      double thickness, bool dash);
+	// baseline at y, ellipsized past width pixels, -1 for no limit
+	void (*text)(struct render *, double x, double y, const char *text,
+		     int width);
+	void (*clip)(struct render *, double x, double y, double w, double h);
+	void (*unclip)(struct render *);
+	void (*flush)(struct render *);
+};
+
+struct render {
+	const struct render_ops *ops;
+	cairo_t *cr;
+	void *data;
+
+	// the cairo backend's unfilled rects, all in color
+	int queued;
+	union rgba color;
+};
+
+static inline void render_color(struct render *r, double red, double green,
+				double blue, double alpha)
+{
+	r->ops->color(r, red, green, blue, alpha);
+}
+
+static inline void render_rect(struct render *r, double x, double y,
+			       double w, double h)
+{
+	r->ops->rect(r, x, y, w, h);
+}
+
+static inline void render_hline(struct render *r, double x, double y,
+				double w, double thickness, bool dash)
+{
+	r->ops->hline(r, x, y, w, thickness, dash);
+}
+
+static inline void render_text(struct render *r, double x, double y,
+			       const char *text, int width)
+{
+	r->ops->text(r, x, y, text, width);
+}
+
+static inline void render_clip(struct render *r, double x, double y,
+			       double w, double h)
+{
+	r->ops->clip(r, x, y, w, h);
+}
+
+static inline void render_unclip(struct render *r)
+{
+	r->ops->unclip(r);
+}
+
+static inline void render_flush(struct render *r)
+{
+	r->ops->flush(r);
+}
+
+static void cairo_render_flush(struct render *r)
+{
+	if (!r->queued)
+		return;
+
+	cairo_fill(r->cr);
+	r->queued = 0;
+}
+
+static void cairo_render_color(struct render *r, double red, double green,
+			       double blue, double alpha)
+{
+	union rgba c = {{ red, green, blue, alpha }};
+
+	if (r->queued && !memcmp(&c, &r->color, sizeof(c)))
+		return;
+
+	cairo_render_flush(r);
+	r->color = c;
+	cairo_set_source_rgba(r->cr, red, green, blue, alpha);
+}
+
+// the path is filled when the color changes or anything else is drawn
+static void cairo_render_rect(struct render *r, double x, double y,
+			      double w, double h)
+{
+	cairo_move_to(r->cr, x, y);
+	draw_rectangle(r->cr, w, h);
+	r->queued++;
+}
+
+static void cairo_render_hline(struct render *r, double x, double y,
+			       double w, double thickness, bool dash)
+{
+	cairo_render_flush(r);
+	cairo_set_line_width(r->cr, thickness);
+	cairo_set_dash(r->cr, dashed, dash ? 1 : 0, 0);
+	cairo_move_to(r->cr, x, y);
+	cairo_rel_line_to(r->cr, w, 0);
+	cairo_stroke(r->cr);
+	cairo_set_dash(r->cr, NULL, 0, 0);
+}
+
+static void cairo_render_text(struct render *r, double x, double y,
+			      const char *text, int width)
+{
+	cairo_render_flush(r);
+	cairo_move_to(r->cr, x, y);
+	draw_text(r->cr, text, width);
+}
+
+static void cairo_render_clip(struct render *r, double x, double y,
+			      double w, double h)
+{
+	cairo_render_flush(r);
+	cairo_save(r->cr);
+	cairo_rectangle(r->cr, x, y, w, h);
+	cairo_clip(r->cr);
+}
+
+static void cairo_render_unclip(struct render *r)
+{
+	cairo_render_flush(r);
+	cairo_restore(r->cr);
+}
+
+static const struct render_ops cairo_render_ops = {
+	.color = cairo_render_color,
+	.rect = cairo_render_rect,
+	.hline = cairo_render_hline,
+	.text = cairo_render_text,
+	.clip = cairo_render_clip,
+	.unclip = cairo_render_unclip,
+	.flush = cairo_render_flush,
+};
+
+static void render_cairo(struct render *r, cairo_t *cr)
+{
+	r->ops = &cairo_render_ops;
+	r->cr = cr;
+	r->data = NULL;
+	r->queued = 0;
+
+	cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+}
+
 
-static void draw_background (cairo_t *cr, int width, int height) {
-	cairo_set_source_rgb(cr, 0.3, 0.3, 0.3);
-	draw_rectangle(cr, width, height);
-	cairo_fill(cr);
+static void draw_background (struct render *r, struct cal *cal) {
+	render_color(r, 0.3, 0.3, 0.3, 1.0);
+	render_rect(r, cal->x, cal->y, cal->width, cal->height);
 }
 
 
 static void
-draw_hours (cairo_t *cr, struct cal* cal)
+draw_hours (struct render *r, struct cal* cal)
 {
 	double height = cal->height;
 	double width  = cal->width;
@@ -2194,44 +7374,38 @@ draw_hours (cairo_t *cr, struct cal* cal)
 	double section_height = (((double)height) / 48.0) * zoom;
 	char buffer[32] = {0};
 	const double col = 0.4;
-	cairo_set_source_rgb (cr, col, col, col);
+
+	// smooth scrolling leaves us part way into a section
+	long view_start = cal->start_at + cal->scroll;
+	long start_section = floor_div(view_start, 30 * 60);
+	double offset = (view_start - start_section * 30 * 60)
+		/ (30.0 * 60.0) * section_height;
 
 	// TODO: dynamic section subdivide on zoom?
-	for (int section = 0; section < 48; section++) {
-		int start_section = ((cal->start_at + cal->scroll) / 60 / 60) * 2;
-		int minutes = (start_section + section) * 30;
-		int onhour = ((minutes / 30) % 2) == 0;
-		int hour = (minutes / 60) % 24;
+	for (int section = 0; section <= 48; section++) {
+		long minutes = (start_section + section) * 30;
+		int onhour = floor_mod(minutes / 30, 2) == 0;
+		int hour = floor_mod(floor_div(minutes, 60), 24);
 		int onday = onhour && hour == 0;
 
 		if (section_height < 14 && !onhour)
 			continue;
 
-		double y = cal->y + ((double)section) * section_height;
-
-		cairo_set_line_width (cr, onday ? 4 : 1);
-		cairo_move_to (cr, cal->x, y);
-		cairo_rel_line_to (cr, width, 0);
+		double y = cal->y + ((double)section) * section_height - offset;
 
-		if (section % 2 == 0)
-			cairo_set_dash (cr, NULL, 0, 0);
-		else
-			cairo_set_dash (cr, dashed, 1, 0);
+		if (y < cal->y)
+			continue;
 
-		cairo_stroke(cr);
-		cairo_set_dash (cr, NULL, 0, 0);
+		render_color(r, col, col, col, 1.0);
+		render_hline(r, cal->x, y, width, onday ? 4 : 1, !onhour);
 
 		if (onhour) {
 			format_margin_time(buffer, 32, hour);
 			// TODO: text extents for proper time placement?
-			cairo_move_to(cr, g_lmargin - (g_margin_time_w + EVPAD),
-				      y+TXTPAD);
-			cairo_set_source_rgb (cr,
-						g_text_color.r,
-						g_text_color.g,
-						g_text_color.b);
-			cairo_show_text(cr, buffer);
-			cairo_set_source_rgb (cr, col, col, col);
+			render_color(r, g_text_color.r, g_text_color.g,
+				     g_text_color.b, 1.0);
+			render_text(r, g_lmargin - (g_margin_time_w + EVPAD),
+				    y+TXTPAD, buffer, -1);
 		}
 	}
 }
@@ -2276,20 +7450,114 @@ static void saturate(union rgba *c, double change)
 		   Pg * c->g + 
 		   Pb * c->b;
 
-	c->r += change * (L - c->r);
-	c->g += change * (L - c->g);
-	c->b += change * (L - c->b);
+	c->r += change * (L - c->r);
+	c->g += change * (L - c->g);
+	c->b += change * (L - c->b);
+}
+
+static double get_evheight(double evheight)
+{
+	return max(1.0, evheight - EVMARGIN);
+}
+
+// level of detail
+//
+// how much of an event we draw depends on how tall it is on screen.
+// events too small to see individually are added up into a density strip
+// instead, so a zoomed out busy day costs the same as a quiet one
+enum event_detail {
+	DETAIL_DENSITY,
+	DETAIL_BAR,
+	DETAIL_SUMMARY,
+	DETAIL_FULL,
+};
+
+static const double DETAIL_BAR_MIN = 3.0;
+
+static enum event_detail event_detail(struct cal *cal, double evheight)
+{
+	if (evheight >= cal->font_size * 2 + 4 + EVPAD)
+		return DETAIL_FULL;
+	else if (evheight >= cal->font_size + EVPAD)
+		return DETAIL_SUMMARY;
+	else if (evheight >= DETAIL_BAR_MIN)
+		return DETAIL_BAR;
+	return DETAIL_DENSITY;
+}
+
+struct density_row {
+	int count;
+	double r, g, b;
+};
+
+static struct density_row *g_density;
+static int g_density_size;
+
+static int density_begin(double top, double bottom)
+{
+	int rows = max(0, (int)ceil(bottom - top));
+
+	if (rows == 0)
+		return 0;
+
+	g_density = grow_array(g_density, &g_density_size, rows,
+			       sizeof(*g_density));
+	memset(g_density, 0, rows * sizeof(*g_density));
+
+	return rows;
+}
+
+static void density_add(struct event *ev, double top, int rows,
+			union rgba c)
+{
+	int first = max(0, (int)floor(ev->y - top));
+	int last = min(rows - 1, (int)ceil(ev->y + ev->height - top) - 1);
+
+	for (int i = first; i <= max(first, last) && i < rows; i++) {
+		g_density[i].count++;
+		g_density[i].r += c.r;
+		g_density[i].g += c.g;
+		g_density[i].b += c.b;
+	}
+}
+
+static bool density_row_same(struct density_row *a, struct density_row *b)
+{
+	return a->count == b->count && a->r == b->r && a->g == b->g &&
+		a->b == b->b;
 }
 
-static double get_evheight(double evheight)
+// one rectangle per run of identical rows, more overlap is more opaque
+static void density_draw(struct render *r, struct cal *cal, double top,
+			 int rows)
 {
-	return max(1.0, evheight - EVMARGIN);
+	struct density_row *row;
+	int i, end;
+
+	for (i = 0; i < rows; i = end) {
+		row = &g_density[i];
+
+		for (end = i + 1; end < rows; end++) {
+			if (!density_row_same(row, &g_density[end]))
+				break;
+		}
+
+		if (row->count == 0)
+			continue;
+
+		render_color(r, row->r / row->count,
+			     row->g / row->count,
+			     row->b / row->count,
+			     min(1.0, 0.4 + 0.15 * (row->count - 1)));
+		render_rect(r, cal->x, top + i, cal->width, end - i);
+	}
 }
 
 static void
-draw_event_summary(cairo_t *cr, struct cal *cal, time_t st, time_t et,
+draw_event_summary(struct render *r, struct cal *cal, time_t st, time_t et,
 		   int is_date, int is_selected, double height, const char *summary,
-		   struct event *sel, double x, double y, union rgba color)
+		   struct event *sel, double x, double y, union rgba color,
+		   enum event_detail detail)
 {
 	// TODO: event text color
 	static char buffer[1024] = {0};
@@ -2297,7 +7565,9 @@ draw_event_summary(cairo_t *cr, struct cal *cal, time_t st, time_t et,
 	static char bsmall2[32] = {0};
 	char *start_time;
 	char *end_time;
+	char *text;
 	time_t len = et - st;
+	gint64 trace = trace_begin();
 
 	//desaturate(&color, 0.8);
 	double c = 0.9;
@@ -2305,21 +7575,37 @@ draw_event_summary(cairo_t *cr, struct cal *cal, time_t st, time_t et,
 	color.g = c;
 	color.b = c;
 
-	cairo_text_extents_t exts;
+	double text_height;
+	int text_width = cal->width - EVPAD * 2;
 
 	int is_editing = is_selected && (cal->flags & CAL_CHANGING);
+	const char *label = is_editing ? edit_field_labels[cal->edit_field] : "";
 
-	summary = is_editing ? g_editbuf : summary;
+	summary = is_editing ? edit_buffer_text(true) : summary;
 
-	cairo_set_source_rgb(cr, color.r, color.g, color.b);
+	// the edit buffer can be any length, so no fixed buffer for it
+	text = g_strdup_printf((is_date ? is_selected : is_editing)
+			       ? "%s'%s'" : "%s%s", label, summary);
+
+	render_color(r, color.r, color.g, color.b, 1.0);
 
 	if (is_date) {
-		sprintf(buffer, is_selected ? "'%s'" : "%s", summary);
-		cairo_text_extents(cr, buffer, &exts);
-		cairo_move_to(cr, x + EVPAD, y + (height / 2.0)
-						+ ((double)exts.height / 2.0));
-		cairo_show_text(cr, buffer);
+		text_extents(text, NULL, &text_height);
+		render_text(r, x + EVPAD, y + (height / 2.0)
+					  + (text_height / 2.0),
+			    text, text_width);
+
+		g_free(text);
+		trace_end(TRACE_DRAW_EVENT_SUMMARY, trace);
+		return;
+	}
 
+	// just the summary, without measuring it or formatting any times
+	if (detail < DETAIL_FULL) {
+		render_text(r, x + EVPAD, y + TXTPAD + EVPAD, text, text_width);
+
+		g_free(text);
+		trace_end(TRACE_DRAW_EVENT_SUMMARY, trace);
 		return;
 	}
 
@@ -2344,13 +7630,12 @@ draw_event_summary(cairo_t *cr, struct cal *cal, time_t st, time_t et,
 	format_time_duration(duration_format_out,
 			     sizeof(duration_format), out);
 
-	sprintf(buffer, is_editing ? "'%s'" : "%s", summary);
-	cairo_text_extents(cr, buffer, &exts);
-	double ey = height < exts.height
+	text_extents(text, NULL, &text_height);
+	double ey = height < text_height
 		? y + TXTPAD - EVPAD
 		: y + TXTPAD + EVPAD;
-	cairo_move_to(cr, x + EVPAD, ey);
-	cairo_show_text(cr, buffer);
+	render_text(r, x + EVPAD, ey, text, text_width);
+	g_free(text);
 
 	if (out >= 0 && in >= 0 && out < len) {
 		sprintf(buffer, "%s-%s +%s-%s %s", start_time, end_time,
@@ -2362,36 +7647,44 @@ draw_event_summary(cairo_t *cr, struct cal *cal, time_t st, time_t et,
 		sprintf(buffer, "%s-%s %s", start_time, end_time, duration_format);
 	}
 
-	ey += exts.height + 4;
+	ey += text_height + 4;
 
 	double tadj = 0.8;
-	cairo_move_to(cr, x + EVPAD, ey);
-	cairo_set_source_rgb(cr, color.r * tadj, color.g * tadj, color.b * tadj);
-	cairo_show_text(cr, buffer);
+	render_color(r, color.r * tadj, color.g * tadj, color.b * tadj, 1.0);
+	render_text(r, x + EVPAD, ey, buffer, text_width);
+
+	trace_end(TRACE_DRAW_EVENT_SUMMARY, trace);
 }
 
+// an event's rect, worked out before anything is drawn. draw_events fills
+// them grouped by color, then draws all the text over the top
+struct event_fill {
+	struct event *ev;
+	union rgba color;
+	double y, height;
+	time_t st, et;
+	int dragging;
+	int order;
+};
+
+static struct event_fill *g_fills;
+static int g_fills_size;
+
 static void
-draw_event (cairo_t *cr, struct cal *cal, struct event *ev,
-	    struct event *sel, struct event *target)
+event_fill (struct cal *cal, struct event *ev, struct event *sel,
+	    struct event *target, struct event_fill *fill)
 {
 	union rgba c = ev->ical->color;
 	desaturate(&c, 0.4);
 
 	int is_locked = ev->flags & EV_IMMOVABLE;
 	int is_dragging = target == ev && (cal->flags & CAL_DRAGGING);
-	int is_selected = sel == ev;
-	icaltimetype dtstart =
-		icalcomponent_get_dtstart(ev->vevent);
+	int is_selected = sel == ev || event_in_selection(cal, ev);
 
 	time_t st, et;
-	vevent_span_timet(ev->vevent, &st, &et);
+	vevent_span_timet(ev->ical, ev->vevent, &st, &et);
 
-	double x = ev->x;
 	double y = ev->y;
-	double evheight = get_evheight(ev->height);
-
-	const char *summary =
-		icalcomponent_get_summary(ev->vevent);
 
 	if (is_dragging || ev->flags & EV_HIGHLIGHTED) {
 		c.a *= 0.95;
@@ -2412,50 +7705,84 @@ draw_event (cairo_t *cr, struct cal *cal, struct event *ev,
 
 	/* y -= EVMARGIN; */
 
-	cairo_move_to(cr, x, y);
-
 	// TODO: selected event rendering
 	if (is_selected)
 		c.r *= 0.8;
 
-	cairo_set_source_rgba(cr, c.r, c.g, c.b, c.a);
-	draw_rectangle(cr, ev->width, evheight);
-	cairo_fill(cr);
-	draw_event_summary(cr, cal, st, et, dtstart.is_date, is_selected,
-			   evheight, summary, sel, x, y, ev->ical->color);
+	fill->ev = ev;
+	fill->color = c;
+	fill->y = y;
+	fill->height = get_evheight(ev->height);
+	fill->st = st;
+	fill->et = et;
+	fill->dragging = is_dragging;
+}
+
+// same colors together, the dragged event on top of everything
+static int cmp_event_fill(const void *a, const void *b)
+{
+	const struct event_fill *fa = a;
+	const struct event_fill *fb = b;
+	int c;
+
+	if (fa->dragging != fb->dragging)
+		return fa->dragging - fb->dragging;
+
+	c = memcmp(&fa->color, &fb->color, sizeof(fa->color));
+	if (c != 0)
+		return c;
+
+	return fa->order - fb->order;
+}
+
+static void
+draw_event_text (struct render *r, struct cal *cal, struct event_fill *fill,
+		 struct event *sel)
+{
+	struct event *ev = fill->ev;
+	int is_selected = sel == ev;
+	icaltimetype dtstart =
+		icalcomponent_get_dtstart(ev->vevent);
+	enum event_detail detail;
+
+	const char *summary =
+		icalcomponent_get_summary(ev->vevent);
+
+	// the selection always gets its text
+	detail = dtstart.is_date || is_selected ? DETAIL_FULL
+		: event_detail(cal, fill->height);
+
+	if (detail >= DETAIL_SUMMARY)
+		draw_event_summary(r, cal, fill->st, fill->et, dtstart.is_date,
+				   is_selected, fill->height, summary, sel,
+				   ev->x, fill->y, ev->ical->color, detail);
 }
 
 
 static inline void
-draw_line (cairo_t *cr, double x, double y, double w) {
-	cairo_move_to(cr, x, y + 0.5);
-	cairo_rel_line_to(cr, w, 0);
+draw_line (struct render *r, double x, double y, double w) {
+	render_hline(r, x, y + 0.5, w, 1.0, false);
 }
 
 
 
 static void
-draw_time_line(cairo_t *cr, struct cal *cal, time_t time) {
+draw_time_line(struct render *r, struct cal *cal, time_t time) {
 	double y = calendar_time_to_loc_absolute(cal, time);
 	int w = cal->width;
 
-	cairo_set_line_width(cr, 1.0);
-
-	cairo_set_source_rgb (cr, 1.0, 0, 0);
-	draw_line(cr, cal->x, y - 1, w);
-	cairo_stroke(cr);
+	render_color(r, 1.0, 0, 0, 1.0);
+	draw_line(r, cal->x, y - 1, w);
 
-	/* cairo_set_source_rgb (cr, 1.0, 1.0, 1.0); */
-	/* draw_line(cr, cal->x, y, w); */
-	/* cairo_stroke(cr); */
+	/* render_color(r, 1.0, 1.0, 1.0, 1.0); */
+	/* draw_line(r, cal->x, y, w); */
 
-	/* cairo_set_source_rgb (cr, 0, 0, 0); */
-	/* draw_line(cr, cal->x, y + 1, w); */
-	/* cairo_stroke(cr); */
+	/* render_color(r, 0, 0, 0, 1.0); */
+	/* draw_line(r, cal->x, y + 1, w); */
 }
 
 static void
-draw_selection (cairo_t *cr, struct cal *cal)
+draw_selection (struct render *r, struct cal *cal)
 {
 	static const char *summary = "Selection";
 	static const int is_selected = 0;
@@ -2465,42 +7792,34 @@ draw_selection (cairo_t *cr, struct cal *cal)
 	time_t et = get_selection_end(cal);
 	double height = calendar_time_to_loc_absolute(cal, et) - sy;
 
-	cairo_move_to(cr, sx, sy);
-
-	cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 0.4);
-	draw_rectangle(cr, cal->width, height);
-	cairo_fill(cr);
-	draw_event_summary(cr, cal, cal->current, et, is_date, is_selected,
-			   height, summary, NULL, sx, sy, ((union rgba){ 0.1, 0.1, 0.1, 1.0 }));
+	render_color(r, 1.0, 1.0, 1.0, 0.4);
+	render_rect(r, sx, sy, cal->width, height);
+	draw_event_summary(r, cal, cal->current, et, is_date, is_selected,
+			   height, summary, NULL, sx, sy, ((union rgba){ 0.1, 0.1, 0.1, 1.0 }),
+			   DETAIL_FULL);
 
 }
 
-static void draw_current_minute(cairo_t *cr, struct cal *cal)
+static void draw_current_minute(struct render *r, struct cal *cal)
 {
 	char buffer[32] = {0};
 	time_t now;
 	time(&now);
 
 	double y = calendar_time_to_loc_absolute(cal, now);
-	const double col = 0.4; // TODO: duplication from draw_hours
-
 	int min = get_minute(now);
 
 	format_margin_time(buffer, 32, min);
 
-	cairo_set_source_rgb (cr, 1.0, 0, 0);
-
-	cairo_move_to(cr, g_lmargin - (g_margin_time_w + EVPAD),
-		      y+(TXTPAD/2.0)-2.0);
-
-	cairo_show_text(cr, buffer);
-	cairo_set_source_rgb (cr, col, col, col);
+	render_color(r, 1.0, 0, 0, 1.0);
+	render_text(r, g_lmargin - (g_margin_time_w + EVPAD),
+		    y+(TXTPAD/2.0)-2.0, buffer, -1);
 }
 
 // draw until-next ephemeral event. This even appears when you have no
 // event but an upcoming event. It allows you to see how much time is left
 // until the next one, etc
-static void draw_ephemeral_event(cairo_t *cr, struct cal *cal)
+static void draw_ephemeral_event(struct render *r, struct cal *cal)
 {
 	static const char *summary = "Until Next";
 	struct event *ev;
@@ -2520,7 +7839,7 @@ static void draw_ephemeral_event(cairo_t *cr, struct cal *cal)
 		return;
 
 	ev = &cal->events[ind];
-	vevent_span_timet(ev->vevent, &et, NULL);
+	vevent_span_timet(ev->ical, ev->vevent, &et, NULL);
 	ind = query_span(cal, ind, st, et, 0, 0);
 
 	// something is already here
@@ -2533,162 +7852,584 @@ static void draw_ephemeral_event(cairo_t *cr, struct cal *cal)
 
 	height = calendar_time_to_loc_absolute(cal, et) - sy;
 
-	cairo_move_to(cr, sx, sy);
-
-	cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 0.2);
-	draw_rectangle(cr, cal->width, height);
-	cairo_fill(cr);
-	draw_event_summary(cr, cal, st, et, is_date, is_selected,
-			   height, summary, NULL, sx, sy, ((union rgba){ 0.1, 0.1, 0.1, 1.0 }));
+	render_color(r, 1.0, 1.0, 1.0, 0.2);
+	render_rect(r, sx, sy, cal->width, height);
+	draw_event_summary(r, cal, st, et, is_date, is_selected,
+			   height, summary, NULL, sx, sy, ((union rgba){ 0.1, 0.1, 0.1, 1.0 }),
+			   DETAIL_FULL);
 }
 
-static int
-draw_calendar (cairo_t *cr, struct cal *cal) {
-	int i, width, height;
-	time_t now;
-	width = cal->width;
-	height = cal->height;
+enum draw_events {
+	DRAW_TIMED = 1 << 0,
+	DRAW_DATES = 1 << 1,
+};
 
-	cairo_move_to(cr, cal->x, cal->y);
-	draw_background(cr, width, height);
-	draw_hours(cr, cal);
-	draw_current_minute(cr, cal);
+// draws the events that are at least partly between top and bottom
+static void
+draw_events (struct render *r, struct cal *cal, double top, double bottom,
+	     int which)
+{
+	struct event *selected = get_selected_event(cal);
+	struct event *target = get_target(cal);
+	struct event_fill *fill;
+	int i, kind, rows = 0, nfills = 0;
+	union rgba c;
 
-	struct event *selected =
-		get_selected_event(cal);
+	if (which & DRAW_TIMED)
+		rows = density_begin(top, bottom);
 
-	// draw calendar events
 	for (i = 0; i < cal->nevents; ++i) {
 		struct event *ev = &cal->events[i];
-		if (ev->ical->visible)
-			draw_event(cr, cal, ev, selected, get_target(cal));
+
+		// the drag target isn't where its layout says
+		if (ev != target &&
+		    (ev->y + ev->height < top || ev->y > bottom))
+			continue;
+
+		kind = icalcomponent_get_dtstart(ev->vevent).is_date ?
+			DRAW_DATES : DRAW_TIMED;
+		if (!(which & kind))
+			continue;
+
+		if (kind == DRAW_TIMED && ev != target && ev != selected &&
+		    event_detail(cal, get_evheight(ev->height)) == DETAIL_DENSITY) {
+			c = ev->ical->color;
+			desaturate(&c, 0.4);
+			density_add(ev, top, rows, c);
+			continue;
+		}
+
+		g_fills = grow_array(g_fills, &g_fills_size, nfills + 1,
+				     sizeof(*g_fills));
+		fill = &g_fills[nfills];
+		event_fill(cal, ev, selected, target, fill);
+		fill->order = nfills++;
+	}
+
+	qsort(g_fills, nfills, sizeof(*g_fills), cmp_event_fill);
+
+	for (i = 0; i < nfills; i++) {
+		fill = &g_fills[i];
+		render_color(r, fill->color.r, fill->color.g, fill->color.b,
+			     fill->color.a);
+		render_rect(r, fill->ev->x, fill->y, fill->ev->width,
+			    fill->height);
 	}
 
-	draw_ephemeral_event(cr, cal);
+	if (which & DRAW_TIMED)
+		density_draw(r, cal, top, rows);
+
+	for (i = 0; i < nfills; i++)
+		draw_event_text(r, cal, &g_fills[i], selected);
+}
+
+static void draw_search_prompt(struct render *r, struct cal *cal)
+{
+	char *buffer = g_strconcat("/", edit_buffer_text(true), NULL);
+	double line_height = cal->font_size + 2;
+	double y = cal->y + cal->height - line_height - EVPAD * 2;
+
+	render_color(r, 0.0, 0.0, 0.0, 0.75);
+	render_rect(r, cal->x, y, cal->width, line_height + EVPAD * 2);
+
+	render_color(r, 0.9, 0.9, 0.9, 1.0);
+	render_text(r, cal->x + EVPAD, y + line_height, buffer, -1);
+	g_free(buffer);
+}
+
+static int
+draw_calendar (struct render *r, struct cal *cal) {
+	time_t now;
+	gint64 trace = trace_begin();
+
+	draw_background(r, cal);
+	draw_hours(r, cal);
+	draw_current_minute(r, cal);
+
+	draw_events(r, cal, 0, cal->y + cal->height, DRAW_TIMED | DRAW_DATES);
+
+	draw_ephemeral_event(r, cal);
 
 	if (cal->selected_event_ind == -1)
-		draw_selection(cr, cal);
+		draw_selection(r, cal);
+
+	draw_time_line(r, cal, time(&now));
+
+	if (cal->flags & CAL_SEARCHING)
+		draw_search_prompt(r, cal);
 
-	draw_time_line(cr, cal, time(&now));
+	render_flush(r);
+
+	trace_end(TRACE_DRAW_CALENDAR, trace);
 
 	return 1;
 }
 
-static gboolean
-on_draw_event(GtkWidget *widget, cairo_t *cr, gpointer user_data)
+static int cmp_gint64(const void *a, const void *b)
 {
-	int width, height;
-	struct extra_data *data = (struct extra_data*) user_data;
-	struct cal *cal = data->cal;
+	gint64 ia = *(const gint64*)a;
+	gint64 ib = *(const gint64*)b;
+	return (ia > ib) - (ia < ib);
+}
+
+// frame time percentiles and the last frame's hot path totals
+static void draw_trace_overlay(struct render *r, struct cal *cal)
+{
+	gint64 frames[TRACE_FRAMES];
+	char buffer[128];
+	int i, n, lines = TRACE_POINTS + 1;
+	double line_height = cal->font_size + 2;
+	double w = 34 * cal->font_size * 0.6;
+	double x = cal->x + cal->width - w - EVPAD;
+	double y = cal->y + EVPAD;
+
+	n = min(g_nframe_times, TRACE_FRAMES);
+	memcpy(frames, g_frame_times, n * sizeof(*frames));
+	qsort(frames, n, sizeof(*frames), cmp_gint64);
+
+	render_color(r, 0.0, 0.0, 0.0, 0.75);
+	render_rect(r, x, y, w, lines * line_height + EVPAD * 2);
+
+	render_color(r, 0.9, 0.9, 0.9, 1.0);
+	y += line_height;
+
+	if (n > 0)
+		snprintf(buffer, sizeof(buffer),
+			 "frame p50 %.2fms p95 %.2fms p99 %.2fms",
+			 frames[n/2] / 1000.0,
+			 frames[n*95/100] / 1000.0,
+			 frames[n*99/100] / 1000.0);
+	else
+		snprintf(buffer, sizeof(buffer), "frame -");
+
+	render_text(r, x + EVPAD, y, buffer, -1);
+
+	for (i = 0; i < TRACE_POINTS; i++) {
+		y += line_height;
+		snprintf(buffer, sizeof(buffer), "%s %.2fms (%d)",
+			 trace_names[i], g_trace_last[i].total / 1000.0,
+			 g_trace_last[i].count);
+		render_text(r, x + EVPAD, y, buffer, -1);
+	}
+
+	render_flush(r);
+}
+
+
+// font setup and sizing for a surface of the given size. shared with the
+// offscreen benchmarks and the sdl backend so they all lay out the same
+static void
+calendar_prepare_draw(struct cal *cal, int width, int height)
+{
+	text_set_font(cal->font_size);
 
 	if (!margin_calculated) {
 		char buffer[32];
-		cairo_text_extents_t exts;
+		double width;
 
 		format_margin_time(buffer, 32, 23);
-		cairo_text_extents(cr, buffer, &exts);
-		g_margin_time_w = exts.width;
+		text_extents(buffer, &width, NULL);
+		g_margin_time_w = width;
 		g_lmargin = g_margin_time_w + EVPAD*2;
 
 		margin_calculated = 1;
 	}
 
-	cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
-	cairo_set_font_size(cr, cal->font_size);
-	cairo_select_font_face(cr,
-				"terminus",
-				CAIRO_FONT_SLANT_NORMAL,
-				CAIRO_FONT_WEIGHT_NORMAL);
-
-	gtk_window_get_size(data->win, &width, &height);
-
 	cal->y = cal->gutter_height;
 
 	cal->width = width - cal->x;
 	cal->height = height - cal->y;
+}
+
+static const double LAYER_MARGIN = 0.5;
+
+// the timed events laid out for the current view, with LAYER_MARGIN
+// views of margin above and below
+static void view_layer_render(cairo_t *cr, struct cal *cal)
+{
+	struct view_anim *anim = &cal->anim;
+	double margin = cal->height * LAYER_MARGIN;
+	int width = cal->x + cal->width;
+	int height = cal->y + cal->height + margin * 2;
+	struct render r;
+	cairo_t *lcr;
 
 	update_calendar(cal);
-	draw_calendar(cr, cal);
+
+	if (anim->layer && (anim->layer_width != width ||
+			    anim->layer_height != height)) {
+		cairo_surface_destroy(anim->layer);
+		anim->layer = NULL;
+	}
+
+	if (!anim->layer) {
+		anim->layer =
+			cairo_surface_create_similar(cairo_get_target(cr),
+						     CAIRO_CONTENT_COLOR_ALPHA,
+						     width, height);
+		anim->layer_width = width;
+		anim->layer_height = height;
+	}
+
+	lcr = cairo_create(anim->layer);
+	cairo_set_operator(lcr, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(lcr);
+	cairo_set_operator(lcr, CAIRO_OPERATOR_OVER);
+
+	render_cairo(&r, lcr);
+	calendar_prepare_draw(cal, width, cal->y + cal->height);
+	cairo_translate(lcr, 0, margin);
+	draw_events(&r, cal, cal->y - margin, cal->y + cal->height + margin,
+		    DRAW_TIMED);
+	render_flush(&r);
+	cairo_destroy(lcr);
+
+	anim->layer_start = calendar_view_start(cal);
+	anim->layer_zoom = cal->zoom;
+}
+
+// where the layer's layout lands in the current view
+static void view_layer_transform(struct cal *cal, double *dy, double *scale)
+{
+	struct view_anim *anim = &cal->anim;
+
+	*scale = cal->zoom / anim->layer_zoom;
+	*dy = (double)(anim->layer_start - calendar_view_start(cal))
+		/ DAY_SECONDS * cal->zoom * cal->height;
+}
+
+static bool view_layer_stale(struct cal *cal)
+{
+	double dy, scale, top, bottom;
+	double margin = cal->height * LAYER_MARGIN;
+
+	if (!cal->anim.layer ||
+	    cal->anim.layer_width != cal->x + cal->width)
+		return true;
+
+	view_layer_transform(cal, &dy, &scale);
+
+	// scaling the layer too far gets blurry
+	if (scale < 0.75 || scale > 1.5)
+		return true;
+
+	top = cal->y + dy - scale * (cal->y + margin);
+	bottom = cal->y + dy + scale * (cal->height + margin);
+
+	return top > cal->y || bottom < cal->y + cal->height;
+}
+
+// a frame while scrolling or zooming, see struct view_anim
+static void draw_calendar_animated(struct render *r, struct cal *cal)
+{
+	cairo_t *cr = r->cr;
+	struct view_anim *anim = &cal->anim;
+	double dy, scale;
+	double margin = cal->height * LAYER_MARGIN;
+	time_t now;
+	gint64 trace = trace_begin();
+
+	if (view_layer_stale(cal))
+		view_layer_render(cr, cal);
+
+	view_layer_transform(cal, &dy, &scale);
+
+	draw_background(r, cal);
+	draw_hours(r, cal);
+	draw_current_minute(r, cal);
+
+	render_clip(r, 0, cal->y, cal->x + cal->width, cal->height);
+	cairo_translate(cr, 0, cal->y + dy);
+	cairo_scale(cr, 1.0, scale);
+	cairo_set_source_surface(cr, anim->layer, 0, -(cal->y + margin));
+	cairo_paint(cr);
+	render_unclip(r);
+
+	draw_events(r, cal, 0, cal->y, DRAW_DATES);
+	draw_ephemeral_event(r, cal);
+
+	if (cal->selected_event_ind == -1)
+		draw_selection(r, cal);
+
+	draw_time_line(r, cal, time(&now));
+
+	if (cal->flags & CAL_SEARCHING)
+		draw_search_prompt(r, cal);
+
+	render_flush(r);
+
+	trace_end(TRACE_DRAW_CALENDAR, trace);
+}
+
+// redraw wakeups
+//
+// nothing on screen moves by itself except what depends on the clock, so
+// instead of polling we work out when that next changes and sleep until
+// then. each draw arms the timer again, so a hidden window that doesn't
+// draw stops waking up at all
+
+static void span_next_change(time_t now, time_t st, time_t et,
+			     bool durations, time_t *next)
+{
+	if (st > now)
+		*next = min(*next, st);
+	if (et > now)
+		*next = min(*next, et);
+
+	// durations count seconds in their first and last minute, see
+	// format_time_duration
+	if (durations && ((now >= st && now - st < 60) ||
+			  (et > now && et - now <= 60)))
+		*next = min(*next, now + 1);
+}
+
+// the clock in the margin and the time line move every minute. events
+// starting or ending change the until next event and the in/out times
+static time_t calendar_next_change(struct cal *cal, time_t now)
+{
+	struct event *ev, *selected = get_selected_event(cal);
+	time_t st, et, next = now - floor_mod(now, 60) + 60;
+	bool durations;
+
+	for (int i = 0; i < cal->nevents; i++) {
+		ev = &cal->events[i];
+		vevent_span_timet(ev->ical, ev->vevent, &st, &et);
+		durations = ev == selected ||
+			event_detail(cal, get_evheight(ev->height)) == DETAIL_FULL;
+		span_next_change(now, st, et, durations, &next);
+	}
+
+	if (cal->selected_event_ind == -1)
+		span_next_change(now, cal->current, get_selection_end(cal),
+				 true, &next);
+
+	return next;
+}
+
+static gboolean redraw_timer_handler(gpointer user_data) {
+	struct cal *cal = (struct cal*)user_data;
+
+	cal->redraw_timer = 0;
+	calendar_queue_draw(cal);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void calendar_cancel_redraw(struct cal *cal)
+{
+	if (cal->redraw_timer)
+		g_source_remove(cal->redraw_timer);
+	cal->redraw_timer = 0;
+}
+
+// called after each draw
+static void calendar_schedule_redraw(struct cal *cal)
+{
+	gint64 now = g_get_real_time();
+	time_t at = calendar_next_change(cal, now / G_USEC_PER_SEC);
+	gint64 wait = (at * G_USEC_PER_SEC - now) / 1000 + 1;
+
+	if (cal->redraw_timer && cal->redraw_at == at)
+		return;
+
+	calendar_cancel_redraw(cal);
+	cal->redraw_at = at;
+	cal->redraw_timer = g_timeout_add(max(wait, 1), redraw_timer_handler,
+					  cal);
+}
+
+static gboolean
+on_draw_event(GtkWidget *widget, cairo_t *cr, gpointer user_data)
+{
+	int width, height;
+	struct extra_data *data = (struct extra_data*) user_data;
+	struct cal *cal = data->cal;
+	struct render r;
+
+	gtk_window_get_size(data->win, &width, &height);
+
+	gint64 trace = trace_begin();
+
+	render_cairo(&r, cr);
+	calendar_prepare_draw(cal, width, height);
+
+	if (cal->anim.tick && !(cal->flags & CAL_DRAGGING))
+		draw_calendar_animated(&r, cal);
+	else {
+		update_calendar(cal);
+		draw_calendar(&r, cal);
+	}
+
+	trace_end(TRACE_FRAME, trace);
+
+	if (g_trace_overlay)
+		draw_trace_overlay(&r, cal);
+
+	// animating draws every frame anyway, the last one schedules
+	if (!cal->anim.tick)
+		calendar_schedule_redraw(cal);
 
 	return FALSE;
 }
 
 
 void usage() {
-	printf("usage: viscal <calendar.ics ...>\n");
+	printf("usage: viscal [--freebusy FROM TO [--json]] <calendar.ics ...>\n"
+	       "\n"
+	       "  --freebusy FROM TO  print the busy time from day FROM through\n"
+	       "                      day TO (YYYY-MM-DD) as a VFREEBUSY and exit\n"
+	       "  --json              print it as json instead\n");
 	exit(1);
 }
 
+// local midnight starting YYYY-MM-DD
+static int parse_day(const char *str, time_t *t)
+{
+	long year;
+	unsigned month, day;
+
+	if (sscanf(str, "%ld-%u-%u", &year, &month, &day) != 3 ||
+	    month < 1 || month > 12 || day < 1 || day > 31)
+		return 0;
+
+	*t = days_from_civil(year, month, day) * DAY_SECONDS;
+	*t -= tz_offset(*t, NULL);
+	return 1;
+}
+
 static inline double rand_0to1() {
 	return (double) rand() / RAND_MAX;
 }
 
-static gboolean redraw_timer_handler(struct extra_data *data) {
-	gtk_widget_queue_draw(data->cal->widget);
-	return 1;
+static gboolean
+on_window_state(GtkWidget *widget, GdkEventWindowState *ev, gpointer user_data)
+{
+	struct extra_data *data = (struct extra_data*)user_data;
+	GdkWindowState hidden =
+		GDK_WINDOW_STATE_ICONIFIED | GDK_WINDOW_STATE_WITHDRAWN;
+
+	// the draw when we're shown again arms the timer
+	if (ev->new_window_state & hidden)
+		calendar_cancel_redraw(data->cal);
+	else if (ev->changed_mask & hidden)
+		calendar_queue_draw(data->cal);
+
+	return FALSE;
 }
 
 
-int main(int argc, char *argv[])
+// everything up to opening a window, shared by both frontends
+static void calendar_startup(struct cal *cal, int argc, char *argv[])
 {
-	GtkWidget *window;
-	GtkWidget *darea;
-	GdkDisplay *display;
-	GdkRGBA color;
-	char buffer[32];
 	double text_col = 0.6;
 	struct ical *ical;
 	union rgba defcol;
+	time_t fb_from = 0, fb_to = 0;
+	int json = 0;
 
 	defcol.r = 106.0 / 255.0;
 	defcol.g = 219.0 / 255.0;
 	defcol.b = 219.0 / 255.0;
 	defcol.a = 1.0;
 
-	struct cal cal;
+	log_init();
+	calendar_create(cal);
+
+	srand(42);
+
+	// events are converted with these as they're loaded
+	timezones_init();
+	cal->tz = g_cal_tz;
+	print_timezone(g_cal_tz);
 
-	calendar_create(&cal);
+	// options come before the calendars
+	while (argc > 1 && !strncmp(argv[1], "--", 2)) {
+		if (!strcmp(argv[1], "--freebusy") && argc > 3 &&
+		    parse_day(argv[2], &fb_from) && parse_day(argv[3], &fb_to)) {
+			argc -= 3;
+			argv += 3;
+		} else if (!strcmp(argv[1], "--json")) {
+			json = 1;
+			argc--;
+			argv++;
+		} else {
+			usage();
+		}
+	}
 
 	if (argc < 2)
 		usage();
 
-	srand(42);
+	if (calendars_load(cal, &argv[1], argc - 1) != argc - 1)
+		log_warn("failed to load some calendars");
 
-	for (int i = 1; i < argc; i++) {
-		printf("loading calendar %s\n", argv[i]);
-		ical = calendar_load_ical(&cal, argv[i]);
-		ical->source = SOURCE_FILE;
-		ical->source_location = argv[i];
+	for (int i = 0; i < cal->ncalendars; i++) {
+		ical = &cal->calendars[i];
 
 		// TODO: configure colors from cli?
-		if (ical != NULL) {
-			ical->color = defcol;
-			ical->color.r = 1.0;
-			ical->color.g = 0.0;
-			ical->color.b = 1.0;
-			ical->color.a = 0.9;
-
-			//saturate(&ical->color, 0.35);
-		}
-		else {
-			printf("failed to load calendar\n");
-		}
+		ical->color = defcol;
+		ical->color.r = 1.0;
+		ical->color.g = 0.0;
+		ical->color.b = 1.0;
+		ical->color.a = 0.9;
+
+		//saturate(&ical->color, 0.35);
 	}
 
 
-	on_change_view(&cal);
-	//select_closest_to_now(&cal);
+	on_change_view(cal);
+	//select_closest_to_now(cal);
+
+	if (fb_to) {
+		// through the end of the last day, however long it is
+		fb_to = local_day_start(fb_to + DAY_SECONDS + DAY_SECONDS / 2);
+		export_freebusy(cal, stdout, fb_from, fb_to, json);
+		log_flush();
+		exit(0);
+	}
 
-	// TODO: get system timezone
-	g_cal_tz = cal.tz = icaltimezone_get_builtin_timezone("America/Vancouver");
-	tz_utc = icaltimezone_get_builtin_timezone("UTC");
+	g_tracing = getenv("VISCAL_TRACE") != NULL;
 
-	print_timezone(g_cal_tz);
-	print_timezone(tz_utc);
+	bindings_init();
+
+#ifdef VISCAL_LUA
+	// after the bindings, so scripts can replace them
+	script_init(cal);
+#endif
 
 	g_text_color.r = text_col;
 	g_text_color.g = text_col;
 	g_text_color.b = text_col;
+}
+
+
+// on the way out, shared by both frontends
+static void calendar_shutdown(struct cal *cal)
+{
+#ifdef VISCAL_CALDAV
+	// uploads that didn't happen yet go out next time
+	for (int i = 0; i < cal->ncalendars; i++) {
+		if (cal->calendars[i].caldav)
+			caldav_flush(cal->calendars[i].caldav);
+	}
+#endif
+
+	log_flush();
+}
+
+
+// bench.c and sdl.c include this file and bring their own main
+#ifndef VISCAL_NO_MAIN
+int main(int argc, char *argv[])
+{
+	GtkWidget *window;
+	GtkWidget *darea;
+	GdkDisplay *display;
+	GdkRGBA color;
+	char buffer[32];
+	struct cal cal;
+
+	calendar_startup(&cal, argc, argv);
 
 	color.red = BGCOLOR;
 	color.green = BGCOLOR;
@@ -2717,10 +8458,6 @@ int main(int argc, char *argv[])
 	cursor_pointer = gdk_cursor_new_from_name (display, "pointer");
 	cursor_default = gdk_cursor_new_from_name (display, "default");
 
-	// redraw timer
-	g_timeout_add(500, (GSourceFunc)redraw_timer_handler,
-		      (gpointer)&extra_data);
-
 	g_signal_connect(G_OBJECT(darea), "button-press-event",
 			G_CALLBACK(on_press), (gpointer)&extra_data);
 
@@ -2739,6 +8476,9 @@ int main(int argc, char *argv[])
 	g_signal_connect(G_OBJECT(darea), "draw",
 			G_CALLBACK(on_draw_event), (gpointer)&extra_data);
 
+	g_signal_connect(window, "window-state-event",
+			 G_CALLBACK(on_window_state), (gpointer)&extra_data);
+
 	g_signal_connect(window, "destroy",
 			 G_CALLBACK(gtk_main_quit), NULL);
 
@@ -2759,6 +8499,8 @@ int main(int argc, char *argv[])
 	gtk_widget_show_all(window);
 
 	gtk_main();
+	calendar_shutdown(&cal);
 
 	return 0;
 }
+#endif